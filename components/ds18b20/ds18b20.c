@@ -77,11 +77,11 @@ unsigned char ds18b20_RST_PULSE(void){
   if(gpio_get_level(DS_GPIO)==1) PRESENCE=1; else PRESENCE=0;
   return PRESENCE;
 }
-// Returns temperature from sensor
-float ds18b20_get_temp(void) {
+// Returns raw temperature from sensor, in 1/16 degrees C
+int ds18b20_get_temp_raw(void) {
   if(init==1){
     unsigned char check;
-    char temp1=0, temp2=0;
+    unsigned char temp1=0, temp2=0;
       check=ds18b20_RST_PULSE();
       if(check==1)
       {
@@ -94,15 +94,17 @@ float ds18b20_get_temp(void) {
         temp1=ds18b20_read_byte();
         temp2=ds18b20_read_byte();
         check=ds18b20_RST_PULSE();
-        float temp=0;
-        temp=(float)(temp1+(temp2*256))/16;
-        return temp;
+        return (short)((temp2<<8)|temp1);
       }
       else{return 0;}
 
   }
   else{return 0;}
 }
+// Returns temperature from sensor
+float ds18b20_get_temp(void) {
+  return (float)ds18b20_get_temp_raw()/16;
+}
 void ds18b20_init(int GPIO){
   DS_GPIO = GPIO;
   gpio_pad_select_gpio(DS_GPIO);
@@ -20,6 +20,7 @@ unsigned char ds18b20_read(void);
 void ds18b20_send_byte(char data);
 unsigned char ds18b20_read_byte(void);
 unsigned char ds18b20_RST_PULSE(void);
+int ds18b20_get_temp_raw(void);
 float ds18b20_get_temp(void);
 void ds18b20_init(int GPIO);
 
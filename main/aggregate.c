@@ -0,0 +1,74 @@
+#include <stdint.h>
+
+#include "aggregate.h"
+
+
+static int64_t fixed_round(int64_t value, int64_t divisor);
+
+
+void aggregate_reset(aggregate_window_t* window, unsigned long start)
+{
+    window->start = start;
+    window->count = 0;
+    window->min = INT32_MAX;
+    window->max = INT32_MIN;
+    window->sum = 0;
+    window->mean = 0;
+    window->m2 = 0;
+}
+
+
+/* With sensor values within +-2^15 the deviations stay below 2^24 in
+   fixed point, so their products and M2 fit int64 for any window a
+   device can collect. The mean is recomputed from the exact sum rather
+   than nudged by delta / count, whose rounding would add up over a long
+   window (tools/aggregate_test.py). */
+void aggregate_add(aggregate_window_t* window, int32_t value)
+{
+    int64_t x = (int64_t)value << AGGREGATE_FIXED_SHIFT;
+
+    window->count++;
+    if (value < window->min) {
+        window->min = value;
+    }
+    if (value > window->max) {
+        window->max = value;
+    }
+
+    int64_t delta = x - window->mean;
+    window->sum += value;
+    window->mean = fixed_round(window->sum << AGGREGATE_FIXED_SHIFT, window->count);
+    window->m2 += (delta * (x - window->mean)) >> AGGREGATE_FIXED_SHIFT;
+}
+
+
+/* A window is closed once 'window_len' has passed since its first sample */
+int aggregate_due(const aggregate_window_t* window, unsigned long now, unsigned long window_len)
+{
+    return window->count > 0 && now - window->start >= window_len;
+}
+
+
+void aggregate_close(const aggregate_window_t* window, aggregate_record_t* record)
+{
+    record->start = window->start;
+    record->count = window->count;
+    record->min = window->min;
+    record->max = window->max;
+    record->mean = fixed_round(window->mean, 1 << AGGREGATE_FIXED_SHIFT);
+
+    if (window->count < 2) {
+        record->variance = 0;
+        return;
+    }
+
+    int64_t variance = fixed_round(window->m2, (int64_t)(window->count - 1) << AGGREGATE_FIXED_SHIFT);
+    record->variance = variance > INT32_MAX ? INT32_MAX : (int)variance;
+}
+
+
+/* Division rounding half away from zero, plain '/' would bias the mean toward 0 */
+static int64_t fixed_round(int64_t value, int64_t divisor)
+{
+    return value >= 0 ? (value + divisor / 2) / divisor : -((-value + divisor / 2) / divisor);
+}
@@ -0,0 +1,38 @@
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <stdint.h>
+
+/* Streaming per-window statistics of one sensor (Welford's algorithm),
+   integer only. */
+
+#define AGGREGATE_FIXED_SHIFT 8     // fraction bits of the running mean and M2
+
+typedef struct {
+    unsigned long start;            // time of the first sample, same time base as readouts
+    int32_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;                    // exact, the mean is derived from it so rounding can't pile up
+    int64_t mean;                   // running mean, fixed point
+    int64_t m2;                     // sum of squared deviations from the mean, fixed point
+} aggregate_window_t;
+
+typedef struct {
+    unsigned long start;
+    int count;
+    int min;
+    int max;
+    int mean;
+    int variance;                   // sample variance, in squared sensor units
+} aggregate_record_t;
+
+void aggregate_reset(aggregate_window_t* window, unsigned long start);
+
+void aggregate_add(aggregate_window_t* window, int32_t value);
+
+int aggregate_due(const aggregate_window_t* window, unsigned long now, unsigned long window_len);
+
+void aggregate_close(const aggregate_window_t* window, aggregate_record_t* record);
+
+#endif
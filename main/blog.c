@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+
+#include "blog.h"
+
+
+/* Ring record as dumped over UART, one "BLOG" line of 8 hex words each:
+   format, tag, ms since boot, meta (wake << 16 | level << 8 | nargs), args */
+typedef struct {
+    uint32_t format;
+    uint32_t tag;
+    uint32_t time;
+    uint32_t meta;
+    uint32_t args[BLOG_MAX_ARGS];
+} blog_entry_t;
+
+
+/* The ring survives deep sleep, so after grounding the debug pin the
+   last BLOG_RING_LEN records are printed, even from earlier wakes. */
+RTC_DATA_ATTR static blog_entry_t ring[BLOG_RING_LEN];
+RTC_DATA_ATTR static uint32_t ring_head = 0;        // total records written, never wraps in practice
+RTC_DATA_ATTR static uint32_t ring_flushed = 0;     // records already printed
+RTC_DATA_ATTR static uint32_t wake = 0;
+
+static portMUX_TYPE ring_mux = portMUX_INITIALIZER_UNLOCKED;
+
+
+void blog_init()
+{
+    wake++;
+
+    gpio_pad_select_gpio(CONFIG_BURATINO_BLOG_GPIO);
+    gpio_set_direction(CONFIG_BURATINO_BLOG_GPIO, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(CONFIG_BURATINO_BLOG_GPIO, GPIO_PULLUP_ONLY);
+}
+
+
+void blog_record(blog_level_t level, const char* tag, const char* format, int nargs, ...)
+{
+    va_list ap;
+
+    portENTER_CRITICAL(&ring_mux);
+    blog_entry_t* entry = &ring[ring_head++ % BLOG_RING_LEN];
+    portEXIT_CRITICAL(&ring_mux);
+
+    entry->format = (uint32_t)(uintptr_t)format;
+    entry->tag = (uint32_t)(uintptr_t)tag;
+    entry->time = esp_log_timestamp();
+    entry->meta = (wake & 0xFFFF) << 16 | level << 8 | nargs;
+
+    va_start(ap, nargs);
+    for (int i = 0; i < nargs && i < BLOG_MAX_ARGS; i++) {
+        entry->args[i] = va_arg(ap, uint32_t);
+    }
+    va_end(ap);
+}
+
+
+/* Prints records not printed yet, if the debug pin is pulled low or
+   CONFIG_BURATINO_BLOG_ALWAYS_FLUSH is set. Called right before deep
+   sleep, when the awake work is done anyway. */
+void blog_flush()
+{
+#if !CONFIG_BURATINO_BLOG_ALWAYS_FLUSH
+    if (gpio_get_level(CONFIG_BURATINO_BLOG_GPIO) != 0) {
+        return;
+    }
+#endif
+
+    if (ring_head - ring_flushed > BLOG_RING_LEN) {
+        printf("BLOG lost %u\n", ring_head - ring_flushed - BLOG_RING_LEN);
+        ring_flushed = ring_head - BLOG_RING_LEN;
+    }
+
+    for (; ring_flushed < ring_head; ring_flushed++) {
+        const blog_entry_t* entry = &ring[ring_flushed % BLOG_RING_LEN];
+
+        printf("BLOG %08x %08x %08x %08x %08x %08x %08x %08x\n",
+            entry->format, entry->tag, entry->time, entry->meta,
+            entry->args[0], entry->args[1], entry->args[2], entry->args[3]);
+    }
+    fflush(stdout);
+}
@@ -0,0 +1,45 @@
+#ifndef BLOG_H_
+#define BLOG_H_
+
+#include <stdint.h>
+
+/* Deferred binary log. BLOGx() stores the address of its format string
+   and up to BLOG_MAX_ARGS raw 32-bit arguments in a ring kept in RTC
+   memory; nothing is formatted or printed on the calling path. The ring
+   is dumped over UART only on request, and tools/blog_decode.py renders
+   it back using the format strings in the firmware ELF.
+
+   Arguments must be 32-bit integers or pointers. Only the pointer of a
+   %s argument is kept, so it must point into flash: a string literal or
+   a const table of them, never a buffer on the stack, heap or in RTC
+   memory, which will hold something else (or nothing, after a reset)
+   by the time the ring is decoded. To log text that is built at run
+   time, log an index or code into a table of literals instead.
+   tools/blog_decode.py renders %s only from the flash data range and
+   flags every other pointer. */
+
+#define BLOG_MAX_ARGS 4
+#define BLOG_RING_LEN 64                // records, 32 bytes each
+
+typedef enum {
+    BLOG_ERROR = 1,
+    BLOG_WARN,
+    BLOG_INFO,
+    BLOG_DEBUG,
+} blog_level_t;
+
+#define BLOG_NARGS(...) BLOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define BLOG_NARGS_(_0, _1, _2, _3, _4, N, ...) N
+
+#define BLOGE(tag, format, ...) blog_record(BLOG_ERROR, tag, format, BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#define BLOGW(tag, format, ...) blog_record(BLOG_WARN, tag, format, BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#define BLOGI(tag, format, ...) blog_record(BLOG_INFO, tag, format, BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#define BLOGD(tag, format, ...) blog_record(BLOG_DEBUG, tag, format, BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+
+void blog_init();
+
+void blog_record(blog_level_t level, const char* tag, const char* format, int nargs, ...);
+
+void blog_flush();
+
+#endif
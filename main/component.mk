@@ -2,3 +2,7 @@
 # "main" pseudo-component makefile.
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
+
+# version reported to the update server, patches are made against it
+FIRMWARE_VERSION ?= $(shell git -C $(COMPONENT_PATH) describe --always --dirty 2>/dev/null || echo unknown)
+CFLAGS += -DFIRMWARE_VERSION=\"$(FIRMWARE_VERSION)\"
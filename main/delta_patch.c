@@ -0,0 +1,224 @@
+#include <string.h>
+
+#include "delta_patch.h"
+
+
+static uint32_t get_u32(const uint8_t* buf);
+static delta_status_t fail(delta_patch_t* patch, delta_status_t status);
+static delta_status_t check_old_image(delta_patch_t* patch, uint32_t old_crc);
+static delta_status_t emit(delta_patch_t* patch, uint8_t byte);
+static delta_status_t flush_out(delta_patch_t* patch);
+
+
+/* CRC-32 as in zlib, bitwise: it runs once per image, not worth a 1 KB table */
+uint32_t delta_crc32(uint32_t crc, const uint8_t* data, size_t len)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+
+void delta_patch_init(delta_patch_t* patch,
+    int (*read_old)(void* ctx, uint32_t offset, uint8_t* buf, size_t len),
+    int (*write_new)(void* ctx, const uint8_t* buf, size_t len), void* ctx)
+{
+    memset(patch, 0, sizeof(delta_patch_t));
+    patch->read_old = read_old;
+    patch->write_new = write_new;
+    patch->ctx = ctx;
+    patch->state = DELTA_STATE_HEADER;
+}
+
+
+/* Consumes the next chunk of the (inflated) patch stream */
+delta_status_t delta_patch_feed(delta_patch_t* patch, const uint8_t* data, size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        switch (patch->state) {
+            case DELTA_STATE_HEADER:
+            case DELTA_STATE_CONTROL: {
+                size_t field_size = patch->state == DELTA_STATE_HEADER ? DELTA_HEADER_LEN : DELTA_CONTROL_LEN;
+                size_t n = field_size - patch->field_len;
+                if (n > len - pos) {
+                    n = len - pos;
+                }
+                memcpy(patch->field + patch->field_len, data + pos, n);
+                patch->field_len += n;
+                pos += n;
+
+                if (patch->field_len < field_size) {
+                    break;
+                }
+                patch->field_len = 0;
+
+                if (patch->state == DELTA_STATE_HEADER) {
+                    if (memcmp(patch->field, DELTA_MAGIC, 4) != 0) {
+                        return fail(patch, DELTA_ERR_FORMAT);
+                    }
+                    patch->old_size = get_u32(patch->field + 4);
+                    patch->new_size = get_u32(patch->field + 12);
+                    patch->new_crc = get_u32(patch->field + 16);
+
+                    delta_status_t status = check_old_image(patch, get_u32(patch->field + 8));
+                    if (status != DELTA_OK) {
+                        return fail(patch, status);
+                    }
+                    patch->state = DELTA_STATE_CONTROL;
+                    break;
+                }
+
+                patch->diff_left = get_u32(patch->field);
+                patch->extra_left = get_u32(patch->field + 4);
+                patch->seek = (int32_t)get_u32(patch->field + 8);
+
+                // bytes still in out_buf are not counted in written yet
+                if ((uint64_t)patch->written + patch->out_len + patch->diff_left + patch->extra_left > patch->new_size
+                        || (uint64_t)patch->old_pos + patch->diff_left > patch->old_size) {
+                    return fail(patch, DELTA_ERR_FORMAT);
+                }
+                patch->state = patch->diff_left ? DELTA_STATE_DIFF : DELTA_STATE_EXTRA;
+                break;
+            }
+
+            case DELTA_STATE_DIFF: {
+                size_t n = patch->diff_left;
+                if (n > len - pos) {
+                    n = len - pos;
+                }
+                if (n > DELTA_BUF_LEN) {
+                    n = DELTA_BUF_LEN;
+                }
+
+                if (patch->read_old(patch->ctx, patch->old_pos, patch->old_buf, n) != 0) {
+                    return fail(patch, DELTA_ERR_IO);
+                }
+                for (size_t i = 0; i < n; i++) {
+                    if (emit(patch, patch->old_buf[i] + data[pos + i]) != DELTA_OK) {
+                        return patch->status;
+                    }
+                }
+                pos += n;
+                patch->old_pos += n;
+                patch->diff_left -= n;
+
+                if (patch->diff_left == 0) {
+                    patch->state = DELTA_STATE_EXTRA;
+                }
+                break;
+            }
+
+            case DELTA_STATE_EXTRA: {
+                while (patch->extra_left > 0 && pos < len) {
+                    if (emit(patch, data[pos++]) != DELTA_OK) {
+                        return patch->status;
+                    }
+                    patch->extra_left--;
+                }
+
+                if (patch->extra_left == 0) {
+                    patch->old_pos += patch->seek;
+                    patch->state = DELTA_STATE_CONTROL;
+                }
+                break;
+            }
+
+            case DELTA_STATE_FAILED:
+                return patch->status;
+        }
+    }
+
+    // records without payload complete without further input
+    if (patch->state == DELTA_STATE_EXTRA && patch->extra_left == 0) {
+        patch->old_pos += patch->seek;
+        patch->state = DELTA_STATE_CONTROL;
+    }
+
+    return DELTA_OK;
+}
+
+
+/* Checks that the whole patch was consumed and the result is the
+   expected image. Call once the patch stream has ended. */
+delta_status_t delta_patch_finish(delta_patch_t* patch)
+{
+    if (patch->state == DELTA_STATE_FAILED) {
+        return patch->status;
+    }
+    if (flush_out(patch) != DELTA_OK) {
+        return patch->status;
+    }
+    if (patch->state != DELTA_STATE_CONTROL || patch->field_len != 0 || patch->written != patch->new_size) {
+        return fail(patch, DELTA_ERR_FORMAT);
+    }
+    if (patch->crc != patch->new_crc) {
+        return fail(patch, DELTA_ERR_NEW_IMAGE);
+    }
+    return DELTA_OK;
+}
+
+
+static uint32_t get_u32(const uint8_t* buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+
+static delta_status_t fail(delta_patch_t* patch, delta_status_t status)
+{
+    patch->state = DELTA_STATE_FAILED;
+    patch->status = status;
+    return status;
+}
+
+
+/* A patch only applies to the exact image it was made from */
+static delta_status_t check_old_image(delta_patch_t* patch, uint32_t old_crc)
+{
+    uint32_t crc = 0;
+
+    for (uint32_t offset = 0; offset < patch->old_size; offset += DELTA_BUF_LEN) {
+        size_t n = patch->old_size - offset < DELTA_BUF_LEN ? patch->old_size - offset : DELTA_BUF_LEN;
+
+        if (patch->read_old(patch->ctx, offset, patch->old_buf, n) != 0) {
+            return DELTA_ERR_IO;
+        }
+        crc = delta_crc32(crc, patch->old_buf, n);
+    }
+
+    return crc == old_crc ? DELTA_OK : DELTA_ERR_OLD_IMAGE;
+}
+
+
+static delta_status_t emit(delta_patch_t* patch, uint8_t byte)
+{
+    patch->out_buf[patch->out_len++] = byte;
+
+    if (patch->out_len == DELTA_BUF_LEN) {
+        return flush_out(patch);
+    }
+    return DELTA_OK;
+}
+
+
+static delta_status_t flush_out(delta_patch_t* patch)
+{
+    if (patch->out_len == 0) {
+        return DELTA_OK;
+    }
+    if (patch->write_new(patch->ctx, patch->out_buf, patch->out_len) != 0) {
+        return fail(patch, DELTA_ERR_IO);
+    }
+
+    patch->crc = delta_crc32(patch->crc, patch->out_buf, patch->out_len);
+    patch->written += patch->out_len;
+    patch->out_len = 0;
+    return DELTA_OK;
+}
@@ -0,0 +1,77 @@
+#ifndef DELTA_PATCH_H_
+#define DELTA_PATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Streaming applier of binary delta patches made by tools/ota_delta.py.
+   The patch is fed in arbitrary chunks (after zlib inflation), old
+   image bytes are fetched on demand and the new image is written out
+   sequentially, so RAM use is a few hundred bytes whatever the image
+   size.
+
+   patch   := "BDLT" old_size old_crc new_size new_crc record*
+   record  := diff_len extra_len seek diff_len*byte extra_len*byte
+
+   Integers are 32-bit little-endian, 'seek' is signed. For each record,
+   diff_len bytes of the new image are old bytes plus the patch bytes
+   (mod 256), followed by extra_len literal bytes; then the old position
+   moves by diff_len + seek. CRCs are CRC-32 (zlib). */
+
+#define DELTA_MAGIC "BDLT"
+#define DELTA_HEADER_LEN 20
+#define DELTA_CONTROL_LEN 12
+#define DELTA_BUF_LEN 256
+
+typedef enum {
+    DELTA_OK = 0,
+    DELTA_ERR_FORMAT = -1,          // not a patch or corrupted
+    DELTA_ERR_OLD_IMAGE = -2,       // patch is for a different old image
+    DELTA_ERR_IO = -3,              // reading old or writing new image failed
+    DELTA_ERR_NEW_IMAGE = -4,       // result does not match the expected CRC
+} delta_status_t;
+
+typedef enum {
+    DELTA_STATE_HEADER,
+    DELTA_STATE_CONTROL,
+    DELTA_STATE_DIFF,
+    DELTA_STATE_EXTRA,
+    DELTA_STATE_FAILED,
+} delta_state_t;
+
+typedef struct {
+    int (*read_old)(void* ctx, uint32_t offset, uint8_t* buf, size_t len);
+    int (*write_new)(void* ctx, const uint8_t* buf, size_t len);
+    void* ctx;
+
+    delta_state_t state;
+    delta_status_t status;
+    uint8_t field[DELTA_HEADER_LEN];        // header or control being assembled
+    size_t field_len;
+
+    uint32_t old_size;
+    uint32_t new_size;
+    uint32_t new_crc;
+    uint32_t old_pos;
+    uint32_t diff_left;
+    uint32_t extra_left;
+    int32_t seek;
+    uint32_t written;
+    uint32_t crc;                           // running CRC of the new image
+
+    uint8_t old_buf[DELTA_BUF_LEN];
+    uint8_t out_buf[DELTA_BUF_LEN];
+    size_t out_len;
+} delta_patch_t;
+
+uint32_t delta_crc32(uint32_t crc, const uint8_t* data, size_t len);
+
+void delta_patch_init(delta_patch_t* patch,
+    int (*read_old)(void* ctx, uint32_t offset, uint8_t* buf, size_t len),
+    int (*write_new)(void* ctx, const uint8_t* buf, size_t len), void* ctx);
+
+delta_status_t delta_patch_feed(delta_patch_t* patch, const uint8_t* data, size_t len);
+
+delta_status_t delta_patch_finish(delta_patch_t* patch);
+
+#endif
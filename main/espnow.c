@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_system.h"
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "esp_event_loop.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "nvs.h"
+
+#include "espnow.h"
+#include "upload.h"
+#include "wifi.h"
+#include "blog.h"
+
+
+#define ESPNOW_NAMESPACE "espnow"
+#define ESPNOW_UNACKED_KEY "unacked"
+#define RX_QUEUE_LEN 16
+#define RADIO_MAX_PEERS ESP_NOW_MAX_TOTAL_PEER_NUM
+
+#define GATEWAY_FLUSH_THRESHOLD (GATEWAY_BATCH_SIZE * 3 / 4)   // leave room for frames arriving mid-upload
+#define GATEWAY_FLUSH_INTERVAL 300                              // forward at least every X seconds
+#define FORWARD_TASK_STACK 6144
+
+
+typedef struct {
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    uint8_t data[ESPNOW_FRAME_MAX_LEN];
+    int len;
+} rx_event_t;
+
+
+// logging tag
+static const char *TAG = "espnow";
+
+/* Sequence number of the last frame sent, kept across deep sleep so the
+   gateway can tell retransmissions from new frames. The boot number is
+   drawn from NVS whenever RTC memory was lost and seq started over, it is
+   never 0. A frame the gateway never acknowledged is also saved to NVS
+   (ESPNOW_UNACKED_KEY) until it is, so that a power-on resends it as the
+   same frame instead of as new readouts. */
+RTC_DATA_ATTR static espnow_sender_t sender;
+
+static QueueHandle_t rx_queue;
+static uint8_t device_id[ESPNOW_DEVICE_ID_LEN];
+static uint8_t gateway_mac[ESP_NOW_ETH_ALEN];
+
+/* Peers registered with the radio. The gateway hears from more devices
+   than the radio keeps peers, so the least recently used one makes room. */
+static uint8_t radio_peers[RADIO_MAX_PEERS][ESP_NOW_ETH_ALEN];
+static uint32_t radio_peer_used[RADIO_MAX_PEERS];
+static int radio_peer_count = 0;
+static uint32_t radio_clock = 0;
+
+// gateway batch is too large for the task stack
+static espnow_gateway_t gateway;
+
+/* Readouts handed over to the forward task. The receive loop only
+   touches them while forward_idle is taken, so frames keep being
+   received and acknowledged while an upload is in progress. */
+static gateway_readout_t outbox[GATEWAY_BATCH_SIZE];
+static int outbox_count = 0;
+static SemaphoreHandle_t forward_request;
+static SemaphoreHandle_t forward_idle;
+static time_t forward_timestamps[GATEWAY_BATCH_SIZE];
+static int forward_values[GATEWAY_BATCH_SIZE];
+static uint8_t forward_state[GATEWAY_BATCH_SIZE];
+
+static esp_err_t event_handler(void *ctx, system_event_t *event);
+static void espnow_start();
+static uint16_t next_link_boot();
+static int load_unacked();
+static void save_unacked();
+static int add_peer(const uint8_t* mac);
+static void recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len);
+static int radio_send(void* ctx, const uint8_t* data, size_t len);
+static int radio_wait_ack(void* ctx, uint16_t seq, int timeout_ms);
+static void gateway_handle(const rx_event_t* evt);
+static void gateway_hand_over();
+static void forward_task(void* arg);
+static void gateway_forward();
+
+
+/* Brings the radio up on the ESP-NOW channel without associating to any
+   access point: no scan, no DHCP, no TCP/IP traffic. */
+void espnow_uplink_init()
+{
+    tcpip_adapter_init();
+    ESP_ERROR_CHECK( esp_event_loop_init(event_handler, NULL) );
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
+    ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
+    ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
+    ESP_ERROR_CHECK( esp_wifi_start() );
+    ESP_ERROR_CHECK( esp_wifi_set_channel(CONFIG_BURATINO_ESPNOW_CHANNEL, WIFI_SECOND_CHAN_NONE) );
+
+    espnow_start();
+
+    if (sender.boot == 0 && load_unacked() != 0) {
+        sender.boot = next_link_boot();
+    }
+
+    sscanf(CONFIG_BURATINO_GATEWAY_MAC, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+        &gateway_mac[0], &gateway_mac[1], &gateway_mac[2],
+        &gateway_mac[3], &gateway_mac[4], &gateway_mac[5]);
+    add_peer(gateway_mac);
+
+    BLOGI(TAG, "ESP-NOW uplink ready on channel %d", CONFIG_BURATINO_ESPNOW_CHANNEL);
+}
+
+
+/* Returns the number of readouts acknowledged by the gateway */
+int espnow_uplink_send(const char* sensor_code, const espnow_readout_t* readouts, int count)
+{
+    espnow_transport_t transport = {
+        .send = radio_send,
+        .wait_ack = radio_wait_ack,
+        .ctx = NULL
+    };
+
+    espnow_sender_t before = sender;
+    int sent = espnow_send_readouts(&transport, device_id, &sender, sensor_code, readouts, count);
+
+    // NVS is written only when the unacked frame changes, which a healthy link never does
+    if (sender.unacked != before.unacked || (sender.unacked > 0 && sender.seq != before.seq)) {
+        save_unacked();
+    }
+    BLOGI(TAG, "Delivered %d/%d %s readouts", sent, count, sensor_code);
+
+    return sent;
+}
+
+
+/* Sensor code of a frame the gateway never acknowledged, NULL if none.
+   Its readouts have to be sent first on the next sync. */
+const char* espnow_uplink_unacked()
+{
+    return sender.unacked > 0 ? sender.unacked_code : NULL;
+}
+
+
+void espnow_uplink_stop()
+{
+    esp_now_deinit();
+    ESP_ERROR_CHECK( esp_wifi_stop() );
+}
+
+
+/* Main loop of the gateway firmware, never returns. The gateway stays
+   associated to the access point, so ESP-NOW shares the AP channel. */
+void gateway_run()
+{
+    initialise_wifi(-1);
+    obtain_time(-1);
+
+    uint8_t primary;
+    wifi_second_chan_t second;
+    esp_wifi_get_channel(&primary, &second);
+    if (primary != CONFIG_BURATINO_ESPNOW_CHANNEL) {
+        ESP_LOGW(TAG, "AP is on channel %d, devices are configured for channel %d",
+            primary, CONFIG_BURATINO_ESPNOW_CHANNEL);
+    }
+
+    espnow_start();
+    espnow_gateway_init(&gateway);
+
+    forward_request = xSemaphoreCreateBinary();
+    forward_idle = xSemaphoreCreateBinary();
+    xSemaphoreGive(forward_idle);
+    xTaskCreate(forward_task, "forward", FORWARD_TASK_STACK, NULL, 5, NULL);
+
+    time_t now, last_forward;
+    time(&last_forward);
+
+    BLOGI(TAG, "Gateway is listening on channel %d", primary);
+
+    while (1) {
+        rx_event_t evt;
+
+        if (xQueueReceive(rx_queue, &evt, 1000 / portTICK_PERIOD_MS) == pdTRUE) {
+            gateway_handle(&evt);
+        }
+
+        time(&now);
+        if ((gateway.readout_count >= GATEWAY_FLUSH_THRESHOLD
+                    || (gateway.readout_count > 0 && now - last_forward >= GATEWAY_FLUSH_INTERVAL))
+                && xSemaphoreTake(forward_idle, 0) == pdTRUE) {
+            gateway_hand_over();
+            xSemaphoreGive(forward_request);
+            last_forward = now;
+        }
+
+        blog_flush();
+    }
+}
+
+
+static esp_err_t event_handler(void *ctx, system_event_t *event)
+{
+    (void)ctx;
+    (void)event;
+    return ESP_OK;
+}
+
+
+static void espnow_start()
+{
+    espnow_parse_device_id(DEVICE_ID, device_id);
+
+    rx_queue = xQueueCreate(RX_QUEUE_LEN, sizeof(rx_event_t));
+    ESP_ERROR_CHECK( esp_now_init() );
+    ESP_ERROR_CHECK( esp_now_register_recv_cb(recv_cb) );
+}
+
+
+/* Counts power-ons in NVS. Should NVS fail, a random number still tells
+   this run from the previous one with high probability. */
+static uint16_t next_link_boot()
+{
+    nvs_handle nvs;
+    uint16_t boot = 0;
+
+    if (nvs_open(ESPNOW_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS, using a random boot number");
+        return (esp_random() % 0xFFFF) + 1;
+    }
+    nvs_get_u16(nvs, "boot", &boot);
+    boot = boot == 0xFFFF ? 1 : boot + 1;
+    nvs_set_u16(nvs, "boot", boot);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+
+    return boot;
+}
+
+
+/* Restores the sender as it was when its last frame went unacknowledged.
+   Returns 0 if there was such a frame, -1 otherwise. */
+static int load_unacked()
+{
+    nvs_handle nvs;
+    espnow_sender_t saved;
+    size_t len = sizeof(saved);
+    int ret = -1;
+
+    if (nvs_open(ESPNOW_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return -1;
+    }
+    if (nvs_get_blob(nvs, ESPNOW_UNACKED_KEY, &saved, &len) == ESP_OK && len == sizeof(saved)
+            && saved.boot != 0 && saved.unacked > 0) {
+        sender = saved;
+        ret = 0;
+    }
+    nvs_close(nvs);
+
+    return ret;
+}
+
+
+static void save_unacked()
+{
+    nvs_handle nvs;
+
+    if (nvs_open(ESPNOW_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save the unacked frame");
+        return;
+    }
+    if (sender.unacked > 0) {
+        nvs_set_blob(nvs, ESPNOW_UNACKED_KEY, &sender, sizeof(sender));
+    } else {
+        nvs_erase_key(nvs, ESPNOW_UNACKED_KEY);
+    }
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+
+/* Returns 0 once 'mac' is a peer of the radio, -1 if it can't be added */
+static int add_peer(const uint8_t* mac)
+{
+    int slot = 0;
+
+    for (int i = 0; i < radio_peer_count; i++) {
+        if (memcmp(radio_peers[i], mac, ESP_NOW_ETH_ALEN) == 0) {
+            radio_peer_used[i] = ++radio_clock;
+            return 0;
+        }
+        if (radio_peer_used[i] < radio_peer_used[slot]) {
+            slot = i;
+        }
+    }
+
+    if (radio_peer_count < RADIO_MAX_PEERS) {
+        slot = radio_peer_count++;
+    } else {
+        esp_now_del_peer(radio_peers[slot]);
+    }
+
+    esp_now_peer_info_t peer;
+    memset(&peer, 0, sizeof(esp_now_peer_info_t));
+    memcpy(peer.peer_addr, mac, ESP_NOW_ETH_ALEN);
+    peer.channel = CONFIG_BURATINO_ESPNOW_CHANNEL;
+    peer.ifidx = ESP_IF_WIFI_STA;
+    peer.encrypt = false;
+
+    if (esp_now_add_peer(&peer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add ESP-NOW peer");
+        // the slot is free now, fill it with the last entry
+        radio_peer_count--;
+        memcpy(radio_peers[slot], radio_peers[radio_peer_count], ESP_NOW_ETH_ALEN);
+        radio_peer_used[slot] = radio_peer_used[radio_peer_count];
+        return -1;
+    }
+
+    memcpy(radio_peers[slot], mac, ESP_NOW_ETH_ALEN);
+    radio_peer_used[slot] = ++radio_clock;
+    return 0;
+}
+
+
+/* Runs in the Wi-Fi task: only copy the frame out, decoding happens later */
+static void recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len)
+{
+    rx_event_t evt;
+
+    if (len <= 0 || len > ESPNOW_FRAME_MAX_LEN) {
+        return;
+    }
+
+    memcpy(evt.mac, mac_addr, ESP_NOW_ETH_ALEN);
+    memcpy(evt.data, data, len);
+    evt.len = len;
+
+    xQueueSend(rx_queue, &evt, 0);
+}
+
+
+static int radio_send(void* ctx, const uint8_t* data, size_t len)
+{
+    (void)ctx;
+    return esp_now_send(gateway_mac, data, len) == ESP_OK ? 0 : -1;
+}
+
+
+static int radio_wait_ack(void* ctx, uint16_t seq, int timeout_ms)
+{
+    (void)ctx;
+    TickType_t deadline = xTaskGetTickCount() + timeout_ms / portTICK_PERIOD_MS;
+    rx_event_t evt;
+    espnow_frame_t frame;
+
+    while (1) {
+        TickType_t now = xTaskGetTickCount();
+
+        if (now >= deadline || xQueueReceive(rx_queue, &evt, deadline - now) != pdTRUE) {
+            return -1;
+        }
+
+        if (espnow_decode_frame(evt.data, evt.len, &frame) == 0
+                && frame.type == ESPNOW_FRAME_ACK
+                && frame.seq == seq
+                && frame.boot == sender.boot
+                && memcmp(frame.device_id, device_id, ESPNOW_DEVICE_ID_LEN) == 0) {
+            return 0;
+        }
+    }
+}
+
+
+static void gateway_handle(const rx_event_t* evt)
+{
+    espnow_frame_t frame;
+    uint8_t buf[ESPNOW_FRAME_MAX_LEN];
+    time_t now;
+
+    if (espnow_decode_frame(evt->data, evt->len, &frame) != 0 || frame.type != ESPNOW_FRAME_DATA) {
+        return;
+    }
+
+    // no ACK can go back without a peer, and the device would resend a frame already batched
+    if (add_peer(evt->mac) != 0) {
+        return;
+    }
+
+    time(&now);
+    if (espnow_gateway_accept(&gateway, &frame, now) < 0) {
+        // batch is full: no ACK, the device keeps its readouts for the next wake
+        ESP_LOGW(TAG, "Batch is full, dropping frame %d", frame.seq);
+        return;
+    }
+
+    frame.type = ESPNOW_FRAME_ACK;
+    frame.count = 0;
+    int len = espnow_encode_frame(&frame, buf, sizeof(buf));
+
+    esp_now_send(evt->mac, buf, len);
+}
+
+
+/* Moves as much of the batch as fits into the outbox, which may still
+   hold readouts whose forward failed. Call with forward_idle taken. */
+static void gateway_hand_over()
+{
+    int moved = gateway.readout_count;
+
+    if (moved > GATEWAY_BATCH_SIZE - outbox_count) {
+        moved = GATEWAY_BATCH_SIZE - outbox_count;
+    }
+    memcpy(&outbox[outbox_count], gateway.readouts, moved * sizeof(gateway_readout_t));
+    outbox_count += moved;
+
+    gateway.readout_count -= moved;
+    memmove(gateway.readouts, &gateway.readouts[moved], gateway.readout_count * sizeof(gateway_readout_t));
+}
+
+
+static void forward_task(void* arg)
+{
+    (void)arg;
+    while (1) {
+        xSemaphoreTake(forward_request, portMAX_DELAY);
+        gateway_forward();
+        xSemaphoreGive(forward_idle);
+    }
+}
+
+
+/* Posts the outbox upstream, one request per device and sensor. Readouts
+   whose request failed stay in the outbox and are retried on the next
+   forward. */
+static void gateway_forward()
+{
+    enum { PENDING, FORWARDED, FAILED };
+    char uuid[37];
+    char response[256];
+
+    memset(forward_state, PENDING, sizeof(forward_state));
+
+    for (int i = 0; i < outbox_count; i++) {
+        if (forward_state[i] != PENDING) {
+            continue;
+        }
+
+        const gateway_readout_t* first = &outbox[i];
+        int count = 0;
+
+        for (int j = i; j < outbox_count; j++) {
+            const gateway_readout_t* readout = &outbox[j];
+
+            if (forward_state[j] == PENDING
+                    && memcmp(readout->device_id, first->device_id, ESPNOW_DEVICE_ID_LEN) == 0
+                    && strcmp(readout->sensor_code, first->sensor_code) == 0) {
+                forward_timestamps[count] = readout->timestamp;
+                forward_values[count] = readout->value;
+                forward_state[j] = FAILED;
+                count++;
+            }
+        }
+
+        espnow_format_device_id(first->device_id, uuid);
+
+        char* body = build_readouts_body(first->sensor_code, forward_timestamps, forward_values, count);
+        char* request = body ? build_request(uuid, "readouts", body) : NULL;
+        int status = request ? http_post(request, response, sizeof(response), HTTP_TIMEOUT_MS) : -1;
+
+        free(body);
+        free(request);
+
+        BLOGI(TAG, "Forwarded %d readouts, status %d", count, status);
+
+        if (status >= 200 && status < 300) {
+            for (int j = i; j < outbox_count; j++) {
+                if (forward_state[j] == FAILED
+                        && memcmp(outbox[j].device_id, first->device_id, ESPNOW_DEVICE_ID_LEN) == 0
+                        && strcmp(outbox[j].sensor_code, first->sensor_code) == 0) {
+                    forward_state[j] = FORWARDED;
+                }
+            }
+        }
+    }
+
+    // compact the outbox down to readouts that still have to be forwarded
+    int kept = 0;
+    for (int i = 0; i < outbox_count; i++) {
+        if (forward_state[i] == FAILED) {
+            outbox[kept++] = outbox[i];
+        }
+    }
+    outbox_count = kept;
+}
@@ -0,0 +1,12 @@
+#include "espnow_proto.h"
+
+
+void espnow_uplink_init();
+
+int espnow_uplink_send(const char* sensor_code, const espnow_readout_t* readouts, int count);
+
+const char* espnow_uplink_unacked();
+
+void espnow_uplink_stop();
+
+void gateway_run();
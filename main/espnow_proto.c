@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "espnow_proto.h"
+
+
+static void put_u16(uint8_t* buf, uint16_t value);
+static void put_u32(uint8_t* buf, uint32_t value);
+static uint16_t get_u16(const uint8_t* buf);
+static uint32_t get_u32(const uint8_t* buf);
+
+
+/* CRC-16/CCITT-FALSE, bitwise: frames are short, a table is not worth 512 bytes */
+uint16_t espnow_crc16(const uint8_t* data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+
+/* Returns the encoded length, or -1 if the frame does not fit into 'size' */
+int espnow_encode_frame(const espnow_frame_t* frame, uint8_t* buf, size_t size)
+{
+    size_t len = ESPNOW_HEADER_LEN + frame->count * ESPNOW_READOUT_LEN + ESPNOW_CRC_LEN;
+
+    if (frame->count > ESPNOW_MAX_READOUTS || len > size) {
+        return -1;
+    }
+
+    uint8_t* p = buf;
+    *p++ = ESPNOW_FRAME_MAGIC;
+    *p++ = ESPNOW_FRAME_VERSION;
+    *p++ = frame->type;
+    put_u16(p, frame->seq);
+    put_u16(p + 2, frame->boot);
+    p += 4;
+    memcpy(p, frame->device_id, ESPNOW_DEVICE_ID_LEN);
+    p += ESPNOW_DEVICE_ID_LEN;
+    memcpy(p, frame->sensor_code, ESPNOW_SENSOR_CODE_LEN);
+    p += ESPNOW_SENSOR_CODE_LEN;
+    *p++ = frame->count;
+
+    for (int i = 0; i < frame->count; i++) {
+        put_u32(p, frame->readouts[i].age);
+        put_u32(p + 4, (uint32_t)frame->readouts[i].value);
+        p += ESPNOW_READOUT_LEN;
+    }
+
+    put_u16(p, espnow_crc16(buf, p - buf));
+
+    return len;
+}
+
+
+/* Returns 0 on success, -1 for truncated, foreign or corrupted frames */
+int espnow_decode_frame(const uint8_t* buf, size_t len, espnow_frame_t* frame)
+{
+    if (len < ESPNOW_HEADER_LEN + ESPNOW_CRC_LEN
+            || buf[0] != ESPNOW_FRAME_MAGIC || buf[1] != ESPNOW_FRAME_VERSION) {
+        return -1;
+    }
+
+    uint8_t count = buf[ESPNOW_HEADER_LEN - 1];
+    if (count > ESPNOW_MAX_READOUTS
+            || len != ESPNOW_HEADER_LEN + (size_t)count * ESPNOW_READOUT_LEN + ESPNOW_CRC_LEN) {
+        return -1;
+    }
+
+    if (get_u16(buf + len - ESPNOW_CRC_LEN) != espnow_crc16(buf, len - ESPNOW_CRC_LEN)) {
+        return -1;
+    }
+
+    const uint8_t* p = buf + 2;
+    frame->type = *p++;
+    frame->seq = get_u16(p);
+    frame->boot = get_u16(p + 2);
+    p += 4;
+    memcpy(frame->device_id, p, ESPNOW_DEVICE_ID_LEN);
+    p += ESPNOW_DEVICE_ID_LEN;
+    memcpy(frame->sensor_code, p, ESPNOW_SENSOR_CODE_LEN);
+    frame->sensor_code[ESPNOW_SENSOR_CODE_LEN] = 0;
+    p += ESPNOW_SENSOR_CODE_LEN;
+    frame->count = *p++;
+
+    for (int i = 0; i < count; i++) {
+        frame->readouts[i].age = get_u32(p);
+        frame->readouts[i].value = (int32_t)get_u32(p + 4);
+        p += ESPNOW_READOUT_LEN;
+    }
+
+    return 0;
+}
+
+
+/* "2e52e67d-d0f5-4f87-b7b6-9aae97a42623" -> 16 bytes; returns -1 if malformed */
+int espnow_parse_device_id(const char* uuid, uint8_t* device_id)
+{
+    int n = 0;
+
+    for (const char* p = uuid; *p && n < ESPNOW_DEVICE_ID_LEN * 2; p++) {
+        int nibble;
+
+        if (*p == '-') {
+            continue;
+        } else if (*p >= '0' && *p <= '9') {
+            nibble = *p - '0';
+        } else if (*p >= 'a' && *p <= 'f') {
+            nibble = *p - 'a' + 10;
+        } else if (*p >= 'A' && *p <= 'F') {
+            nibble = *p - 'A' + 10;
+        } else {
+            return -1;
+        }
+
+        if (n % 2 == 0) {
+            device_id[n / 2] = nibble << 4;
+        } else {
+            device_id[n / 2] |= nibble;
+        }
+        n++;
+    }
+
+    return n == ESPNOW_DEVICE_ID_LEN * 2 ? 0 : -1;
+}
+
+
+/* Inverse of espnow_parse_device_id, 'uuid' must hold 37 bytes */
+void espnow_format_device_id(const uint8_t* device_id, char* uuid)
+{
+    const uint8_t* d = device_id;
+
+    sprintf(uuid, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+        d[0], d[1], d[2], d[3], d[4], d[5], d[6], d[7],
+        d[8], d[9], d[10], d[11], d[12], d[13], d[14], d[15]);
+}
+
+
+/* Splits 'readouts' into frames and sends them one by one, retrying each
+   frame until it is acknowledged. Stops at the first frame that exhausts
+   its retries and returns the number of readouts delivered, so the caller
+   can keep the rest for the next wake. Every new frame advances
+   sender->seq, retries reuse it. A frame left unacknowledged by the
+   previous call is sent again first, with the same seq and readouts, so
+   the gateway drops it if it did get through. */
+int espnow_send_readouts(const espnow_transport_t* transport, const uint8_t* device_id,
+    espnow_sender_t* sender, const char* sensor_code, const espnow_readout_t* readouts, int count)
+{
+    espnow_frame_t frame;
+    uint8_t buf[ESPNOW_FRAME_MAX_LEN];
+    int sent = 0;
+
+    frame.type = ESPNOW_FRAME_DATA;
+    frame.boot = sender->boot;
+    memcpy(frame.device_id, device_id, ESPNOW_DEVICE_ID_LEN);
+    strncpy(frame.sensor_code, sensor_code, ESPNOW_SENSOR_CODE_LEN);
+    frame.sensor_code[ESPNOW_SENSOR_CODE_LEN] = 0;
+
+    while (sent < count) {
+        int batch = count - sent;
+        if (batch > ESPNOW_MAX_READOUTS) {
+            batch = ESPNOW_MAX_READOUTS;
+        }
+
+        if (sent == 0 && sender->unacked > 0 && sender->unacked <= count
+                && strcmp(sender->unacked_code, frame.sensor_code) == 0) {
+            batch = sender->unacked;
+        } else {
+            sender->seq++;
+        }
+        frame.seq = sender->seq;
+        frame.count = batch;
+        memcpy(frame.readouts, readouts + sent, batch * sizeof(espnow_readout_t));
+
+        int len = espnow_encode_frame(&frame, buf, sizeof(buf));
+        int acked = 0;
+
+        for (int attempt = 0; attempt < ESPNOW_MAX_RETRIES && !acked; attempt++) {
+            if (transport->send(transport->ctx, buf, len) != 0) {
+                continue;
+            }
+            acked = transport->wait_ack(transport->ctx, frame.seq, ESPNOW_ACK_TIMEOUT_MS) == 0;
+        }
+
+        if (!acked) {
+            sender->unacked = batch;
+            memcpy(sender->unacked_code, frame.sensor_code, ESPNOW_SENSOR_CODE_LEN + 1);
+            break;
+        }
+        sender->unacked = 0;
+        sent += batch;
+    }
+
+    return sent;
+}
+
+
+void espnow_gateway_init(espnow_gateway_t* gateway)
+{
+    memset(gateway, 0, sizeof(espnow_gateway_t));
+}
+
+
+/* Adds the readouts of a DATA frame received at 'now' to the batch.
+   Returns 1 if the frame was added, 0 for a retransmission of a frame
+   already added (its ACK got lost), and -1 if the batch has no room left.
+   The sender should be acknowledged in the first two cases only. With
+   more than GATEWAY_MAX_PEERS devices around, the one heard from least
+   recently loses its duplicate detection. */
+int espnow_gateway_accept(espnow_gateway_t* gateway, const espnow_frame_t* frame, time_t now)
+{
+    gateway_peer_t* peer = NULL;
+
+    for (int i = 0; i < gateway->peer_count; i++) {
+        if (memcmp(gateway->peers[i].device_id, frame->device_id, ESPNOW_DEVICE_ID_LEN) == 0) {
+            peer = &gateway->peers[i];
+            break;
+        }
+    }
+
+    if (peer != NULL && peer->last_boot == frame->boot && peer->last_seq == frame->seq) {
+        peer->last_used = ++gateway->clock;
+        return 0;
+    }
+
+    if (gateway->readout_count + frame->count > GATEWAY_BATCH_SIZE) {
+        return -1;
+    }
+
+    if (peer == NULL) {
+        if (gateway->peer_count < GATEWAY_MAX_PEERS) {
+            peer = &gateway->peers[gateway->peer_count++];
+        } else {
+            peer = &gateway->peers[0];
+            for (int i = 1; i < GATEWAY_MAX_PEERS; i++) {
+                if (gateway->peers[i].last_used < peer->last_used) {
+                    peer = &gateway->peers[i];
+                }
+            }
+        }
+        memcpy(peer->device_id, frame->device_id, ESPNOW_DEVICE_ID_LEN);
+    }
+    peer->last_seq = frame->seq;
+    peer->last_boot = frame->boot;
+    peer->last_used = ++gateway->clock;
+
+    for (int i = 0; i < frame->count; i++) {
+        gateway_readout_t* readout = &gateway->readouts[gateway->readout_count++];
+
+        memcpy(readout->device_id, frame->device_id, ESPNOW_DEVICE_ID_LEN);
+        memcpy(readout->sensor_code, frame->sensor_code, ESPNOW_SENSOR_CODE_LEN + 1);
+        readout->timestamp = now - frame->readouts[i].age;
+        readout->value = frame->readouts[i].value;
+    }
+
+    return 1;
+}
+
+
+static void put_u16(uint8_t* buf, uint16_t value)
+{
+    buf[0] = value & 0xFF;
+    buf[1] = value >> 8;
+}
+
+
+static void put_u32(uint8_t* buf, uint32_t value)
+{
+    put_u16(buf, value & 0xFFFF);
+    put_u16(buf + 2, value >> 16);
+}
+
+
+static uint16_t get_u16(const uint8_t* buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+
+static uint32_t get_u32(const uint8_t* buf)
+{
+    return get_u16(buf) | ((uint32_t)get_u16(buf + 2) << 16);
+}
@@ -0,0 +1,117 @@
+#ifndef ESPNOW_PROTO_H_
+#define ESPNOW_PROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Wire format of the ESP-NOW uplink: framing, batching and the ack
+   logic of both ends.
+
+   frame := magic(1) version(1) type(1) seq(2) boot(2) device_id(16) sensor(3)
+            count(1) count * { age_s(4) value(4) } crc16(2)
+
+   All integers are little-endian. 'age_s' is how many seconds before the
+   frame was sent the readout was taken; the gateway turns it back into a
+   wall clock timestamp, so battery devices never need to sync time.
+   'seq' lives in RTC memory and starts over after a power loss; 'boot'
+   is a counter kept in NVS that changes whenever it does, so the gateway
+   tells a restarted device from a retransmission. */
+
+#define ESPNOW_FRAME_MAGIC 0xB7
+#define ESPNOW_FRAME_VERSION 2
+#define ESPNOW_FRAME_MAX_LEN 250            // ESP_NOW_MAX_DATA_LEN
+
+#define ESPNOW_DEVICE_ID_LEN 16
+#define ESPNOW_SENSOR_CODE_LEN 3
+
+#define ESPNOW_HEADER_LEN (7 + ESPNOW_DEVICE_ID_LEN + ESPNOW_SENSOR_CODE_LEN + 1)
+#define ESPNOW_READOUT_LEN 8
+#define ESPNOW_CRC_LEN 2
+#define ESPNOW_MAX_READOUTS ((ESPNOW_FRAME_MAX_LEN - ESPNOW_HEADER_LEN - ESPNOW_CRC_LEN) / ESPNOW_READOUT_LEN)
+
+#define ESPNOW_ACK_TIMEOUT_MS 50
+#define ESPNOW_MAX_RETRIES 5
+
+#define GATEWAY_MAX_PEERS 64                // devices tracked for duplicates, more than the radio keeps as peers
+#define GATEWAY_BATCH_SIZE 512              // readouts buffered before forwarding upstream
+
+typedef enum {
+    ESPNOW_FRAME_DATA = 1,
+    ESPNOW_FRAME_ACK = 2,
+} espnow_frame_type_t;
+
+typedef struct {
+    uint32_t age;
+    int32_t value;
+} espnow_readout_t;
+
+typedef struct {
+    uint8_t type;
+    uint16_t seq;
+    uint16_t boot;
+    uint8_t device_id[ESPNOW_DEVICE_ID_LEN];
+    char sensor_code[ESPNOW_SENSOR_CODE_LEN + 1];
+    uint8_t count;
+    espnow_readout_t readouts[ESPNOW_MAX_READOUTS];
+} espnow_frame_t;
+
+/* Link the sender runs over: the radio on the device, a lossy simulation
+   on the host. 'wait_ack' blocks for up to 'timeout_ms' and returns 0 once
+   an ACK frame carrying 'seq' arrives. */
+typedef struct {
+    int (*send)(void* ctx, const uint8_t* data, size_t len);
+    int (*wait_ack)(void* ctx, uint16_t seq, int timeout_ms);
+    void* ctx;
+} espnow_transport_t;
+
+/* Sender side of the link, kept in RTC memory across wakes. A frame that
+   ran out of retries may still have reached the gateway, so the next
+   sync sends the same readouts again under the same seq. */
+typedef struct {
+    uint16_t seq;                           // last frame sent
+    uint16_t boot;
+    uint8_t unacked;                        // readouts in frame 'seq' if it was never acknowledged
+    char unacked_code[ESPNOW_SENSOR_CODE_LEN + 1];
+} espnow_sender_t;
+
+typedef struct {
+    uint8_t device_id[ESPNOW_DEVICE_ID_LEN];
+    char sensor_code[ESPNOW_SENSOR_CODE_LEN + 1];
+    time_t timestamp;
+    int value;
+} gateway_readout_t;
+
+typedef struct {
+    uint8_t device_id[ESPNOW_DEVICE_ID_LEN];
+    uint16_t last_seq;
+    uint16_t last_boot;
+    uint32_t last_used;
+} gateway_peer_t;
+
+typedef struct {
+    gateway_peer_t peers[GATEWAY_MAX_PEERS];
+    int peer_count;
+    uint32_t clock;                         // bumped per accepted frame, orders peers by last use
+    gateway_readout_t readouts[GATEWAY_BATCH_SIZE];
+    int readout_count;
+} espnow_gateway_t;
+
+uint16_t espnow_crc16(const uint8_t* data, size_t len);
+
+int espnow_encode_frame(const espnow_frame_t* frame, uint8_t* buf, size_t size);
+
+int espnow_decode_frame(const uint8_t* buf, size_t len, espnow_frame_t* frame);
+
+int espnow_parse_device_id(const char* uuid, uint8_t* device_id);
+
+void espnow_format_device_id(const uint8_t* device_id, char* uuid);
+
+int espnow_send_readouts(const espnow_transport_t* transport, const uint8_t* device_id,
+    espnow_sender_t* sender, const char* sensor_code, const espnow_readout_t* readouts, int count);
+
+void espnow_gateway_init(espnow_gateway_t* gateway);
+
+int espnow_gateway_accept(espnow_gateway_t* gateway, const espnow_frame_t* frame, time_t now);
+
+#endif
@@ -20,6 +20,7 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include "esp_spiffs.h"
 #include <sys/unistd.h>
@@ -45,19 +46,27 @@
 #include "sensors.h"
 #include "storage.h"
 #include "wifi.h"
+#include "upload.h"
+#include "espnow.h"
+#include "power.h"
+#include "supervisor.h"
+#include "blog.h"
+#include "ota.h"
+#include "scheduler.h"
+#include "settings.h"
+#include "maint.h"
 
 
 
-/* Constants that aren't configurable in menuconfig */
-#define WEB_SERVER "buratino.asobolev.ru"
-#define WEB_PORT 80
-#define WEB_URL "http://buratino.asobolev.ru/api/v1/devices/2e52e67d-d0f5-4f87-b7b6-9aae97a42623/readouts"
-
-/* Sheduling configuration
-   TODO: make configurable by the user
+/* Sheduling configuration, firmware defaults the server may override
+   (see remote_config.h)
 */ 
-#define DEEP_SLEEP_DELAY 10     // delay between reboots, in ms
-#define FREQ_SYNC 1             // sync data to the server every X reboots
+#define DEEP_SLEEP_DELAY 10     // delay between reboots, in s, stretched on low battery
+#define FREQ_SYNC 1             // sync data to the server every X reboots, stretched on low battery
+#define UPLOAD_CHUNK 128        // readouts per upload request
+#define RESPONSE_LEN 512        // kept part of the upload response body
+
+#define CLOCK_NAMESPACE "clock"
 
 
  
@@ -72,239 +81,646 @@ static const char *TAG = "main";
 RTC_DATA_ATTR static int boot_count = 0;
 RTC_DATA_ATTR static struct timeval sleep_enter_time;
 
+/* Bitmask of sensors whose readout was skipped because the sensors phase
+   ran out of time; they are read on the next wake regardless of their
+   read frequency. */
+RTC_DATA_ATTR static int pending_sensors = 0;
+
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+// open aggregation window of every sensor
+RTC_DATA_ATTR static aggregate_window_t sensor_windows[MAX_SENSORS];
+#endif
 
-static void http_get_task(char* REQUEST);
 
+static void reset_rtc_state(esp_reset_reason_t reason);
+static time_t load_time_base();
+static void save_time_base(time_t time_base);
+
+#if CONFIG_BURATINO_UPLINK_ESPNOW
+static void sync_espnow(sensor_settings_t* sensors, unsigned long sleep_time_ms);
+static int send_readouts_espnow(const sensor_settings_t* sensor, unsigned long sleep_time_ms);
+#else
+static void sync_wifi(sensor_settings_t* sensors, unsigned long sleep_time_ms);
+static void finish_sync(int success, int answered, const char* response);
+static int upload_telemetry();
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+static int upload_aggregates(const sensor_settings_t* sensor, char* response, size_t response_size);
+#else
+static int upload_readouts(const sensor_settings_t* sensor, char* response, size_t response_size);
+#endif
+#endif
 
 
 void app_main()
 {
+    // cap the time spent awake, whatever phase gets stuck
+    supervisor_start(DEEP_SLEEP_DELAY);
+    blog_init();
+
+    // init NVS flash storage
+    ESP_ERROR_CHECK( nvs_flash_init() );
+
+    // RTC memory only carries over deep sleep, not a reset or an image switch
+    esp_reset_reason_t reset_reason = esp_reset_reason();
+    if (reset_reason != ESP_RST_DEEPSLEEP) {
+        reset_rtc_state(reset_reason);
+    }
+
     ++boot_count;
-    ESP_LOGI(TAG, "Boot count: %d", boot_count);  // boot counts between deep sleep sessions
+    BLOGI(TAG, "Boot count: %d", boot_count);  // boot counts between deep sleep sessions
 
     struct timeval now;
 
     gettimeofday(&now, NULL);
     unsigned long currentMillis = xTaskGetTickCount();
     unsigned long sleep_time_ms = (now.tv_sec - sleep_enter_time.tv_sec) * 1000 + (now.tv_usec - sleep_enter_time.tv_usec) / 1000;
-    ESP_LOGI(TAG, "Sleep enter time: %f\n", (double)sleep_enter_time.tv_sec);
-    ESP_LOGI(TAG, "Time spent in deep sleep: %lu ms\n", sleep_time_ms);
+    BLOGI(TAG, "Sleep enter time: %lu s", sleep_enter_time.tv_sec);
+    BLOGI(TAG, "Time spent in deep sleep: %lu ms", sleep_time_ms);
+
+    // strap or serial command: stream the storage partition to the host instead
+    maint_check(sleep_enter_time.tv_sec);
 
     // init SPIFFS filesystem
     storage_init();
 
-    // init NVS flash storage
-    ESP_ERROR_CHECK( nvs_flash_init() );
+    // formatting a fresh partition takes seconds, the boot budget starts after it
+    supervisor_phase(WAKE_PHASE_BOOT);
+
+#if CONFIG_BURATINO_OTA
+    // roll back a freshly installed firmware that never reached the server
+    ota_boot_check();
+#endif
+
+    // settings pushed by the server on an earlier sync
+    const remote_config_t* config = settings_load();
+    int deep_sleep_delay = config->deep_sleep_delay > 0 ? config->deep_sleep_delay : DEEP_SLEEP_DELAY;
+    int freq_sync = config->freq_sync > 0 ? config->freq_sync : FREQ_SYNC;
+
+    if (config->wifi_ssid[0]) {
+        wifi_set_credentials(config->wifi_ssid, config->wifi_pass);
+    }
+    if (config->server_host[0]) {
+        upload_set_server(config->server_host, config->server_port);
+    }
+
+#if CONFIG_BURATINO_GATEWAY
+    // mains powered gateway never sleeps
+    supervisor_stop();
+    gateway_run();
+#endif
 
     // init sensor settings
     sensor_settings_t* sensors = malloc(sizeof(sensor_settings_t) * get_sensor_number());
     sensor_settings_init(sensors);
 
+    for (int i = 0; i < get_sensor_number(); i++) {
+        sensors[i].read_frequency = remote_config_read_frequency(config, sensors[i].code, sensors[i].read_frequency);
+    }
 
-    switch (esp_sleep_get_wakeup_cause()) {
-        case ESP_SLEEP_WAKEUP_UNDEFINED: {
+    // pick sleep and sync intervals for the current battery level
+    const power_profile_t* power = power_init(deep_sleep_delay, freq_sync);
+#if CONFIG_BURATINO_UPLINK_ESPNOW
+    int sync_now = power->sync_every > 0 && boot_count % power->sync_every == 0;
+#else
+    // Wi-Fi syncs follow the slot assigned by the server, see sync_slot.h
+    scheduler_init(power->sync_every * power->sleep_delay);
+    int sync_now = power->sync_every > 0 && scheduler_sync_due();
+#endif
+    supervisor_set_sleep_delay(power->sleep_delay);
 
-            // not a deep sleep reboot
-            ESP_LOGI(TAG, "Cleaning readout data files");
 
-            for (int i = 0; i < get_sensor_number(); i++) {
-                flush_readouts(sensors[i].code);
-            }
+    if (reset_reason == ESP_RST_POWERON) {
+
+        // the clock restarted, stored readout offsets count from a lost time base
+        BLOGI(TAG, "Cleaning readout data files");
+
+        for (int i = 0; i < get_sensor_number(); i++) {
+            flush_readouts(sensors[i].code);
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+            flush_aggregates(sensors[i].code);
+#endif
         }
-        default:
-            ESP_LOGI(TAG, "Normal deep sleep reboot\n");
+        save_time_base(0);
+    } else if (reset_reason == ESP_RST_DEEPSLEEP) {
+        BLOGI(TAG, "Normal deep sleep reboot");
+    } else {
+        BLOGI(TAG, "Reset, reason %d, keeping readout data files", reset_reason);
     }
 
+    supervisor_phase_done();
+
     // perform sensor readouts
+    supervisor_phase(WAKE_PHASE_SENSORS);
+
+    int* readout_values = malloc(sizeof(int) * get_sensor_number());
+    int readout_taken = 0;
+
     for (int i = 0; i < get_sensor_number(); i++) {
         
-        if (boot_count % sensors[i].read_frequency == 0) {
-            dump_readout(sensors[i].code, sleep_time_ms, sensors[i].read());    
+        if (boot_count % sensors[i].read_frequency == 0 || pending_sensors & (1 << i)) {
+            if (supervisor_remaining_ms() == 0) {
+                pending_sensors |= 1 << i;
+                continue;
+            }
+            readout_values[i] = sensors[i].read();
+            readout_taken |= 1 << i;
+            pending_sensors &= ~(1 << i);
         }
     }
 
+    supervisor_phase_done();
+
+    // store sensor readouts
+    supervisor_phase(WAKE_PHASE_STORAGE);
+
+    for (int i = 0; i < get_sensor_number(); i++) {
+        if (readout_taken & (1 << i)) {
+            dump_readout(sensors[i].code, sleep_time_ms, readout_values[i]);
+
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+            aggregate_window_t* window = &sensor_windows[i];
+
+            if (aggregate_due(window, sleep_time_ms, CONFIG_BURATINO_AGGREGATE_WINDOW * 1000UL)) {
+                aggregate_record_t record;
+                aggregate_close(window, &record);
+                dump_aggregate(sensors[i].code, &record);
+                aggregate_reset(window, sleep_time_ms);
+            } else if (window->count == 0) {
+                aggregate_reset(window, sleep_time_ms);
+            }
+            aggregate_add(window, readout_values[i]);
+#endif
+        }
+    }
+    free(readout_values);
+
+    supervisor_phase_done();
+
+    if (sync_now) {
+#if CONFIG_BURATINO_UPLINK_ESPNOW
+        sync_espnow(sensors, sleep_time_ms);
+#else
+        sync_wifi(sensors, sleep_time_ms);
+#endif
+    }
+
+    // unmount SPIFFS filesystem
+    storage_close();
+
+    supervisor_stop();
+
+#if CONFIG_BURATINO_OTA
+    // the other image must not wake up into our RTC memory
+    if (ota_restart_due()) {
+        BLOGI(TAG, "Restarting into the other firmware image");
+        blog_flush();
+        esp_restart();
+    }
+#endif
+
+    int sleep_delay = power->sleep_delay;
+#if !CONFIG_BURATINO_UPLINK_ESPNOW
+    // wake up right at the sync slot
+    sleep_delay = scheduler_sleep_delay(sleep_delay);
+#endif
+
+    //const int deep_sleep_sec = 10;
+    BLOGI(TAG, "Entering deep sleep for %d seconds", sleep_delay);
+    blog_flush();
+    esp_deep_sleep(1000000LL * sleep_delay);
+}
+
+
+/* Starts RTC memory over after any reset, without relying on the
+   bootloader to reload it. Readout offsets count from sleep_enter_time,
+   so it is taken back from NVS unless the clock itself restarted. */
+static void reset_rtc_state(esp_reset_reason_t reason)
+{
+    boot_count = 0;
+    pending_sensors = 0;
+    memset(&sleep_enter_time, 0, sizeof(sleep_enter_time));
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        aggregate_reset(&sensor_windows[i], 0);
+    }
+#endif
+
+    if (reason != ESP_RST_POWERON) {
+        sleep_enter_time.tv_sec = load_time_base();
+    }
+}
+
+
+static time_t load_time_base()
+{
+    nvs_handle nvs;
+    int64_t time_base = 0;
+
+    if (nvs_open(CLOCK_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_i64(nvs, "base", &time_base);
+        nvs_close(nvs);
+    }
+    return (time_t)time_base;
+}
+
+
+static void save_time_base(time_t time_base)
+{
+    nvs_handle nvs;
+
+    if (nvs_open(CLOCK_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save the time base");
+        return;
+    }
+    nvs_set_i64(nvs, "base", time_base);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+
+#if CONFIG_BURATINO_UPLINK_ESPNOW
+/* Hands stored readouts over to the gateway, no Wi-Fi association needed */
+static void sync_espnow(sensor_settings_t* sensors, unsigned long sleep_time_ms)
+{
+    supervisor_phase(WAKE_PHASE_CONNECT);
+    espnow_uplink_init();
+    supervisor_phase_done();
+
+    supervisor_phase(WAKE_PHASE_UPLOAD);
+
+    // a frame that may have reached the gateway unacknowledged must be the next one sent
+    const char* unacked = espnow_uplink_unacked();
+    int first = 0;
+
+    for (int i = 0; i < get_sensor_number(); i++) {
+        if (unacked != NULL && strcmp(sensors[i].code, unacked) == 0) {
+            first = i;
+        }
+    }
+
+    for (int n = 0; n < get_sensor_number() && supervisor_remaining_ms() > 0; n++) {
+        if (send_readouts_espnow(&sensors[(first + n) % get_sensor_number()], sleep_time_ms) != 0) {
+            break;
+        }
+    }
+
+    supervisor_phase_done();
+
+    espnow_uplink_stop();
+}
+
 
+/* Sends the stored readouts of a sensor in chunks of UPLOAD_CHUNK, read
+   through the time index like upload_readouts() does. Readouts the
+   gateway acknowledged are removed, the rest stays for the next sync.
+   Returns -1 if the gateway stopped answering, 0 otherwise. */
+static int send_readouts_espnow(const sensor_settings_t* sensor, unsigned long sleep_time_ms)
+{
+    readout_range_t range;
+
+    if (read_range(sensor->code, 0, ULONG_MAX, &range) != 0) {
+        return 0;
+    }
+
+    unsigned long* times = malloc(UPLOAD_CHUNK * sizeof(unsigned long));
+    espnow_readout_t* readouts = malloc(UPLOAD_CHUNK * sizeof(espnow_readout_t));
+    int delivered = 0;
+    int done = 0;
+    int failed = 0;
+    unsigned long delivered_until = 0;
+
+    while (!done && supervisor_remaining_ms() > 0) {
+        int readout_cnt = 0;
+        int value;
+
+        while (readout_cnt < UPLOAD_CHUNK
+                && read_range_next(&range, &times[readout_cnt], &value)) {
+            readouts[readout_cnt].age = (sleep_time_ms - times[readout_cnt]) / 1000;
+            readouts[readout_cnt].value = value;
+            readout_cnt++;
+        }
+        done = readout_cnt < UPLOAD_CHUNK;
+
+        if (readout_cnt == 0) {
+            break;
+        }
+
+        int sent = espnow_uplink_send(sensor->code, readouts, readout_cnt);
+
+        if (sent > 0) {
+            delivered = 1;
+            delivered_until = times[sent - 1];
+        }
+        if (sent < readout_cnt) {
+            done = 0;
+            failed = 1;
+            break;
+        }
+    }
+    read_range_close(&range);
+
+    if (done) {
+        flush_readouts(sensor->code);
+    } else if (delivered) {
+        prune_readouts(sensor->code, delivered_until + 1);
+    }
+
+    free(times);
+    free(readouts);
+
+    return failed ? -1 : 0;
+}
+#else
+/* Syncs stored readouts to the cloud. Readouts stay in storage until the
+   server accepts them, so any phase that runs out of time simply leaves
+   the rest for the next sync. */
+static void sync_wifi(sensor_settings_t* sensors, unsigned long sleep_time_ms)
+{
     struct tm timeinfo;
-    // sync data to the cloud
-    if (boot_count % FREQ_SYNC == 0) {
-        time_t time_now;
-        time(&time_now);
-        localtime_r(&time_now, &timeinfo);
+    time_t time_now;
+    time(&time_now);
+    localtime_r(&time_now, &timeinfo);
+
+    supervisor_phase(WAKE_PHASE_CONNECT);
+    int attempted = supervisor_remaining_ms() > 0;
+    int connected = attempted && initialise_wifi(supervisor_remaining_ms()) == 0;
+    supervisor_phase_done();
+
+    if (!connected) {
+        stop_wifi();
+        finish_sync(0, attempted ? 0 : -1, NULL);
+        return;
+    }
 
-        initialise_wifi();
+    // Is time set? If not, tm_year will be (1970 - 1900).
+    if (timeinfo.tm_year < (2016 - 1900)) {
+        BLOGI(TAG, "Time is not set yet. Getting time over NTP.");
 
+        supervisor_phase(WAKE_PHASE_TIME_SYNC);
+        int time_set = obtain_time(supervisor_remaining_ms()) == 0;
+        supervisor_phase_done();
 
-        // Is time set? If not, tm_year will be (1970 - 1900).
-        if (timeinfo.tm_year < (2016 - 1900)) {
-            ESP_LOGI(TAG, "Time is not set yet. Getting time over NTP.");
-            
-            obtain_time();
+        if (!time_set) {
+            stop_wifi();
+            finish_sync(0, 0, NULL);
+            return;
         }
+    }
  
-        // update sleep enter time
-        struct timeval act_time;
-        gettimeofday(&act_time, NULL);
+    // update sleep enter time, kept in NVS as well for resets that are not a power-on
+    struct timeval act_time;
+    gettimeofday(&act_time, NULL);
+    if (sleep_enter_time.tv_sec != act_time.tv_sec - (time_t)(sleep_time_ms / 1000)) {
         sleep_enter_time.tv_sec = act_time.tv_sec - sleep_time_ms / 1000;
+        save_time_base(sleep_enter_time.tv_sec);
+    }
 
-        char curr_time_buf[64];
+    supervisor_phase(WAKE_PHASE_UPLOAD);
 
-        for (int i = 0; i < get_sensor_number(); i++) {
+    // body of the last upload response, it may carry a sync slot and settings
+    char* response = calloc(1, RESPONSE_LEN);
+    int failed = response == NULL;
+    int answered = 0;
 
-            // reading stored sensor values to a buffer
-            int readout_cnt = get_readouts_count(sensors[i].code);
+    for (int i = 0; i < get_sensor_number() && !failed && supervisor_remaining_ms() > 0; i++) {
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+        int status = upload_aggregates(&sensors[i], response, RESPONSE_LEN);
 
-            if (readout_cnt == 0) {
-                continue;
-            }
-            unsigned long* times = malloc(readout_cnt * sizeof(unsigned long));
-            int* values = malloc(readout_cnt * sizeof(unsigned long));
-            char* req_body = malloc(readout_cnt * 128);
+        // raw readouts are only kept around for local inspection
+        unsigned long retention_ms = CONFIG_BURATINO_RAW_RETENTION * 3600000UL;
+        if (sleep_time_ms > retention_ms) {
+            expire_readouts(sensors[i].code, sleep_time_ms - retention_ms);
+        }
+#else
+        int status = upload_readouts(&sensors[i], response, RESPONSE_LEN);
+#endif
+        if (status != 0 && (status < 200 || status >= 300)) {
+            failed = 1;
+            break;
+        }
+        answered |= status != 0;
+    }
 
-            strcpy(req_body,  "[");
+    if (!failed && supervisor_remaining_ms() > 0) {
+        answered |= upload_telemetry() == 0;
+    }
 
-            for (int j=0; j < readout_cnt; j++) {
-                char readout[128];
-                
-                time_t readout_time = sleep_enter_time.tv_sec + times[j] / 1000;
-                localtime_r(&readout_time, &timeinfo);
-                strftime(curr_time_buf, sizeof(curr_time_buf), "%Y-%m-%dT%H:%M:%S", &timeinfo);
+    supervisor_phase_done();
 
-                if (j != 0) {
-                    strcat(req_body, ", ");
-                }
+#if CONFIG_BURATINO_OTA
+    // updates ride on the sync session, Wi-Fi is already up
+    supervisor_phase(WAKE_PHASE_UPDATE);
+    if (supervisor_remaining_ms() > 0) {
+        power_boost_begin();
+        ota_update(supervisor_remaining_ms());
+        power_boost_end();
+    }
+    supervisor_phase_done();
+#endif
 
-                snprintf(readout, 128, 
-                    "{\"timestamp\": \"%s\", \"sensor_type\": \"%s\", \"value\": %d}", 
-                    curr_time_buf, sensors[i].code, values[j]
-                );
+    stop_wifi();
 
-                strcat(req_body, readout);
-            }
+    // only a sync the server answered, and turned down nothing of, counts
+    finish_sync(answered && !failed, answered, response);
+    free(response);
+}
 
-            strcat(req_body,  "]");
-
-            // building request header
-            char req_header[1024];
-            snprintf(req_header, 1024, "POST " WEB_URL " HTTP/1.0\r\n"
-                "Host: "WEB_SERVER"\r\n"
-                "User-Agent: esp-idf/1.0 esp32\r\n"
-                "Accept: application/json\r\n"
-                "Connection: close\r\n"
-                "Content-Type: application/json\r\n"
-                "Content-Length: %d\r\n"
-                "\r\n", strlen(req_body));
-
-            
-            char* request = malloc(strlen(req_header) + strlen(req_body)); 
-            strcpy(request,  req_header);
-            strcat(request,  req_body);
-
-            ESP_LOGI(TAG, "FULL REQUEST: \n%s", request);
-            
-            free(times);
-            free(values);
-            free(req_body);
-            free(request);
-        }
 
-        // SYNC data
-        //xTaskCreate(&http_get_task, "http_get_task", 4096, NULL, 5, NULL);
-        //http_get_task(request);
-    
-        stop_wifi();
+/* Everything a sync brings back rides on the upload response: the sync
+   slot and settings, which take effect from the next wake. answered is
+   whether any request got a 2xx answer, -1 if the sync had no time left
+   to try; a freshly installed image is confirmed or blamed on it. */
+static void finish_sync(int success, int answered, const char* response)
+{
+#if CONFIG_BURATINO_OTA
+    if (answered >= 0) {
+        ota_sync_done(answered);
+    }
+#else
+    (void)answered;
+#endif
+    settings_sync_done(success);
+    if (response != NULL) {
+        settings_update(response);
     }
+    scheduler_sync_done(success, response);
+}
 
-    // unmount SPIFFS filesystem
-    storage_close();
 
-    //const int deep_sleep_sec = 10;
-    ESP_LOGI(TAG, "Entering deep sleep for %d seconds", DEEP_SLEEP_DELAY);
-    esp_deep_sleep(1000000LL * DEEP_SLEEP_DELAY);
+/* Reports phase overruns and hard cap hits of the supervisor, if there
+   were any since the last report. The counters are only reset once the
+   server accepted them. Returns 0 if the server did, -1 otherwise. */
+static int upload_telemetry()
+{
+    supervisor_telemetry_t telemetry;
+    const char* phase_names[WAKE_PHASE_COUNT];
+
+    if (!supervisor_telemetry(&telemetry)) {
+        return -1;
+    }
+    for (int i = 0; i < WAKE_PHASE_COUNT; i++) {
+        phase_names[i] = supervisor_phase_name(i);
+    }
+
+    char* req_body = build_telemetry_body(phase_names, telemetry.overruns, WAKE_PHASE_COUNT,
+        telemetry.hard_cap_hits);
+    if (req_body == NULL) {
+        return -1;
+    }
+    char* request = build_request(DEVICE_ID, "telemetry", req_body);
+
+    int status = request != NULL ? http_post(request, NULL, 0, supervisor_remaining_ms()) : -1;
+    int sent = status >= 200 && status < 300;
+    if (sent) {
+        supervisor_telemetry_sent(&telemetry);
+    } else {
+        ESP_LOGE(TAG, "Upload of telemetry failed, status %d", status);
+    }
+
+    free(req_body);
+    free(request);
+    return sent ? 0 : -1;
 }
 
 
-static void http_get_task(char* REQUEST)
+#if CONFIG_BURATINO_UPLOAD_AGGREGATES
+/* Posts the closed aggregation windows of a sensor, removing them once
+   the server accepted them. Returns the HTTP status, 0 if there was
+   nothing to post. */
+static int upload_aggregates(const sensor_settings_t* sensor, char* response, size_t response_size)
 {
-    const struct addrinfo hints = {
-        .ai_family = AF_INET,
-        .ai_socktype = SOCK_STREAM,
-    };
-    struct addrinfo *res;
-    struct in_addr *addr;
-    int s, r;
-    char recv_buf[64];
-
-    /* TODO: properly design the async calls
-        Wait for the callback to set the CONNECTED_BIT in the
-        event group.
-    */
-    //xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT,
-    //                    false, true, portMAX_DELAY);
-    //ESP_LOGI(TAG, "Connected to AP");
-
-
-    int err = getaddrinfo(WEB_SERVER, "80", &hints, &res);
-
-    if(err != 0 || res == NULL) {
-        ESP_LOGE(TAG, "DNS lookup failed err=%d res=%p", err, res);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        return;
+    int capacity = get_aggregates_count(sensor->code);
+
+    if (capacity == 0) {
+        return 0;
+    }
+    aggregate_record_t* records = malloc(capacity * sizeof(aggregate_record_t));
+    time_t* timestamps = malloc(capacity * sizeof(time_t));
+    if (records == NULL || timestamps == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate %d %s aggregates", capacity, sensor->code);
+        free(records);
+        free(timestamps);
+        return -1;
     }
 
-    /* Code to print the resolved IP.
-        Note: inet_ntoa is non-reentrant, look at ipaddr_ntoa_r for "real" code */
-    addr = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
-    ESP_LOGI(TAG, "DNS lookup succeeded. IP=%s", inet_ntoa(*addr));
+    // a line torn by a reset is counted but not read
+    int aggregate_cnt = get_aggregates(sensor->code, records, capacity);
+    if (aggregate_cnt == 0) {
+        free(records);
+        free(timestamps);
+        return 0;
+    }
 
-    s = socket(res->ai_family, res->ai_socktype, 0);
-    if(s < 0) {
-        ESP_LOGE(TAG, "... Failed to allocate socket.");
-        freeaddrinfo(res);
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
-        return;
+    for (int j = 0; j < aggregate_cnt; j++) {
+        timestamps[j] = sleep_enter_time.tv_sec + records[j].start / 1000;
     }
-    ESP_LOGI(TAG, "... allocated socket");
 
-    if(connect(s, res->ai_addr, res->ai_addrlen) != 0) {
-        ESP_LOGE(TAG, "... socket connect failed errno=%d", errno);
-        close(s);
-        freeaddrinfo(res);
-        vTaskDelay(4000 / portTICK_PERIOD_MS);
-        return;
+    power_boost_begin();
+
+    char* req_body = build_aggregates_body(sensor->code, timestamps, records, aggregate_cnt,
+        CONFIG_BURATINO_AGGREGATE_WINDOW);
+    char* request = req_body != NULL ? build_request(DEVICE_ID, "aggregates", req_body) : NULL;
+
+    int status = request != NULL ? http_post(request, response, response_size, supervisor_remaining_ms()) : -1;
+    if (status >= 200 && status < 300) {
+        flush_aggregates(sensor->code);
+    } else {
+        ESP_LOGE(TAG, "Upload of %s aggregates failed, status %d", sensor->code, status);
     }
 
-    ESP_LOGI(TAG, "... connected");
-    freeaddrinfo(res);
+    power_boost_end();
 
-    if (write(s, REQUEST, strlen(REQUEST)) < 0) {
-        ESP_LOGE(TAG, "... socket send failed");
-        close(s);
-        vTaskDelay(4000 / portTICK_PERIOD_MS);
-        return;
+    free(records);
+    free(timestamps);
+    free(req_body);
+    free(request);
+
+    return status;
+}
+#else
+/* Posts the stored readouts of a sensor in chunks of UPLOAD_CHUNK, read
+   through the time index rather than all at once. Chunks the server
+   accepted are removed; if the upload stops early the rest stays for the
+   next sync. Returns the HTTP status of the last post, 0 if there was
+   nothing to post. */
+static int upload_readouts(const sensor_settings_t* sensor, char* response, size_t response_size)
+{
+    readout_range_t range;
+
+    if (read_range(sensor->code, 0, ULONG_MAX, &range) != 0) {
+        return 0;
     }
-    ESP_LOGI(TAG, "... socket send success");
 
-    struct timeval receiving_timeout;
-    receiving_timeout.tv_sec = 5;
-    receiving_timeout.tv_usec = 0;
-    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &receiving_timeout,
-            sizeof(receiving_timeout)) < 0) {
-        ESP_LOGE(TAG, "... failed to set socket receiving timeout");
-        close(s);
-        vTaskDelay(4000 / portTICK_PERIOD_MS);
-        return;
+    unsigned long* times = malloc(UPLOAD_CHUNK * sizeof(unsigned long));
+    int* values = malloc(UPLOAD_CHUNK * sizeof(int));
+    time_t* timestamps = malloc(UPLOAD_CHUNK * sizeof(time_t));
+    if (times == NULL || values == NULL || timestamps == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate an upload chunk of %s readouts", sensor->code);
+        read_range_close(&range);
+        free(times);
+        free(values);
+        free(timestamps);
+        return -1;
     }
-    ESP_LOGI(TAG, "... set socket receiving timeout success");
+    int status = 0;
+    int delivered = 0;
+    int done = 0;
+    unsigned long delivered_until = 0;
+
+    while (!done && supervisor_remaining_ms() > 0) {
+        int readout_cnt = 0;
+
+        while (readout_cnt < UPLOAD_CHUNK
+                && read_range_next(&range, &times[readout_cnt], &values[readout_cnt])) {
+            readout_cnt++;
+        }
+        done = readout_cnt < UPLOAD_CHUNK;
 
-    /* Read HTTP response */
-    do {
-        bzero(recv_buf, sizeof(recv_buf));
-        r = read(s, recv_buf, sizeof(recv_buf)-1);
-        for(int i = 0; i < r; i++) {
-            putchar(recv_buf[i]);
+        if (readout_cnt == 0) {
+            break;
         }
-    } while(r > 0);
 
-    ESP_LOGI(TAG, "... done reading from socket. Last read return=%d errno=%d\r\n", r, errno);
-    close(s);
+        for (int j = 0; j < readout_cnt; j++) {
+            timestamps[j] = sleep_enter_time.tv_sec + times[j] / 1000;
+        }
+
+        power_boost_begin();
+
+        char* req_body = build_readouts_body(sensor->code, timestamps, values, readout_cnt);
+        char* request = req_body != NULL ? build_request(DEVICE_ID, "readouts", req_body) : NULL;
+
+        BLOGI(TAG, "Posting %d %s readouts", readout_cnt, sensor->code);
+        ESP_LOGD(TAG, "FULL REQUEST: \n%s", request != NULL ? request : "");
+
+        // SYNC data
+        status = request != NULL ? http_post(request, response, response_size, supervisor_remaining_ms()) : -1;
+
+        power_boost_end();
+
+        free(req_body);
+        free(request);
+
+        if (status < 200 || status >= 300) {
+            ESP_LOGE(TAG, "Upload of %s readouts failed, status %d", sensor->code, status);
+            done = 0;
+            break;
+        }
+        delivered = 1;
+        delivered_until = times[readout_cnt - 1];
+    }
+    read_range_close(&range);
+
+    if (done) {
+        flush_readouts(sensor->code);
+    } else if (delivered) {
+        prune_readouts(sensor->code, delivered_until + 1);
+    }
+
+    free(times);
+    free(values);
+    free(timestamps);
+
+    return status;
 }
+#endif
+#endif
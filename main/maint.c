@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "rom/crc.h"
+
+#include "maint.h"
+#include "supervisor.h"
+
+
+#define MAINT_UART UART_NUM_0
+#define MAINT_RX_BUF_LEN 256
+#define MAINT_TX_BUF_LEN (2 * MAINT_BLOCK_LEN)  // one block goes out while the next is read
+#define MAINT_HEADER_LEN 14
+#define MAINT_COMMAND_LEN 16
+#define MAINT_SWITCH_MS 200                     // time given to the host to follow the baud change
+#define MAINT_IDLE_MS 300000                    // reboot after this long without a command
+#define MAINT_LOG_PAGE_LEN 256                  // SPIFFS logical page used by esp_spiffs
+#define MAINT_TIME_VALID 1451606400             // 2016-01-01, earlier time bases were never synced
+
+#define FRAME_INFO 'I'
+#define FRAME_DATA 'D'
+#define FRAME_END 'E'
+
+
+// logging tag
+static const char *TAG = "maint";
+
+// sequence number of the next frame, restarts with every dump
+static uint16_t frame_seq = 0;
+
+static int strap_held();
+static int read_command(char* command, size_t size, int timeout_ms);
+static void maint_run(uint32_t time_base);
+static void stream_partition(const esp_partition_t* partition, uint32_t time_base);
+static void send_frame(uint8_t type, uint32_t offset, const uint8_t* payload, uint16_t len);
+static int is_erased(const uint8_t* block, size_t len);
+static void put_u32(uint8_t* buf, uint32_t value);
+
+
+void maint_check(uint32_t time_base)
+{
+    int strap = strap_held();
+    char command[MAINT_COMMAND_LEN];
+
+    if (!strap && (CONFIG_BURATINO_MAINT_LISTEN_MS == 0 ||
+                   esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED)) {
+        return;
+    }
+
+    ESP_ERROR_CHECK( uart_driver_install(MAINT_UART, MAINT_RX_BUF_LEN, MAINT_TX_BUF_LEN, 0, NULL, 0) );
+
+    if (!strap) {
+        // the host may have been repeating the command since before the boot
+        int len = read_command(command, sizeof(command), CONFIG_BURATINO_MAINT_LISTEN_MS);
+
+        if (len < 0 || strstr(command, "maint") == NULL) {
+            uart_driver_delete(MAINT_UART);
+            return;
+        }
+    }
+
+    maint_run(time_base);
+}
+
+
+static int strap_held()
+{
+    gpio_pad_select_gpio(CONFIG_BURATINO_MAINT_GPIO);
+    gpio_set_direction(CONFIG_BURATINO_MAINT_GPIO, GPIO_MODE_INPUT);
+    gpio_set_pull_mode(CONFIG_BURATINO_MAINT_GPIO, GPIO_PULLUP_ONLY);
+    vTaskDelay(1);      // let the pull-up charge the line
+
+    return gpio_get_level(CONFIG_BURATINO_MAINT_GPIO) == 0;
+}
+
+
+/* Reads one line from the console into command, without the line end.
+   Returns its length or -1 when no full line arrived within timeout_ms. */
+static int read_command(char* command, size_t size, int timeout_ms)
+{
+    TickType_t deadline = xTaskGetTickCount() + timeout_ms / portTICK_PERIOD_MS;
+    size_t len = 0;
+    uint8_t c;
+
+    for (;;) {
+        TickType_t now = xTaskGetTickCount();
+
+        if (now >= deadline) {
+            return -1;
+        }
+        if (uart_read_bytes(MAINT_UART, &c, 1, deadline - now) != 1) {
+            continue;
+        }
+        if (c == '\n' || c == '\r') {
+            if (len > 0) {
+                command[len] = '\0';
+                return len;
+            }
+        } else if (len < size - 1) {
+            command[len++] = c;
+        } else {
+            len = 0;        // line noise, start over
+        }
+    }
+}
+
+
+/* Stays in maintenance until the host says "reboot" or goes silent;
+   "dump" streams the partition again. The wake cycle supervisor is off,
+   the device never returns to deep sleep from here. */
+static void maint_run(uint32_t time_base)
+{
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    char command[MAINT_COMMAND_LEN];
+
+    supervisor_stop();
+
+    if (partition == NULL) {
+        ESP_LOGE(TAG, "Failed to find the storage partition");
+        esp_restart();
+    }
+
+    // the host waits for this line before switching its baud rate
+    char banner[40];
+    int len = snprintf(banner, sizeof(banner), "\nBURATINO MAINT %d\n", CONFIG_BURATINO_MAINT_BAUD);
+    uart_write_bytes(MAINT_UART, banner, len);
+    uart_wait_tx_done(MAINT_UART, portMAX_DELAY);
+
+    // nothing but frames from now on
+    esp_log_level_set("*", ESP_LOG_NONE);
+    vTaskDelay(MAINT_SWITCH_MS / portTICK_PERIOD_MS);
+    uart_set_baudrate(MAINT_UART, CONFIG_BURATINO_MAINT_BAUD);
+    uart_flush_input(MAINT_UART);
+
+    stream_partition(partition, time_base);
+
+    while (read_command(command, sizeof(command), MAINT_IDLE_MS) >= 0) {
+        if (strstr(command, "reboot") != NULL) {
+            break;
+        }
+        if (strstr(command, "dump") != NULL) {
+            stream_partition(partition, time_base);
+        }
+    }
+
+    uart_wait_tx_done(MAINT_UART, portMAX_DELAY);
+    esp_restart();
+}
+
+
+/* Sends the partition block by block, skipping erased blocks. A block
+   that fails to read ends the dump early; the host then sees the whole
+   partition CRC in the end frame disagree. */
+static void stream_partition(const esp_partition_t* partition, uint32_t time_base)
+{
+    uint8_t* block = malloc(MAINT_BLOCK_LEN);
+    uint8_t info[16];
+    uint8_t end[12];
+    uint32_t crc = 0;
+    uint32_t sent = 0;
+
+    if (block == NULL) {
+        return;
+    }
+
+    frame_seq = 0;
+    put_u32(info, partition->size);
+    put_u32(info + 4, MAINT_BLOCK_LEN);
+    put_u32(info + 8, MAINT_LOG_PAGE_LEN);
+    put_u32(info + 12, time_base >= MAINT_TIME_VALID ? time_base : 0);
+    send_frame(FRAME_INFO, 0, info, sizeof(info));
+
+    for (uint32_t offset = 0; offset < partition->size; offset += MAINT_BLOCK_LEN) {
+        size_t len = partition->size - offset < MAINT_BLOCK_LEN ? partition->size - offset : MAINT_BLOCK_LEN;
+
+        if (esp_partition_read(partition, offset, block, len) != ESP_OK) {
+            break;
+        }
+        crc = crc32_le(crc, block, len);
+
+        if (!is_erased(block, len)) {
+            send_frame(FRAME_DATA, offset, block, len);
+            sent++;
+        }
+    }
+
+    put_u32(end, partition->size);
+    put_u32(end + 4, crc);
+    put_u32(end + 8, sent);
+    send_frame(FRAME_END, 0, end, sizeof(end));
+    uart_wait_tx_done(MAINT_UART, portMAX_DELAY);
+
+    free(block);
+}
+
+
+static void send_frame(uint8_t type, uint32_t offset, const uint8_t* payload, uint16_t len)
+{
+    uint8_t header[MAINT_HEADER_LEN];
+    uint8_t trailer[4];
+
+    memcpy(header, MAINT_MAGIC, 4);
+    header[4] = type;
+    header[5] = 0;
+    header[6] = frame_seq & 0xff;
+    header[7] = frame_seq >> 8;
+    put_u32(header + 8, offset);
+    header[12] = len & 0xff;
+    header[13] = len >> 8;
+    frame_seq++;
+
+    uint32_t crc = crc32_le(0, header + 4, MAINT_HEADER_LEN - 4);
+    crc = crc32_le(crc, payload, len);
+    put_u32(trailer, crc);
+
+    uart_write_bytes(MAINT_UART, (const char*) header, sizeof(header));
+    uart_write_bytes(MAINT_UART, (const char*) payload, len);
+    uart_write_bytes(MAINT_UART, (const char*) trailer, sizeof(trailer));
+}
+
+
+static int is_erased(const uint8_t* block, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (block[i] != 0xff) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static void put_u32(uint8_t* buf, uint32_t value)
+{
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = value >> 24;
+}
@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+
+/* Maintenance mode streams the raw storage partition over the console
+   UART in framed blocks, decoded on the host by tools/storage_dump.py.
+   All fields are little-endian:
+
+     "BDMP" type:u8 flags:u8 seq:u16 offset:u32 len:u16 payload[len] crc:u32
+
+   crc is the CRC-32 (zlib) of everything from type to the end of the
+   payload. Frames are numbered by seq. Types:
+
+     'I' info: partition size, log block size, log page size, time base
+         (epoch second readout offsets count from, 0 when unknown), u32 each
+     'D' data: len bytes of the partition at offset; erased blocks are
+         not sent and read back as 0xff
+     'E' end: partition size, CRC-32 of the whole partition, data frames
+         sent, u32 each
+*/
+#define MAINT_MAGIC "BDMP"
+#define MAINT_BLOCK_LEN 4096
+
+
+/* Enters maintenance mode when CONFIG_BURATINO_MAINT_GPIO is held to
+   ground, or when "maint" arrives on the console within
+   CONFIG_BURATINO_MAINT_LISTEN_MS after a reset (deep sleep wakes do not
+   listen). Does not return in maintenance mode. Call before storage_init,
+   which would mount the partition and, after a reset, clear the logs. */
+void maint_check(uint32_t time_base);
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include "rom/miniz.h"
+
+#include "ota.h"
+#include "delta_patch.h"
+#include "upload.h"
+#include "blog.h"
+
+
+#define OTA_NAMESPACE "ota"
+#define OTA_MAX_RESETS 3                // crash resets of an unconfirmed image before rolling back
+#define OTA_MAX_ATTEMPTS 20             // syncs of an unconfirmed image without an answer before rolling back
+#define OTA_PATH_LEN 96
+
+
+// logging tag
+static const char *TAG = "ota";
+
+// boot slot switched, the other image runs after esp_restart()
+static int restart_due = 0;
+
+/* State of one update download. Inflated patch data goes straight into
+   the delta applier, whose output goes straight to the other app slot:
+   RAM use is the inflate dictionary plus a few small buffers. */
+typedef struct {
+    const esp_partition_t* running;
+    const esp_partition_t* update;
+    esp_ota_handle_t handle;
+    int started;
+    tinfl_decompressor inflator;
+    uint8_t* dict;
+    size_t dict_ofs;
+    int inflated;
+    delta_patch_t patch;
+} ota_session_t;
+
+static int confirm_image(nvs_handle nvs);
+static void roll_back(nvs_handle nvs, int count, const char* what);
+static int on_patch_data(void* ctx, int status, const char* data, size_t len);
+static int read_old(void* ctx, uint32_t offset, uint8_t* buf, size_t len);
+static int write_new(void* ctx, const uint8_t* buf, size_t len);
+static int finish_update(ota_session_t* session, int status);
+
+
+/* Guards a freshly installed image. Until the image has talked to the
+   server (see ota_sync_done) every reset other than a deep sleep wake or
+   a restart of our own is counted; an image that keeps crashing is
+   abandoned and the previous slot is booted again. Call early, right
+   after NVS init. */
+void ota_boot_check()
+{
+    nvs_handle nvs;
+    uint8_t pending = 0;
+
+    if (nvs_open(OTA_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    nvs_get_u8(nvs, "pending", &pending);
+
+    if (!pending) {
+        nvs_close(nvs);
+        return;
+    }
+
+    // the bootloader may have refused the new image and booted the old one
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    char slot[sizeof(running->label)] = "";
+    size_t slot_len = sizeof(slot);
+    nvs_get_str(nvs, "slot", slot, &slot_len);
+
+    if (strcmp(slot, running->label) != 0) {
+        ESP_LOGW(TAG, "Update to %s did not boot, staying on %s", slot, running->label);
+        confirm_image(nvs);
+        nvs_close(nvs);
+        return;
+    }
+
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (reason == ESP_RST_DEEPSLEEP || reason == ESP_RST_SW) {
+        nvs_close(nvs);
+        return;
+    }
+
+    uint16_t resets = 0;
+    nvs_get_u16(nvs, "resets", &resets);
+    resets++;
+
+    if (resets <= OTA_MAX_RESETS) {
+        nvs_set_u16(nvs, "resets", resets);
+        nvs_commit(nvs);
+        nvs_close(nvs);
+        BLOGI(TAG, "Unconfirmed image, %d resets so far", resets);
+        return;
+    }
+
+    roll_back(nvs, resets, "resets");
+    nvs_close(nvs);
+
+    if (restart_due) {
+        esp_restart();
+    }
+}
+
+
+/* Reports how a sync went for a freshly installed image. Any answer from
+   the server confirms it; syncs that tried and got none are counted, and
+   an image that never gets through is rolled back on the next
+   ota_restart_due(). Wakes that do not sync (low battery, no time left)
+   prove nothing either way and are not counted. */
+void ota_sync_done(int answered)
+{
+    nvs_handle nvs;
+    uint8_t pending = 0;
+
+    if (nvs_open(OTA_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    nvs_get_u8(nvs, "pending", &pending);
+
+    if (!pending) {
+        nvs_close(nvs);
+        return;
+    }
+
+    if (answered) {
+        BLOGI(TAG, "Running image confirmed");
+        confirm_image(nvs);
+        nvs_close(nvs);
+        return;
+    }
+
+    uint16_t attempts = 0;
+    nvs_get_u16(nvs, "attempts", &attempts);
+    attempts++;
+
+    if (attempts <= OTA_MAX_ATTEMPTS) {
+        nvs_set_u16(nvs, "attempts", attempts);
+        nvs_commit(nvs);
+        BLOGI(TAG, "Unconfirmed image, %d syncs without an answer so far", attempts);
+    } else {
+        roll_back(nvs, attempts, "syncs without an answer");
+    }
+    nvs_close(nvs);
+}
+
+
+/* Returns 1 if the boot slot was switched by an update or a rollback. The
+   other image must then be started with esp_restart() instead of a deep
+   sleep wake: only a reset makes the bootloader load its own RTC memory
+   instead of handing it ours. */
+int ota_restart_due()
+{
+    return restart_due;
+}
+
+
+/* Asks the server for a patch from FIRMWARE_VERSION and applies it to the
+   other app slot while it downloads; the new image boots once
+   ota_restart_due() says so. An answer from the server also confirms a
+   freshly installed image. Returns 1 if an update was installed, 0 if
+   there is none and -1 on failure. */
+int ota_update(int timeout_ms)
+{
+    ota_session_t* session = calloc(1, sizeof(ota_session_t));
+    uint8_t* dict = malloc(TINFL_LZ_DICT_SIZE);
+
+    if (session == NULL || dict == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate update buffers");
+        free(session);
+        free(dict);
+        return -1;
+    }
+
+    session->running = esp_ota_get_running_partition();
+    session->update = esp_ota_get_next_update_partition(NULL);
+    session->dict = dict;
+    tinfl_init(&session->inflator);
+    delta_patch_init(&session->patch, read_old, write_new, session);
+
+    char path[OTA_PATH_LEN];
+    snprintf(path, OTA_PATH_LEN, "firmware?from=%s", FIRMWARE_VERSION);
+
+    int status = http_get(path, on_patch_data, session, timeout_ms);
+    int result = finish_update(session, status);
+
+    free(dict);
+    free(session);
+    return result;
+}
+
+
+static int confirm_image(nvs_handle nvs)
+{
+    nvs_set_u8(nvs, "pending", 0);
+    nvs_set_u16(nvs, "resets", 0);
+    nvs_set_u16(nvs, "attempts", 0);
+    return nvs_commit(nvs) == ESP_OK ? 0 : -1;
+}
+
+
+static void roll_back(nvs_handle nvs, int count, const char* what)
+{
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    const esp_partition_t* previous = esp_ota_get_next_update_partition(NULL);
+
+    ESP_LOGE(TAG, "Image in %s not confirmed after %d %s, rolling back to %s",
+        running->label, count, what, previous->label);
+
+    confirm_image(nvs);
+
+    if (esp_ota_set_boot_partition(previous) == ESP_OK) {
+        restart_due = 1;
+    } else {
+        ESP_LOGE(TAG, "Rollback failed, previous image is not valid");
+    }
+}
+
+
+/* Inflates a chunk of the zlib compressed patch and feeds it to the
+   delta applier */
+static int on_patch_data(void* ctx, int status, const char* data, size_t len)
+{
+    ota_session_t* session = ctx;
+    const uint8_t* in = (const uint8_t*)data;
+    size_t in_left = len;
+
+    if (status != 200) {
+        return 0;
+    }
+
+    while (!session->inflated) {
+        size_t in_bytes = in_left;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - session->dict_ofs;
+
+        tinfl_status inflate_status = tinfl_decompress(&session->inflator, in, &in_bytes,
+            session->dict, session->dict + session->dict_ofs, &out_bytes,
+            TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_PARSE_ZLIB_HEADER);
+
+        in += in_bytes;
+        in_left -= in_bytes;
+
+        if (out_bytes > 0
+                && delta_patch_feed(&session->patch, session->dict + session->dict_ofs, out_bytes) != DELTA_OK) {
+            ESP_LOGE(TAG, "Patch rejected, error %d", session->patch.status);
+            return -1;
+        }
+        session->dict_ofs = (session->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+        if (inflate_status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Patch is not valid zlib data, error %d", inflate_status);
+            return -1;
+        }
+        if (inflate_status == TINFL_STATUS_DONE) {
+            session->inflated = 1;
+        } else if (inflate_status == TINFL_STATUS_NEEDS_MORE_INPUT && in_left == 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+static int read_old(void* ctx, uint32_t offset, uint8_t* buf, size_t len)
+{
+    ota_session_t* session = ctx;
+
+    return esp_partition_read(session->running, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+
+/* The slot is only erased once the patch header proved to match the
+   running image, and only as far as the new image reaches */
+static int write_new(void* ctx, const uint8_t* buf, size_t len)
+{
+    ota_session_t* session = ctx;
+
+    if (!session->started) {
+        if (esp_ota_begin(session->update, session->patch.new_size, &session->handle) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start writing to %s", session->update->label);
+            return -1;
+        }
+        session->started = 1;
+    }
+
+    return esp_ota_write(session->handle, buf, len) == ESP_OK ? 0 : -1;
+}
+
+
+/* Validates the written image and switches the boot slot to it; the
+   switch is marked pending until the new image reaches the server */
+static int finish_update(ota_session_t* session, int status)
+{
+    nvs_handle nvs;
+    int result = -1;
+
+    if (status < 0) {
+        ESP_LOGE(TAG, "Update check failed");
+    } else {
+        // the server answered, so the running image works
+        ota_sync_done(1);
+    }
+
+    if (status == 204 || status == 304) {
+        BLOGI(TAG, "Firmware is up to date");
+        return 0;
+    }
+    if (status != 200) {
+        if (status >= 0) {
+            ESP_LOGE(TAG, "Unexpected update check status %d", status);
+        }
+        if (session->started) {
+            esp_ota_end(session->handle);
+        }
+        return -1;
+    }
+
+    delta_status_t patch_status = session->inflated ? delta_patch_finish(&session->patch) : DELTA_ERR_FORMAT;
+    if (patch_status != DELTA_OK) {
+        ESP_LOGE(TAG, "Incomplete or invalid patch, error %d", patch_status);
+    }
+
+    if (session->started && esp_ota_end(session->handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Image in %s failed validation", session->update->label);
+        patch_status = DELTA_ERR_NEW_IMAGE;
+    }
+
+    if (patch_status != DELTA_OK || nvs_open(OTA_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return -1;
+    }
+
+    // marked pending before switching, a switch that fails is cleared on the next boot
+    nvs_set_str(nvs, "slot", session->update->label);
+    nvs_set_u8(nvs, "pending", 1);
+    nvs_set_u16(nvs, "resets", 0);
+    nvs_set_u16(nvs, "attempts", 0);
+    if (nvs_commit(nvs) == ESP_OK && esp_ota_set_boot_partition(session->update) == ESP_OK) {
+        restart_due = 1;
+        result = 1;
+    }
+    nvs_close(nvs);
+
+    if (result == 1) {
+        BLOGI(TAG, "Update of %d bytes installed, restarting into it", session->patch.new_size);
+    }
+    return result;
+}
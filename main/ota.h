@@ -0,0 +1,12 @@
+#ifndef FIRMWARE_VERSION
+#define FIRMWARE_VERSION "unknown"
+#endif
+
+
+void ota_boot_check();
+
+void ota_sync_done(int answered);
+
+int ota_restart_due();
+
+int ota_update(int timeout_ms);
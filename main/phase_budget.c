@@ -0,0 +1,48 @@
+#include "phase_budget.h"
+
+
+void phase_budget_start(phase_budget_t* budget, phase_clock_t now_ms, const int* phase_budgets_ms,
+    int total_budget_ms, uint32_t* overruns)
+{
+    budget->now_ms = now_ms;
+    budget->phase_budgets_ms = phase_budgets_ms;
+    budget->total_budget_ms = total_budget_ms;
+    budget->overruns = overruns;
+    budget->wake_start_ms = now_ms();
+    budget->phase_start_ms = budget->wake_start_ms;
+    budget->phase = WAKE_PHASE_BOOT;
+}
+
+
+void phase_budget_begin(phase_budget_t* budget, wake_phase_t phase)
+{
+    budget->phase = phase;
+    budget->phase_start_ms = budget->now_ms();
+}
+
+
+/* Time the current phase may still spend: the smaller of what is left of
+   its own deadline and of the total awake budget. 0 once either is
+   exhausted, phases poll this and give up their work when it hits 0. */
+int phase_budget_remaining_ms(const phase_budget_t* budget)
+{
+    int64_t now = budget->now_ms();
+    int64_t phase_left = budget->phase_start_ms + budget->phase_budgets_ms[budget->phase] - now;
+    int64_t total_left = budget->wake_start_ms + budget->total_budget_ms - now;
+    int64_t left = phase_left < total_left ? phase_left : total_left;
+
+    return left > 0 ? (int)left : 0;
+}
+
+
+/* Closes the current phase. Returns 1 and counts an overrun if the phase
+   ran out of time, 0 otherwise. */
+int phase_budget_end(phase_budget_t* budget)
+{
+    if (phase_budget_remaining_ms(budget) > 0) {
+        return 0;
+    }
+
+    budget->overruns[budget->phase]++;
+    return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef PHASE_BUDGET_H_
+#define PHASE_BUDGET_H_
+
+#include <stdint.h>
+
+/* Deadline bookkeeping of the wake-cycle supervisor. Time comes from an
+   injected clock. */
+
+typedef enum {
+    WAKE_PHASE_BOOT = 0,
+    WAKE_PHASE_SENSORS,
+    WAKE_PHASE_STORAGE,
+    WAKE_PHASE_CONNECT,
+    WAKE_PHASE_TIME_SYNC,
+    WAKE_PHASE_UPLOAD,
+    WAKE_PHASE_UPDATE,
+    WAKE_PHASE_COUNT
+} wake_phase_t;
+
+typedef int64_t (*phase_clock_t)();
+
+typedef struct {
+    phase_clock_t now_ms;
+    const int* phase_budgets_ms;        // indexed by wake_phase_t
+    int total_budget_ms;
+    int64_t wake_start_ms;
+    int64_t phase_start_ms;
+    wake_phase_t phase;
+    uint32_t* overruns;                 // WAKE_PHASE_COUNT counters, owned by the caller
+} phase_budget_t;
+
+void phase_budget_start(phase_budget_t* budget, phase_clock_t now_ms, const int* phase_budgets_ms,
+    int total_budget_ms, uint32_t* overruns);
+
+void phase_budget_begin(phase_budget_t* budget, wake_phase_t phase);
+
+int phase_budget_remaining_ms(const phase_budget_t* budget);
+
+int phase_budget_end(phase_budget_t* budget);
+
+#endif
@@ -0,0 +1,68 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_pm.h"
+
+#include "power.h"
+#include "sensors.h"
+#include "blog.h"
+
+
+// logging tag
+static const char *TAG = "power";
+
+/* Level picked on the previous wake, kept in RTC memory so the
+   hysteresis survives deep sleep */
+RTC_DATA_ATTR static power_level_t power_level = POWER_LEVEL_NORMAL;
+
+static power_profile_t profile;
+static esp_pm_lock_handle_t boost_lock = NULL;
+
+
+/* Enables dynamic frequency scaling and picks this wake's power profile
+   from the battery voltage. Without a boost lock held the CPU runs at
+   80 MHz, which is plenty for ADC reads and the bit-banged DS18B20 bus. */
+const power_profile_t* power_init(int base_sleep_delay, int base_sync)
+{
+    esp_pm_config_esp32_t pm_config = {
+        .max_cpu_freq = RTC_CPU_FREQ_160M,
+        .min_cpu_freq = RTC_CPU_FREQ_80M,
+        .light_sleep_enable = false
+    };
+
+    esp_err_t ret = esp_pm_configure(&pm_config);
+    if (ret == ESP_OK) {
+        ret = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "boost", &boost_lock);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Frequency scaling is not available (%d), staying at default frequency", ret);
+    }
+
+    int battery_mv = read_battery_voltage();
+    power_level = power_policy_level(battery_mv, power_level);
+    power_policy_profile(power_level, base_sleep_delay, base_sync, &profile);
+
+    BLOGI(TAG, "Battery %d mV, power level %d: sleep %d s, sync every %d wakes",
+        battery_mv, profile.level, profile.sleep_delay, profile.sync_every);
+
+    return &profile;
+}
+
+
+/* Runs the CPU at full speed until power_boost_end(), for CPU bound
+   phases like serializing and sending uploads: finishing them sooner
+   lets the radio go down sooner. */
+void power_boost_begin()
+{
+    if (boost_lock != NULL) {
+        esp_pm_lock_acquire(boost_lock);
+    }
+}
+
+
+void power_boost_end()
+{
+    if (boost_lock != NULL) {
+        esp_pm_lock_release(boost_lock);
+    }
+}
@@ -0,0 +1,8 @@
+#include "power_policy.h"
+
+
+const power_profile_t* power_init(int base_sleep_delay, int base_sync);
+
+void power_boost_begin();
+
+void power_boost_end();
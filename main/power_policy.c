@@ -0,0 +1,55 @@
+#include "power_policy.h"
+
+
+static const int level_thresholds[] = {
+    [POWER_LEVEL_SAVING] = BATTERY_MV_SAVING,
+    [POWER_LEVEL_LOW] = BATTERY_MV_LOW,
+    [POWER_LEVEL_CRITICAL] = BATTERY_MV_CRITICAL,
+};
+
+static const int sleep_multipliers[] = {
+    [POWER_LEVEL_NORMAL] = 1,
+    [POWER_LEVEL_SAVING] = 2,
+    [POWER_LEVEL_LOW] = 4,
+    [POWER_LEVEL_CRITICAL] = 16,
+};
+
+static const int sync_multipliers[] = {
+    [POWER_LEVEL_NORMAL] = 1,
+    [POWER_LEVEL_SAVING] = 2,
+    [POWER_LEVEL_LOW] = 4,
+    [POWER_LEVEL_CRITICAL] = 0,
+};
+
+
+/* Maps the measured battery voltage to a power level. Dropping to a lower
+   level is immediate, recovering to a higher one needs the voltage to
+   clear the threshold by BATTERY_HYSTERESIS_MV (e.g. when charging). */
+power_level_t power_policy_level(int battery_mv, power_level_t previous)
+{
+    if (battery_mv < BATTERY_MV_EXTERNAL) {
+        return POWER_LEVEL_NORMAL;
+    }
+
+    power_level_t level = POWER_LEVEL_NORMAL;
+    while (level < POWER_LEVEL_CRITICAL && battery_mv < level_thresholds[level + 1]) {
+        level++;
+    }
+
+    if (level < previous) {
+        // only climb as far as the voltage clears the hysteresis margin
+        while (level < previous && battery_mv < level_thresholds[level + 1] + BATTERY_HYSTERESIS_MV) {
+            level++;
+        }
+    }
+
+    return level;
+}
+
+
+void power_policy_profile(power_level_t level, int base_sleep_delay, int base_sync, power_profile_t* profile)
+{
+    profile->level = level;
+    profile->sleep_delay = base_sleep_delay * sleep_multipliers[level];
+    profile->sync_every = base_sync * sync_multipliers[level];
+}
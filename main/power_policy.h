@@ -0,0 +1,29 @@
+#ifndef POWER_POLICY_H_
+#define POWER_POLICY_H_
+
+/* Battery policy of the power governor. */
+
+#define BATTERY_MV_SAVING 3800          // below: stretch sleep and sync intervals
+#define BATTERY_MV_LOW 3600             // below: stretch them further
+#define BATTERY_MV_CRITICAL 3450        // below: minimal mode, LDO is close to brownout
+#define BATTERY_MV_EXTERNAL 1000        // below: no battery on the divider, running from USB
+#define BATTERY_HYSTERESIS_MV 100        // recovery margin, keeps ADC noise from flapping levels
+
+typedef enum {
+    POWER_LEVEL_NORMAL = 0,
+    POWER_LEVEL_SAVING,
+    POWER_LEVEL_LOW,
+    POWER_LEVEL_CRITICAL,
+} power_level_t;
+
+typedef struct {
+    power_level_t level;
+    int sleep_delay;        // seconds of deep sleep between wakes
+    int sync_every;         // sync every X wakes, 0 for no radio at all
+} power_profile_t;
+
+power_level_t power_policy_level(int battery_mv, power_level_t previous);
+
+void power_policy_profile(power_level_t level, int base_sleep_delay, int base_sync, power_profile_t* profile);
+
+#endif
@@ -0,0 +1,462 @@
+#include <string.h>
+
+#include "remote_config.h"
+
+
+#define SKIP_DEPTH 8            // nesting accepted in the value of an unknown key
+#define URL_SCHEME "http://"
+
+typedef enum {
+    FIELD_VERSION = 0,
+    FIELD_TEMPERATURE,
+    FIELD_SOIL,
+    FIELD_LIGHT,
+    FIELD_SLEEP,
+    FIELD_SYNC,
+    FIELD_SSID,
+    FIELD_PASS,
+    FIELD_URL,
+    FIELD_COUNT
+} field_t;
+
+static const char* field_keys[FIELD_COUNT] = {
+    "v", "temp", "soil", "light", "sleep", "sync", "ssid", "pass", "url"
+};
+
+static const char* find_config(const char* response);
+static void skip_ws(const char** p);
+static int parse_string(const char** p, char* buf, size_t size);
+static int parse_uint(const char** p, uint32_t* value);
+static int parse_null(const char** p);
+static int skip_string(const char** p);
+static int skip_number(const char** p);
+static int skip_value(const char** p, int depth);
+static int parse_field(const char** p, field_t field, remote_config_t* config);
+static int parse_url(const char* url, remote_config_t* config);
+
+
+/* Applies the config delta carried by an upload response on top of
+   'current', writing the result to 'updated'. 'updated' is only valid
+   if REMOTE_CONFIG_UPDATED is returned. */
+remote_config_status_t remote_config_parse(const char* response, const remote_config_t* current,
+    remote_config_t* updated)
+{
+    const char* p = find_config(response);
+    unsigned seen = 0;
+
+    if (p == NULL) {
+        return REMOTE_CONFIG_NONE;
+    }
+    *updated = *current;
+
+    skip_ws(&p);
+    if (*p++ != '{') {
+        return REMOTE_CONFIG_INVALID;
+    }
+    skip_ws(&p);
+
+    while (*p != '}') {
+        const char* key = p + 1;
+        size_t key_len;
+        int field;
+
+        if (skip_string(&p) < 0) {
+            return REMOTE_CONFIG_INVALID;
+        }
+        key_len = p - key - 1;
+        skip_ws(&p);
+        if (*p++ != ':') {
+            return REMOTE_CONFIG_INVALID;
+        }
+        skip_ws(&p);
+
+        // keys are compared as sent, a known key spelled with escapes is an unknown one
+        for (field = 0; field < FIELD_COUNT; field++) {
+            if (strlen(field_keys[field]) == key_len && memcmp(key, field_keys[field], key_len) == 0) {
+                break;
+            }
+        }
+
+        if (field == FIELD_COUNT) {
+            if (skip_value(&p, 0) < 0) {
+                return REMOTE_CONFIG_INVALID;
+            }
+        } else if (seen & (1 << field) || parse_field(&p, field, updated) < 0) {
+            return REMOTE_CONFIG_INVALID;
+        }
+        seen |= field < FIELD_COUNT ? 1 << field : 0;
+
+        skip_ws(&p);
+        if (*p == ',') {
+            p++;
+            skip_ws(&p);
+            if (*p == '}') {
+                return REMOTE_CONFIG_INVALID;
+            }
+        } else if (*p != '}') {
+            return REMOTE_CONFIG_INVALID;
+        }
+    }
+
+    if (!(seen & (1 << FIELD_VERSION))) {
+        return REMOTE_CONFIG_INVALID;
+    }
+    if (updated->version <= current->version) {
+        return REMOTE_CONFIG_STALE;
+    }
+    return REMOTE_CONFIG_UPDATED;
+}
+
+
+/* Read frequency of a sensor, 'default_frequency' unless overridden */
+int remote_config_read_frequency(const remote_config_t* config, const char* sensor_code, int default_frequency)
+{
+    int frequency = 0;
+
+    if (strcmp(sensor_code, "TMP") == 0) {
+        frequency = config->freq_temperature;
+    } else if (strcmp(sensor_code, "FER") == 0) {
+        frequency = config->freq_soil;
+    } else if (strcmp(sensor_code, "LUM") == 0) {
+        frequency = config->freq_light;
+    }
+    return frequency > 0 ? frequency : default_frequency;
+}
+
+
+/* Position right after '"config":', NULL if there is none */
+static const char* find_config(const char* response)
+{
+    for (const char* p = strstr(response, "\"config\""); p != NULL; p = strstr(p + 1, "\"config\"")) {
+        const char* value = p + strlen("\"config\"");
+
+        skip_ws(&value);
+        if (*value == ':') {
+            return value + 1;
+        }
+    }
+    return NULL;
+}
+
+
+static void skip_ws(const char** p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n') {
+        (*p)++;
+    }
+}
+
+
+/* Copies a JSON string into 'buf'. Returns its length, -1 if it is
+   malformed or does not fit. Only the short escapes are accepted. */
+static int parse_string(const char** p, char* buf, size_t size)
+{
+    const char* s = *p;
+    size_t len = 0;
+
+    if (*s++ != '"') {
+        return -1;
+    }
+
+    while (*s != '"') {
+        char ch = *s++;
+
+        if ((unsigned char)ch < 0x20) {
+            return -1;          // control characters, including the end of the response
+        }
+        if (ch == '\\') {
+            const char* escapes = "\"\"\\\\//b\bf\fn\nr\rt\t";
+            const char* e = *s ? strchr(escapes, *s) : NULL;
+
+            // pairs of (escape, character), the match must be the first of a pair
+            if (e == NULL || (e - escapes) % 2 != 0) {
+                return -1;
+            }
+            ch = e[1];
+            s++;
+        }
+        if (len + 1 >= size) {
+            return -1;
+        }
+        buf[len++] = ch;
+    }
+
+    buf[len] = 0;
+    *p = s + 1;
+    return len;
+}
+
+
+static int parse_uint(const char** p, uint32_t* value)
+{
+    const char* s = *p;
+    uint64_t parsed = 0;
+
+    if (*s < '0' || *s > '9') {
+        return -1;
+    }
+    while (*s >= '0' && *s <= '9') {
+        parsed = parsed * 10 + (*s++ - '0');
+        if (parsed > UINT32_MAX) {
+            return -1;
+        }
+    }
+    // fractions and exponents are not integers
+    if (*s == '.' || *s == 'e' || *s == 'E') {
+        return -1;
+    }
+
+    *value = parsed;
+    *p = s;
+    return 0;
+}
+
+
+static int parse_null(const char** p)
+{
+    if (strncmp(*p, "null", 4) != 0) {
+        return -1;
+    }
+    *p += 4;
+    return 0;
+}
+
+
+/* Skips a string without copying it, unknown keys may carry long ones */
+static int skip_string(const char** p)
+{
+    const char* s = *p;
+
+    if (*s++ != '"') {
+        return -1;
+    }
+    while (*s != '"' && *s != 0) {
+        s += *s == '\\' && s[1] != 0 ? 2 : 1;
+    }
+    if (*s != '"') {
+        return -1;
+    }
+    *p = s + 1;
+    return 0;
+}
+
+
+/* Skips a JSON number of any size, sign, fraction or exponent */
+static int skip_number(const char** p)
+{
+    const char* s = *p;
+
+    if (*s == '-') {
+        s++;
+    }
+    if (*s == '0') {
+        s++;
+    } else if (*s >= '1' && *s <= '9') {
+        while (*s >= '0' && *s <= '9') {
+            s++;
+        }
+    } else {
+        return -1;
+    }
+    if (*s == '.') {
+        if (*++s < '0' || *s > '9') {
+            return -1;
+        }
+        while (*s >= '0' && *s <= '9') {
+            s++;
+        }
+    }
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '+' || *s == '-') {
+            s++;
+        }
+        if (*s < '0' || *s > '9') {
+            return -1;
+        }
+        while (*s >= '0' && *s <= '9') {
+            s++;
+        }
+    }
+
+    *p = s;
+    return 0;
+}
+
+
+/* Skips the value of an unknown key. Nested objects and arrays are
+   accepted up to SKIP_DEPTH levels and need the same ',' and ':'
+   separators as the config object itself. */
+static int skip_value(const char** p, int depth)
+{
+    if (**p == '{' || **p == '[') {
+        char close = **p == '{' ? '}' : ']';
+
+        if (depth == SKIP_DEPTH) {
+            return -1;
+        }
+        (*p)++;
+        skip_ws(p);
+        if (**p == close) {
+            (*p)++;
+            return 0;
+        }
+
+        while (1) {
+            if (close == '}') {
+                if (skip_string(p) < 0) {
+                    return -1;
+                }
+                skip_ws(p);
+                if (**p != ':') {
+                    return -1;
+                }
+                (*p)++;
+                skip_ws(p);
+            }
+            if (skip_value(p, depth + 1) < 0) {
+                return -1;
+            }
+            skip_ws(p);
+            if (**p == close) {
+                (*p)++;
+                return 0;
+            }
+            if (**p != ',') {
+                return -1;
+            }
+            (*p)++;
+            skip_ws(p);
+        }
+    }
+
+    if (**p == '"') {
+        return skip_string(p);
+    }
+    if (strncmp(*p, "true", 4) == 0 || strncmp(*p, "null", 4) == 0) {
+        *p += 4;
+        return 0;
+    }
+    if (strncmp(*p, "false", 5) == 0) {
+        *p += 5;
+        return 0;
+    }
+    return skip_number(p);
+}
+
+
+/* Parses and range checks the value of one known key into 'config' */
+static int parse_field(const char** p, field_t field, remote_config_t* config)
+{
+    static const struct {
+        uint32_t min;
+        uint32_t max;
+    } ranges[FIELD_SYNC + 1] = {
+        [FIELD_TEMPERATURE] = { 1, REMOTE_FREQ_MAX },
+        [FIELD_SOIL] = { 1, REMOTE_FREQ_MAX },
+        [FIELD_LIGHT] = { 1, REMOTE_FREQ_MAX },
+        [FIELD_SLEEP] = { REMOTE_SLEEP_MIN, REMOTE_SLEEP_MAX },
+        [FIELD_SYNC] = { 1, REMOTE_FREQ_MAX },
+    };
+    int* numbers[FIELD_SYNC + 1] = {
+        [FIELD_TEMPERATURE] = &config->freq_temperature,
+        [FIELD_SOIL] = &config->freq_soil,
+        [FIELD_LIGHT] = &config->freq_light,
+        [FIELD_SLEEP] = &config->deep_sleep_delay,
+        [FIELD_SYNC] = &config->freq_sync,
+    };
+    char url[sizeof(URL_SCHEME) + REMOTE_HOST_LEN + 1 + REMOTE_PORT_LEN];
+    uint32_t value;
+    int len;
+
+    switch (field) {
+        case FIELD_VERSION:
+            if (parse_uint(p, &value) < 0 || value == 0) {
+                return -1;
+            }
+            config->version = value;
+            return 0;
+
+        case FIELD_TEMPERATURE:
+        case FIELD_SOIL:
+        case FIELD_LIGHT:
+        case FIELD_SLEEP:
+        case FIELD_SYNC:
+            if (parse_null(p) == 0) {
+                *numbers[field] = 0;
+                return 0;
+            }
+            if (parse_uint(p, &value) < 0 || value < ranges[field].min || value > ranges[field].max) {
+                return -1;
+            }
+            *numbers[field] = value;
+            return 0;
+
+        case FIELD_SSID:
+            if (parse_null(p) == 0) {
+                config->wifi_ssid[0] = 0;
+                return 0;
+            }
+            return parse_string(p, config->wifi_ssid, sizeof(config->wifi_ssid)) > 0 ? 0 : -1;
+
+        case FIELD_PASS:
+            if (parse_null(p) == 0) {
+                config->wifi_pass[0] = 0;
+                return 0;
+            }
+            len = parse_string(p, config->wifi_pass, sizeof(config->wifi_pass));
+            return len == 0 || len >= REMOTE_PASS_MIN ? 0 : -1;
+
+        case FIELD_URL:
+            if (parse_null(p) == 0) {
+                config->server_host[0] = 0;
+                config->server_port[0] = 0;
+                return 0;
+            }
+            if (parse_string(p, url, sizeof(url)) < 0) {
+                return -1;
+            }
+            return parse_url(url, config);
+
+        default:
+            return -1;
+    }
+}
+
+
+/* Accepts "http://host" and "http://host:port", host names or IPv4 only */
+static int parse_url(const char* url, remote_config_t* config)
+{
+    size_t scheme_len = strlen(URL_SCHEME);
+
+    if (strncmp(url, URL_SCHEME, scheme_len) != 0) {
+        return -1;
+    }
+    const char* host = url + scheme_len;
+    size_t host_len = strcspn(host, ":");
+
+    if (host_len == 0 || host_len > REMOTE_HOST_LEN) {
+        return -1;
+    }
+    for (size_t i = 0; i < host_len; i++) {
+        char ch = host[i];
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+                || ch == '.' || ch == '-')) {
+            return -1;
+        }
+    }
+
+    const char* port = host[host_len] == ':' ? host + host_len + 1 : "80";
+    const char* s = port;
+    uint32_t port_number;
+
+    if (strlen(port) > REMOTE_PORT_LEN
+            || parse_uint(&s, &port_number) < 0 || *s != 0 || port_number == 0 || port_number > 65535) {
+        return -1;
+    }
+
+    memcpy(config->server_host, host, host_len);
+    config->server_host[host_len] = 0;
+    strcpy(config->server_port, port);
+    return 0;
+}
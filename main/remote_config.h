@@ -0,0 +1,52 @@
+#ifndef REMOTE_CONFIG_H_
+#define REMOTE_CONFIG_H_
+
+#include <stdint.h>
+
+/* Settings pushed by the server in the upload response, as a versioned
+   delta over what the device has stored:
+
+     {"config": {"v": 7, "temp": 1, "soil": 2, "light": 1, "sleep": 10, "sync": 1,
+                 "ssid": "...", "pass": "...", "url": "http://host:port"}}
+
+   Every key but "v" is optional, null resets a setting to the firmware
+   default. A delta is taken as a whole or not at all: a malformed or out
+   of range value, a duplicate key or a version not newer than the stored
+   one rejects it. Unknown keys are skipped for newer servers. */
+
+#define REMOTE_FREQ_MAX 1000            // wakes between readouts or syncs
+#define REMOTE_SLEEP_MIN 5              // deep sleep range, in s
+#define REMOTE_SLEEP_MAX 86400
+#define REMOTE_SSID_LEN 32
+#define REMOTE_PASS_MIN 8               // WPA2 passphrase, or empty for an open network
+#define REMOTE_PASS_LEN 64
+#define REMOTE_HOST_LEN 63
+#define REMOTE_PORT_LEN 5
+
+/* Zero and empty strings mean "firmware default" */
+typedef struct {
+    uint32_t version;
+    int freq_temperature;
+    int freq_soil;
+    int freq_light;
+    int deep_sleep_delay;
+    int freq_sync;
+    char wifi_ssid[REMOTE_SSID_LEN + 1];
+    char wifi_pass[REMOTE_PASS_LEN + 1];
+    char server_host[REMOTE_HOST_LEN + 1];
+    char server_port[REMOTE_PORT_LEN + 1];
+} remote_config_t;
+
+typedef enum {
+    REMOTE_CONFIG_NONE = 0,             // the response carries no config
+    REMOTE_CONFIG_UPDATED = 1,
+    REMOTE_CONFIG_STALE = -1,           // not newer than the stored config
+    REMOTE_CONFIG_INVALID = -2,
+} remote_config_status_t;
+
+remote_config_status_t remote_config_parse(const char* response, const remote_config_t* current,
+    remote_config_t* updated);
+
+int remote_config_read_frequency(const remote_config_t* config, const char* sensor_code, int default_frequency);
+
+#endif
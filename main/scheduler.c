@@ -0,0 +1,91 @@
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+#include "nvs.h"
+
+#include "scheduler.h"
+#include "blog.h"
+
+
+#define SCHEDULER_NAMESPACE "sync"
+
+
+// logging tag
+static const char *TAG = "scheduler";
+
+/* Schedule of the Wi-Fi syncs. Kept in RTC memory between wakes; the
+   server assigned slot is also stored in NVS, so it survives power loss
+   while the next sync time is re-drawn after every power-on. */
+RTC_DATA_ATTR static sync_schedule_t schedule;
+
+static uint32_t default_period;
+
+
+/* Loads the schedule for this wake. 'base_period' is the sync interval
+   in seconds the device uses when the server assigned no slot. */
+void scheduler_init(int base_period)
+{
+    default_period = base_period;
+
+    if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED) {
+        return;
+    }
+
+    nvs_handle nvs;
+    if (nvs_open(SCHEDULER_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, "period", &schedule.period);
+        nvs_get_u32(nvs, "offset", &schedule.offset);
+        nvs_close(nvs);
+    }
+
+    // after an outage the whole fleet boots at once, spread the first syncs
+    sync_schedule_reset(&schedule, time(NULL), default_period, esp_random());
+    BLOGI(TAG, "Slot %d+%d s, first sync in %d s", schedule.period, schedule.offset,
+        schedule.next_sync - (uint32_t)time(NULL));
+}
+
+
+int scheduler_sync_due()
+{
+    return sync_schedule_due(&schedule, time(NULL));
+}
+
+
+/* Plans the next sync from the outcome of this one and the body of the
+   last upload response (NULL if none), storing a newly assigned slot */
+void scheduler_sync_done(int success, const char* response)
+{
+    sync_hint_t hint;
+    int has_hint = response != NULL && sync_hint_parse(response, &hint);
+    uint32_t period = schedule.period;
+    uint32_t offset = schedule.offset;
+
+    sync_schedule_done(&schedule, time(NULL), default_period, success, has_hint ? &hint : NULL, esp_random());
+
+    BLOGI(TAG, "Sync %s, next in %d s", success ? "done" : "failed", schedule.next_sync - (uint32_t)time(NULL));
+
+    if (schedule.period == period && schedule.offset == offset) {
+        return;
+    }
+
+    nvs_handle nvs;
+    if (nvs_open(SCHEDULER_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store sync slot");
+        return;
+    }
+    nvs_set_u32(nvs, "period", schedule.period);
+    nvs_set_u32(nvs, "offset", schedule.offset);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
+
+
+/* Shortens 'sleep_delay' so the device wakes right at its sync slot */
+int scheduler_sleep_delay(int sleep_delay)
+{
+    return sync_schedule_sleep(&schedule, time(NULL), sleep_delay);
+}
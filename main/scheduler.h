@@ -0,0 +1,10 @@
+#include "sync_slot.h"
+
+
+void scheduler_init(int base_period);
+
+int scheduler_sync_due();
+
+void scheduler_sync_done(int success, const char* response);
+
+int scheduler_sleep_delay(int sleep_delay);
@@ -6,6 +6,7 @@
 #include "esp_adc_cal.h"
 #include "driver/gpio.h"
 #include "driver/adc.h"
+#include "blog.h"
 
 
 #define V_REF 1100
@@ -13,8 +14,11 @@
 #define ADC1_TEMP_CHANNEL 14                // GPIO 14
 #define ADC1_FERT_CHANNEL (ADC1_CHANNEL_6)  // GPIO 34, A2 Feather
 #define ADC1_LIGHT_CHANNEL (ADC1_CHANNEL_0) // GPIO 36, A4 Feather
+#define ADC1_BATT_CHANNEL (ADC1_CHANNEL_7)  // GPIO 35, A13 Feather, VBAT through a 1:2 divider
+#define BATT_SAMPLES 16                     // averaged, a single read is off by tens of mV
 
 
+/* Firmware defaults, the server may override them (see remote_config.h) */
 #define FREQ_TEMPERATURE 1      // read out temperatute every X reboots
 #define FREQ_LIGHT 1            // read out light every X reboots
 #define FREQ_SOIL 2             // read out soil every X reboots
@@ -26,29 +30,46 @@ static const char *TAG = "sensors";
 
 int read_temperature_value()
 {
-    ESP_LOGI(TAG, "Reading temperature sensor");
+    BLOGI(TAG, "Reading temperature sensor");
     ds18b20_init(ADC1_TEMP_CHANNEL);
 
-    float temp = ds18b20_get_temp() * 100;  // 0.2f to int
-
-    return (int)temp;
+    return ds18b20_get_temp_raw() * 25 / 4;  // 1/16 C to 1/100 C, no float on the hot path
 }
 
 
 int read_fertility_value()
 {
-    ESP_LOGI(TAG, "Reading fertility sensor");
+    BLOGI(TAG, "Reading fertility sensor");
     return read_adc1_value(ADC1_FERT_CHANNEL);
 }
 
 
 int read_light_value()
 {
-    ESP_LOGI(TAG, "Reading light sensor");
+    BLOGI(TAG, "Reading light sensor");
     return read_adc1_value(ADC1_LIGHT_CHANNEL);
 }
 
 
+/* Averages BATT_SAMPLES reads, the power policy's hysteresis is sized
+   for the noise left after that (see tools/power_sim.py) */
+int read_battery_voltage()
+{
+    esp_adc_cal_characteristics_t characteristics;
+    int sum = 0;
+
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(ADC1_BATT_CHANNEL, ADC_ATTEN_11db);
+    esp_adc_cal_get_characteristics(V_REF, ADC_ATTEN_11db, ADC_WIDTH_BIT_12, &characteristics);
+
+    for (int i = 0; i < BATT_SAMPLES; i++) {
+        sum += adc1_to_voltage(ADC1_BATT_CHANNEL, &characteristics);
+    }
+
+    return sum / BATT_SAMPLES * 2;
+}
+
+
 int read_adc1_value(int ADC1_CHANNEL)  // TODO check if we need it all every time
 {
     esp_adc_cal_characteristics_t characteristics_gt;
@@ -67,27 +88,27 @@ int get_sensor_number()
 
 void sensor_settings_init(sensor_settings_t* buffer)
 {
-    ESP_LOGI(TAG, "Setting up analog channels\n");
+    BLOGI(TAG, "Setting up analog channels");
     adc1_config_width(ADC_WIDTH_BIT_12);
 
     sensor_settings_t temp_sensor = {
         .code = "TMP",
         .filepath = "/spiffs/temperature.txt",
-        .read_frequency = 1,
+        .read_frequency = FREQ_TEMPERATURE,
         .read = read_temperature_value
     };
 
     sensor_settings_t fert_sensor = {
         .code = "FER",
         .filepath = "/spiffs/fertility.txt",
-        .read_frequency = 2,
+        .read_frequency = FREQ_SOIL,
         .read = read_fertility_value
     };
 
     sensor_settings_t light_sensor = {
         .code = "LUM",
         .filepath = "/spiffs/light.txt",
-        .read_frequency = 1,
+        .read_frequency = FREQ_LIGHT,
         .read = read_light_value
     };
 
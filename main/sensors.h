@@ -1,3 +1,5 @@
+#define MAX_SENSORS 8  // sensor masks are kept in an int
+
 
 typedef int (*read_value)();
 
@@ -11,6 +13,7 @@ typedef struct {
 int read_temperature_value();
 int read_fertility_value();
 int read_light_value();
+int read_battery_voltage();
 int read_adc1_value(int ADC1_CHANNEL);
 
 int get_sensor_number();
@@ -0,0 +1,121 @@
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "nvs.h"
+
+#include "settings.h"
+#include "blog.h"
+
+
+#define SETTINGS_NAMESPACE "config"
+#define SETTINGS_KEY "remote"
+#define SETTINGS_FALLBACK_FAILURES 6      // failed syncs before the firmware network settings are tried
+
+
+// logging tag
+static const char *TAG = "settings";
+
+/* Consecutive failed syncs. Pushed Wi-Fi credentials or a server URL
+   that do not work would cut the device off for good, so past
+   SETTINGS_FALLBACK_FAILURES every other sync uses the firmware ones; if
+   that works, the pushed ones are dropped. */
+RTC_DATA_ATTR static uint32_t sync_failures = 0;
+
+static remote_config_t stored;          // as in NVS, what deltas apply to
+static remote_config_t active;          // used on this wake
+static int network_fallback = 0;
+
+static void store(const remote_config_t* config);
+
+
+/* Loads the settings pushed by the server on earlier syncs. Fields left
+   at zero or empty use the firmware defaults. */
+const remote_config_t* settings_load()
+{
+    nvs_handle nvs;
+    size_t len = sizeof(stored);
+
+    memset(&stored, 0, sizeof(stored));
+
+    if (nvs_open(SETTINGS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        // a blob of another layout comes from older firmware, start over
+        if (nvs_get_blob(nvs, SETTINGS_KEY, &stored, &len) != ESP_OK || len != sizeof(stored)) {
+            memset(&stored, 0, sizeof(stored));
+        }
+        nvs_close(nvs);
+    }
+
+    active = stored;
+    int has_network = stored.wifi_ssid[0] || stored.server_host[0];
+
+    if (has_network && sync_failures >= SETTINGS_FALLBACK_FAILURES && sync_failures % 2 == 0) {
+        ESP_LOGW(TAG, "%d failed syncs, trying the firmware network settings", sync_failures);
+        active.wifi_ssid[0] = 0;
+        active.wifi_pass[0] = 0;
+        active.server_host[0] = 0;
+        active.server_port[0] = 0;
+        network_fallback = 1;
+    }
+
+    BLOGI(TAG, "Config version %d", stored.version);
+    return &active;
+}
+
+
+/* Stores the config delta carried by an upload response, if any. It
+   takes effect from the next wake. */
+void settings_update(const char* response)
+{
+    remote_config_t updated;
+
+    switch (remote_config_parse(response, &stored, &updated)) {
+        case REMOTE_CONFIG_UPDATED:
+            BLOGI(TAG, "Config updated to version %d", updated.version);
+            store(&updated);
+            break;
+        case REMOTE_CONFIG_INVALID:
+            ESP_LOGW(TAG, "Rejected malformed or out of range config");
+            break;
+        default:
+            break;
+    }
+}
+
+
+void settings_sync_done(int success)
+{
+    if (!success) {
+        sync_failures++;
+        return;
+    }
+    sync_failures = 0;
+
+    if (network_fallback) {
+        ESP_LOGW(TAG, "Pushed network settings did not work, dropping them");
+        stored.wifi_ssid[0] = 0;
+        stored.wifi_pass[0] = 0;
+        stored.server_host[0] = 0;
+        stored.server_port[0] = 0;
+        store(&stored);
+        network_fallback = 0;
+    }
+}
+
+
+static void store(const remote_config_t* config)
+{
+    nvs_handle nvs;
+
+    if (nvs_open(SETTINGS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store config");
+        return;
+    }
+    if (nvs_set_blob(nvs, SETTINGS_KEY, config, sizeof(remote_config_t)) == ESP_OK && nvs_commit(nvs) == ESP_OK) {
+        stored = *config;
+    } else {
+        ESP_LOGE(TAG, "Failed to store config");
+    }
+    nvs_close(nvs);
+}
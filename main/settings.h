@@ -0,0 +1,8 @@
+#include "remote_config.h"
+
+
+const remote_config_t* settings_load();
+
+void settings_update(const char* response);
+
+void settings_sync_done(int success);
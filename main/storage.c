@@ -1,5 +1,8 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/unistd.h>
 
@@ -7,6 +10,22 @@
 #include "esp_spiffs.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "blog.h"
+
+
+#define INDEX_BLOCK_SIZE 512     // readout log bytes covered by one index entry
+#define RECOVER_MAX 8            // interrupted compactions finished per boot
+#define EXPIRE_MIN_BYTES 4096    // expired readouts worth rewriting the log for: a flash block
+#define EXPIRE_MIN_SHARE 4       // and a quarter of the log
+
+
+/* Sparse time index of a readout log, stored next to it in
+   /spiffs/<sensor>.idx: entry N holds the time and offset of the first
+   readout starting in the N-th INDEX_BLOCK_SIZE block of the log. */
+typedef struct {
+    uint32_t time;
+    uint32_t offset;
+} index_entry_t;
 
 
 // logging tag
@@ -14,14 +33,26 @@ static const char *TAG = "storage";
 
 
 void get_filepath_for_type(const char* sensor_type, char* filepath);
+void get_index_filepath_for_type(const char* sensor_type, char* filepath);
+void get_aggregate_filepath_for_type(const char* sensor_type, char* filepath);
 int count_line_number(char* filepath);
+
+static void drop_readouts(const char* sensor_type, unsigned long before, int lazy);
+static void index_readout(const char* sensor_type, unsigned long at_time, long offset);
+static long index_lookup(const char* sensor_type, unsigned long t0, long log_size);
+static int index_offset_valid(FILE* f, long offset, unsigned long t0);
+static void truncate_readouts(const char* sensor_type, long offset);
+static void rebuild_index(const char* sensor_type);
+static void recover_compactions();
+static void recover_compaction(const char* sensor_type);
+static void get_compaction_filepath(const char* sensor_type, const char* suffix, char* filepath);
     
 
 void storage_init()
 {
-    ESP_LOGI(TAG, "Initializing SPIFFS");
+    BLOGI(TAG, "Initializing SPIFFS");
     esp_vfs_spiffs_conf_t conf = {
-      .base_path = "/spiffs",
+      .base_path = STORAGE_BASE_PATH,
       .partition_label = NULL,
       .max_files = 12,
       .format_if_mount_failed = true
@@ -47,14 +78,16 @@ void storage_init()
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to get SPIFFS partition information");
     } else {
-        ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+        BLOGI(TAG, "Partition size: total: %d, used: %d", total, used);
     }
+
+    recover_compactions();
 }
 
 
 void dump_readout(const char* sensor_type, unsigned long at_time, int value)
 {
-    ESP_LOGI(TAG, "Dumping %s readout at %lu with value: %d", sensor_type, at_time, value);
+    BLOGI(TAG, "Dumping %s readout at %lu with value: %d", sensor_type, at_time, value);
 
     char filepath[64];
     get_filepath_for_type(sensor_type, filepath);
@@ -65,8 +98,13 @@ void dump_readout(const char* sensor_type, unsigned long at_time, int value)
         return;
     }
 
+    fseek(f, 0, SEEK_END);
+    long offset = ftell(f);
+
     fprintf(f, "%lu %d\n", at_time, value);
     fclose(f);
+
+    index_readout(sensor_type, at_time, offset);
 }
 
 
@@ -79,29 +117,72 @@ int get_readouts_count(const char* sensor_type)
 }
 
 
-void get_readouts(const char* sensor_type, unsigned long* times, int* values)
+/* Opens an iterator over the readouts taken between 't0' and 't1'
+   (inclusive). The sparse index lets it start scanning at the block
+   holding 't0' instead of at the beginning of the log. Returns -1 if
+   the sensor has no readouts. */
+int read_range(const char* sensor_type, unsigned long t0, unsigned long t1, readout_range_t* range)
 {
     char filepath[64];
     get_filepath_for_type(sensor_type, filepath);
 
-    FILE* f = fopen(filepath, "r");
-    if (f == NULL) {
-        ESP_LOGE(TAG, "Failed to open readout file for reading");
-        return;
+    range->f = fopen(filepath, "r");
+    if (range->f == NULL) {
+        return -1;
     }
-    
+
+    fseek(range->f, 0, SEEK_END);
+    long offset = index_lookup(sensor_type, t0, ftell(range->f));
+    if (offset > 0 && !index_offset_valid(range->f, offset, t0)) {
+        ESP_LOGW(TAG, "Index of %s is stale, scanning from the start", filepath);
+        offset = 0;
+    }
+
+    range->t0 = t0;
+    range->t1 = t1;
+    range->offset = offset;
+    range->line_offset = range->offset;
+    fseek(range->f, range->offset, SEEK_SET);
+
+    return 0;
+}
+
+
+/* Returns 1 and the next readout of the range, or 0 once it is exhausted */
+int read_range_next(readout_range_t* range, unsigned long* time, int* value)
+{
     char line[64];
-    int line_idx = 0;
 
-    while (fgets(line, 64, f)) {    
+    while (fgets(line, 64, range->f)) {
+        long line_offset = range->offset;
+        range->offset += strlen(line);
+
         char* t_from_reboot = strtok (line, " ");  // in ms
         char* readout_value = strtok (NULL, " ");
-        readout_value[strlen(readout_value) - 1] = 0;  // remove \n
+        if (readout_value == NULL) {
+            continue;  // torn line from an interrupted write
+        }
 
-        times[line_idx] = *t_from_reboot;
-        values[line_idx] = *readout_value;
+        unsigned long t = strtoul(t_from_reboot, NULL, 10);
+        if (t < range->t0) {
+            continue;
+        }
+        if (t > range->t1) {
+            return 0;
+        }
+
+        *time = t;
+        *value = atoi(readout_value);
+        range->line_offset = line_offset;
+        return 1;
     }
-    fclose(f);
+    return 0;
+}
+
+
+void read_range_close(readout_range_t* range)
+{
+    fclose(range->f);
 }
 
 
@@ -114,6 +195,100 @@ void flush_readouts(const char* sensor_type)
     if (stat(filepath, &st) == 0) {
         unlink(filepath);
     }
+
+    get_index_filepath_for_type(sensor_type, filepath);
+    if (stat(filepath, &st) == 0) {
+        unlink(filepath);
+    }
+}
+
+
+/* Removes raw readouts taken before 'before'. Readouts are appended in
+   time order, so these are always a prefix of the file. */
+void prune_readouts(const char* sensor_type, unsigned long before)
+{
+    drop_readouts(sensor_type, before, 0);
+}
+
+
+/* Like prune_readouts(), for readouts that merely aged out: the log is
+   only rewritten once they take up EXPIRE_MIN_BYTES and 1/EXPIRE_MIN_SHARE
+   of it, so a few may outlive 'before'. */
+void expire_readouts(const char* sensor_type, unsigned long before)
+{
+    drop_readouts(sensor_type, before, 1);
+}
+
+
+void dump_aggregate(const char* sensor_type, const aggregate_record_t* record)
+{
+    BLOGI(TAG, "Dumping %s aggregate of %d readouts from %lu", sensor_type, record->count, record->start);
+
+    char filepath[64];
+    get_aggregate_filepath_for_type(sensor_type, filepath);
+
+    FILE* f = fopen(filepath, "a");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s file for writing", filepath);
+        return;
+    }
+
+    fprintf(f, "%lu %d %d %d %d %d\n", record->start, record->count,
+        record->min, record->max, record->mean, record->variance);
+    fclose(f);
+}
+
+
+int get_aggregates_count(const char* sensor_type)
+{
+    char filepath[64];
+    get_aggregate_filepath_for_type(sensor_type, filepath);
+
+    return count_line_number(filepath);
+}
+
+
+/* Reads up to 'capacity' aggregate records into 'records'. A line cut
+   short by a reset while it was written is skipped. Returns the number
+   of records read. */
+int get_aggregates(const char* sensor_type, aggregate_record_t* records, int capacity)
+{
+    char filepath[64];
+    get_aggregate_filepath_for_type(sensor_type, filepath);
+
+    FILE* f = fopen(filepath, "r");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open aggregate file for reading");
+        return 0;
+    }
+
+    char line[96];
+    int line_idx = 0;
+
+    while (line_idx < capacity && fgets(line, 96, f)) {
+        aggregate_record_t* record = &records[line_idx];
+
+        if (strchr(line, '\n') != NULL
+                && sscanf(line, "%lu %d %d %d %d %d", &record->start, &record->count,
+                    &record->min, &record->max, &record->mean, &record->variance) == 6) {
+            line_idx++;
+        }
+    }
+    fclose(f);
+
+    return line_idx;
+}
+
+
+void flush_aggregates(const char* sensor_type)
+{
+    char filepath[64];
+    get_aggregate_filepath_for_type(sensor_type, filepath);
+
+    struct stat st;  
+    if (stat(filepath, &st) == 0) {
+        unlink(filepath);
+    }
 }
 
 
@@ -121,13 +296,25 @@ void storage_close()
 {
     // All done, unmount partition and disable SPIFFS
     esp_vfs_spiffs_unregister(NULL);
-    ESP_LOGI(TAG, "SPIFFS unmounted");    
+    BLOGI(TAG, "SPIFFS unmounted");    
 }
 
 
 void get_filepath_for_type(const char* sensor_type, char* filepath)
 {
-    sprintf(filepath, "/spiffs/%s.txt", sensor_type);
+    sprintf(filepath, STORAGE_BASE_PATH "/%s.txt", sensor_type);
+}
+
+
+void get_index_filepath_for_type(const char* sensor_type, char* filepath)
+{
+    sprintf(filepath, STORAGE_BASE_PATH "/%s.idx", sensor_type);
+}
+
+
+void get_aggregate_filepath_for_type(const char* sensor_type, char* filepath)
+{
+    sprintf(filepath, STORAGE_BASE_PATH "/%s.agg", sensor_type);
 }
 
 
@@ -151,3 +338,318 @@ int count_line_number(char* filepath) {
 
     return lines;
 }
+
+
+/* Compacts away the readouts taken before 'before'. 'lazy' leaves a
+   prefix too small to be worth a rewrite of the log in place. */
+static void drop_readouts(const char* sensor_type, unsigned long before, int lazy)
+{
+    readout_range_t range;
+    unsigned long time;
+    int value;
+
+    if (read_range(sensor_type, before, ULONG_MAX, &range) != 0) {
+        return;
+    }
+    long start = range.offset;
+    int found = read_range_next(&range, &time, &value);
+    long offset = range.line_offset;
+
+    // the whole log only goes on a scan from its start, never on the index's word
+    if (!found && start > 0) {
+        rewind(range.f);
+        range.offset = 0;
+        found = read_range_next(&range, &time, &value);
+        offset = range.line_offset;
+    }
+    read_range_close(&range);
+
+    if (!found) {
+        flush_readouts(sensor_type);
+        return;
+    }
+
+    if (lazy) {
+        char filepath[64];
+        get_filepath_for_type(sensor_type, filepath);
+
+        struct stat st;
+        if (stat(filepath, &st) != 0 || offset < EXPIRE_MIN_BYTES || offset < st.st_size / EXPIRE_MIN_SHARE) {
+            return;
+        }
+    }
+    if (offset > 0) {
+        truncate_readouts(sensor_type, offset);
+    }
+}
+
+
+/* Adds an index entry if the readout written at 'offset' is the first one
+   starting in its block. Readout lines are much shorter than a block, so
+   every block gets one and the entry count tells which block is next. */
+static void index_readout(const char* sensor_type, unsigned long at_time, long offset)
+{
+    char filepath[64];
+    get_index_filepath_for_type(sensor_type, filepath);
+
+    struct stat st;
+    long entries = stat(filepath, &st) == 0 ? st.st_size / sizeof(index_entry_t) : 0;
+
+    // a torn entry would shift every one after it
+    if (entries > 0 && st.st_size % sizeof(index_entry_t) != 0) {
+        ESP_LOGW(TAG, "Index %s is misaligned, rebuilding it", filepath);
+        rebuild_index(sensor_type);
+        return;
+    }
+    if (entries > offset / INDEX_BLOCK_SIZE) {
+        return;
+    }
+
+    FILE* f = fopen(filepath, "a");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s file for writing", filepath);
+        return;
+    }
+
+    index_entry_t entry = { .time = at_time, .offset = offset };
+    fwrite(&entry, sizeof(index_entry_t), 1, f);
+    fclose(f);
+}
+
+
+/* Returns the offset of the last indexed block starting at or before
+   't0', found by binary search over the index file. 0 (scan from the
+   start) if there is no index, 't0' precedes it, or the index does not
+   fit a log of 'log_size' bytes. */
+static long index_lookup(const char* sensor_type, unsigned long t0, long log_size)
+{
+    char filepath[64];
+    get_index_filepath_for_type(sensor_type, filepath);
+
+    FILE* f = fopen(filepath, "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long index_size = ftell(f);
+    if (index_size % sizeof(index_entry_t) != 0) {
+        ESP_LOGW(TAG, "Index %s is misaligned, ignoring it", filepath);
+        fclose(f);
+        return 0;
+    }
+    long lo = 0;
+    long hi = index_size / sizeof(index_entry_t);
+    long offset = 0;
+    index_entry_t entry;
+
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+
+        fseek(f, mid * sizeof(index_entry_t), SEEK_SET);
+        if (fread(&entry, sizeof(index_entry_t), 1, f) != 1) {
+            break;
+        }
+
+        if (entry.time <= t0) {
+            offset = entry.offset;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    fclose(f);
+
+    if (offset >= log_size) {
+        ESP_LOGW(TAG, "Index %s points past the end of the log, ignoring it", filepath);
+        return 0;
+    }
+    return offset;
+}
+
+
+/* Checks that an index entry still points at the start of a readout
+   taken at or before 't0', as it did when the log was written */
+static int index_offset_valid(FILE* f, long offset, unsigned long t0)
+{
+    char line[64];
+    char* end;
+
+    if (fseek(f, offset - 1, SEEK_SET) != 0 || fgetc(f) != '\n' || fgets(line, 64, f) == NULL) {
+        return 0;
+    }
+    unsigned long t = strtoul(line, &end, 10);
+
+    return end != line && *end == ' ' && t <= t0;
+}
+
+
+/* Drops everything before 'offset' from the readout log. The kept part
+   is copied to <sensor>.tmp first. SPIFFS can't rename over an existing
+   file, so the log is moved to <sensor>.old before .tmp takes its name.
+   Once .old is there, .tmp is complete, which is what lets
+   recover_compaction() finish the job after a reset at any step. The
+   index is rebuilt last, for the log in place. */
+static void truncate_readouts(const char* sensor_type, long offset)
+{
+    char filepath[64];
+    char tmp_filepath[64];
+    char old_filepath[64];
+    char index_filepath[64];
+    get_filepath_for_type(sensor_type, filepath);
+    get_compaction_filepath(sensor_type, "tmp", tmp_filepath);
+    get_compaction_filepath(sensor_type, "old", old_filepath);
+    get_index_filepath_for_type(sensor_type, index_filepath);
+
+    FILE* src = fopen(filepath, "r");
+    FILE* dst = fopen(tmp_filepath, "w");
+    if (src == NULL || dst == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s for compaction", filepath);
+        if (src) fclose(src);
+        if (dst) fclose(dst);
+        return;
+    }
+
+    char line[64];
+    int copied = 1;
+
+    fseek(src, offset, SEEK_SET);
+    while (copied && fgets(line, 64, src)) {
+        copied = fputs(line, dst) >= 0;
+    }
+    fclose(src);
+    if (fclose(dst) != 0 || !copied) {
+        ESP_LOGE(TAG, "Failed to write %s, keeping %s as it is", tmp_filepath, filepath);
+        unlink(tmp_filepath);
+        return;
+    }
+
+    // its offsets are about to go stale
+    unlink(index_filepath);
+
+    if (rename(filepath, old_filepath) != 0 || rename(tmp_filepath, filepath) != 0) {
+        ESP_LOGE(TAG, "Failed to replace %s", filepath);
+        recover_compaction(sensor_type);
+        return;
+    }
+    unlink(old_filepath);
+
+    rebuild_index(sensor_type);
+}
+
+
+/* Writes the index of a readout log from scratch */
+static void rebuild_index(const char* sensor_type)
+{
+    char filepath[64];
+    char index_filepath[64];
+    get_filepath_for_type(sensor_type, filepath);
+    get_index_filepath_for_type(sensor_type, index_filepath);
+
+    unlink(index_filepath);
+
+    FILE* src = fopen(filepath, "r");
+    if (src == NULL) {
+        return;
+    }
+    FILE* idx = fopen(index_filepath, "w");
+    if (idx == NULL) {
+        ESP_LOGE(TAG, "Failed to open %s file for writing", index_filepath);
+        fclose(src);
+        return;
+    }
+
+    char line[64];
+    long offset = 0;
+    long entries = 0;
+
+    while (fgets(line, 64, src)) {
+        if (entries <= offset / INDEX_BLOCK_SIZE) {
+            index_entry_t entry = { .time = strtoul(line, NULL, 10), .offset = offset };
+            fwrite(&entry, sizeof(index_entry_t), 1, idx);
+            entries++;
+        }
+        offset += strlen(line);
+    }
+    fclose(src);
+    fclose(idx);
+}
+
+
+/* Looks for compactions left halfway by a reset, see truncate_readouts() */
+static void recover_compactions()
+{
+    char sensor_types[RECOVER_MAX][16];
+    int count = 0;
+
+    DIR* dir = opendir(STORAGE_BASE_PATH);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && count < RECOVER_MAX) {
+        const char* name = entry->d_name[0] == '/' ? entry->d_name + 1 : entry->d_name;
+        const char* dot = strrchr(name, '.');
+
+        if (dot == NULL || (size_t)(dot - name) >= sizeof(sensor_types[0])
+                || (strcmp(dot, ".tmp") != 0 && strcmp(dot, ".old") != 0)) {
+            continue;
+        }
+
+        int len = dot - name;
+        int seen = 0;
+        for (int i = 0; i < count; i++) {
+            seen |= strncmp(sensor_types[i], name, len) == 0 && sensor_types[i][len] == 0;
+        }
+        if (!seen) {
+            memcpy(sensor_types[count], name, len);
+            sensor_types[count++][len] = 0;
+        }
+    }
+    closedir(dir);
+
+    // renaming while the directory is being read is not safe on SPIFFS
+    for (int i = 0; i < count; i++) {
+        recover_compaction(sensor_types[i]);
+    }
+}
+
+
+/* With <sensor>.old around, .tmp was complete and only has to take the
+   log's name, if it hasn't already. Without .old, the log was never
+   touched and .tmp may be partial, so it goes. */
+static void recover_compaction(const char* sensor_type)
+{
+    char filepath[64];
+    char tmp_filepath[64];
+    char old_filepath[64];
+    get_filepath_for_type(sensor_type, filepath);
+    get_compaction_filepath(sensor_type, "tmp", tmp_filepath);
+    get_compaction_filepath(sensor_type, "old", old_filepath);
+
+    struct stat st;
+    int has_log = stat(filepath, &st) == 0;
+    int has_tmp = stat(tmp_filepath, &st) == 0;
+    int has_old = stat(old_filepath, &st) == 0;
+
+    ESP_LOGW(TAG, "Recovering an interrupted compaction of %s", filepath);
+
+    if (has_old && !has_log) {
+        // the log from before the compaction is still better than none
+        if ((!has_tmp || rename(tmp_filepath, filepath) != 0) && rename(old_filepath, filepath) != 0) {
+            ESP_LOGE(TAG, "Failed to restore %s", filepath);
+            return;
+        }
+    }
+    unlink(tmp_filepath);
+    unlink(old_filepath);
+
+    rebuild_index(sensor_type);
+}
+
+
+static void get_compaction_filepath(const char* sensor_type, const char* suffix, char* filepath)
+{
+    sprintf(filepath, STORAGE_BASE_PATH "/%s.%s", sensor_type, suffix);
+}
@@ -1,3 +1,22 @@
+#include <stdio.h>
+
+#include "aggregate.h"
+
+
+// overridable for host builds, see tools/storage_test.py
+#ifndef STORAGE_BASE_PATH
+#define STORAGE_BASE_PATH "/spiffs"
+#endif
+
+typedef struct {
+    FILE* f;
+    unsigned long t0;
+    unsigned long t1;
+    long offset;            // offset of the next line
+    long line_offset;       // offset of the readout returned last
+} readout_range_t;
+
+
 
 void storage_init();
 
@@ -5,8 +24,24 @@ void dump_readout(const char* sensor_type, unsigned long time, int value);
 
 int get_readouts_count(const char* sensor_type);
 
-void get_readouts(const char* sensor_type, unsigned long* times, int* values);
+int read_range(const char* sensor_type, unsigned long t0, unsigned long t1, readout_range_t* range);
+
+int read_range_next(readout_range_t* range, unsigned long* time, int* value);
+
+void read_range_close(readout_range_t* range);
 
 void flush_readouts(const char* sensor_type);
 
+void prune_readouts(const char* sensor_type, unsigned long before);
+
+void expire_readouts(const char* sensor_type, unsigned long before);
+
+void dump_aggregate(const char* sensor_type, const aggregate_record_t* record);
+
+int get_aggregates_count(const char* sensor_type);
+
+int get_aggregates(const char* sensor_type, aggregate_record_t* records, int capacity);
+
+void flush_aggregates(const char* sensor_type);
+
 void storage_close();
\ No newline at end of file
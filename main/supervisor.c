@@ -0,0 +1,170 @@
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+
+#include "supervisor.h"
+#include "blog.h"
+
+
+#define WAKE_BUDGET_MS 45000            // total awake time per wake, room for a firmware update
+#define WAKE_HARD_CAP_GRACE_MS 2000     // extra time before the wake is cut off for good
+
+
+// logging tag
+static const char *TAG = "supervisor";
+
+static const int phase_budgets_ms[WAKE_PHASE_COUNT] = {
+    [WAKE_PHASE_BOOT] = 1000,
+    [WAKE_PHASE_SENSORS] = 3000,
+    [WAKE_PHASE_STORAGE] = 1000,
+    [WAKE_PHASE_CONNECT] = 8000,
+    [WAKE_PHASE_TIME_SYNC] = 6000,
+    [WAKE_PHASE_UPLOAD] = 8000,
+    [WAKE_PHASE_UPDATE] = 20000,
+};
+
+static const char* phase_names[WAKE_PHASE_COUNT] = {
+    "boot", "sensors", "storage", "connect", "time sync", "upload", "update"
+};
+
+/* Overrun counters, kept in RTC memory until the server accepted them as
+   telemetry. 'hard_cap_hits' counts wakes that did not finish even within
+   the grace period and were put to sleep by the timer. */
+RTC_DATA_ATTR static uint32_t phase_overruns[WAKE_PHASE_COUNT];
+RTC_DATA_ATTR static uint32_t hard_cap_hits = 0;
+
+static phase_budget_t budget;
+static esp_timer_handle_t hard_cap_timer = NULL;
+static int cap_sleep_delay;
+
+static int64_t clock_ms();
+static void hard_cap_cb(void* arg);
+
+
+/* Starts the awake budget and arms the hard cap: if the wake is still
+   running WAKE_BUDGET_MS + WAKE_HARD_CAP_GRACE_MS after boot, whatever
+   phase is stuck is abandoned and the device goes to sleep. */
+void supervisor_start(int sleep_delay)
+{
+    cap_sleep_delay = sleep_delay;
+    phase_budget_start(&budget, clock_ms, phase_budgets_ms, WAKE_BUDGET_MS, phase_overruns);
+
+    for (int i = 0; i < WAKE_PHASE_COUNT; i++) {
+        if (phase_overruns[i] > 0) {
+            ESP_LOGW(TAG, "Phase %s overran %u times", phase_names[i], phase_overruns[i]);
+        }
+    }
+    if (hard_cap_hits > 0) {
+        ESP_LOGW(TAG, "Wake cut off by the hard cap %u times", hard_cap_hits);
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = hard_cap_cb,
+        .name = "wake_cap"
+    };
+    if (esp_timer_create(&timer_args, &hard_cap_timer) == ESP_OK) {
+        esp_timer_start_once(hard_cap_timer, 1000LL * (WAKE_BUDGET_MS + WAKE_HARD_CAP_GRACE_MS));
+    } else {
+        ESP_LOGE(TAG, "Failed to arm the wake hard cap");
+    }
+}
+
+
+void supervisor_set_sleep_delay(int sleep_delay)
+{
+    cap_sleep_delay = sleep_delay;
+}
+
+
+void supervisor_phase(wake_phase_t phase)
+{
+    phase_budget_begin(&budget, phase);
+}
+
+
+int supervisor_remaining_ms()
+{
+    return phase_budget_remaining_ms(&budget);
+}
+
+
+/* Closes the current phase, returns 0 if it overran and the rest of its
+   work has to wait for the next wake */
+int supervisor_phase_done()
+{
+    if (phase_budget_end(&budget)) {
+        ESP_LOGW(TAG, "Phase %s ran out of time, deferring to the next wake", phase_names[budget.phase]);
+        return 0;
+    }
+    return 1;
+}
+
+
+void supervisor_stop()
+{
+    if (hard_cap_timer != NULL) {
+        esp_timer_stop(hard_cap_timer);
+        esp_timer_delete(hard_cap_timer);
+        hard_cap_timer = NULL;
+    }
+}
+
+
+const char* supervisor_phase_name(wake_phase_t phase)
+{
+    return phase_names[phase];
+}
+
+
+/* Copies the overrun counters for an upload. Returns 1 if there is
+   anything to report, 0 if all of them are 0. */
+int supervisor_telemetry(supervisor_telemetry_t* telemetry)
+{
+    int any = hard_cap_hits > 0;
+
+    for (int i = 0; i < WAKE_PHASE_COUNT; i++) {
+        telemetry->overruns[i] = phase_overruns[i];
+        any |= phase_overruns[i] > 0;
+    }
+    telemetry->hard_cap_hits = hard_cap_hits;
+
+    return any;
+}
+
+
+/* The server accepted 'telemetry': takes what it reported off the
+   counters, overruns counted since it was copied stay for the next one */
+void supervisor_telemetry_sent(const supervisor_telemetry_t* telemetry)
+{
+    for (int i = 0; i < WAKE_PHASE_COUNT; i++) {
+        phase_overruns[i] -= telemetry->overruns[i];
+    }
+    hard_cap_hits -= telemetry->hard_cap_hits;
+}
+
+
+static int64_t clock_ms()
+{
+    return esp_timer_get_time() / 1000;
+}
+
+
+/* Runs in the esp_timer task while the main task is stuck somewhere, so
+   nothing of the main task is cleaned up: open SPIFFS files are neither
+   flushed nor closed and Wi-Fi is not stopped. Flash writes themselves
+   can't be cut in half, they block every task while they run, but data
+   still buffered in a FILE is lost as on a power loss, which SPIFFS is
+   built to survive. Closing files from here would race with the main
+   task still using them. */
+static void hard_cap_cb(void* arg)
+{
+    (void)arg;
+    phase_overruns[budget.phase]++;
+    hard_cap_hits++;
+
+    ESP_LOGE(TAG, "Phase %s is stuck, going to sleep for %d seconds", phase_names[budget.phase], cap_sleep_delay);
+    blog_flush();
+    esp_deep_sleep(1000000LL * cap_sleep_delay);
+}
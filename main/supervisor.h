@@ -0,0 +1,25 @@
+#include "phase_budget.h"
+
+
+typedef struct {
+    uint32_t overruns[WAKE_PHASE_COUNT];
+    uint32_t hard_cap_hits;
+} supervisor_telemetry_t;
+
+void supervisor_start(int sleep_delay);
+
+void supervisor_set_sleep_delay(int sleep_delay);
+
+void supervisor_phase(wake_phase_t phase);
+
+int supervisor_remaining_ms();
+
+int supervisor_phase_done();
+
+void supervisor_stop();
+
+const char* supervisor_phase_name(wake_phase_t phase);
+
+int supervisor_telemetry(supervisor_telemetry_t* telemetry);
+
+void supervisor_telemetry_sent(const supervisor_telemetry_t* telemetry);
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "sync_slot.h"
+
+
+static int find_uint(const char* json, const char* end, const char* key, uint32_t* value);
+static uint32_t slot_period(const sync_schedule_t* schedule, uint32_t base_period);
+static uint32_t next_slot(const sync_schedule_t* schedule, uint32_t after, uint32_t base_period);
+
+
+/* Picks the sync slot and retry hint out of an upload response. Values
+   out of range are ignored, the device then keeps its current schedule.
+   Returns 1 if the response carried any hint, 0 otherwise. */
+int sync_hint_parse(const char* response, sync_hint_t* hint)
+{
+    const char* end = response + strlen(response);
+    const char* slot = strstr(response, "\"sync_slot\"");
+
+    memset(hint, 0, sizeof(sync_hint_t));
+
+    if (slot != NULL) {
+        const char* slot_end = strchr(slot, '}');
+        uint32_t period, offset;
+
+        if (slot_end != NULL
+                && find_uint(slot, slot_end, "period", &period) && find_uint(slot, slot_end, "offset", &offset)
+                && period >= SYNC_PERIOD_MIN && period <= SYNC_PERIOD_MAX && offset < period) {
+            hint->period = period;
+            hint->offset = offset;
+        }
+    }
+
+    uint32_t retry_after;
+    if (find_uint(response, end, "retry_after", &retry_after) && retry_after <= SYNC_RETRY_AFTER_MAX) {
+        hint->retry_after = retry_after;
+    }
+
+    return hint->period > 0 || hint->retry_after > 0;
+}
+
+
+/* Schedules the first sync after power-on somewhere within one period,
+   the slot itself is kept */
+void sync_schedule_reset(sync_schedule_t* schedule, uint32_t now, uint32_t base_period, uint32_t random)
+{
+    uint32_t period = slot_period(schedule, base_period);
+
+    schedule->failures = 0;
+    schedule->next_sync = now + (period > 0 ? random % period : 0);
+}
+
+
+int sync_schedule_due(const sync_schedule_t* schedule, uint32_t now)
+{
+    return (int32_t)(now - schedule->next_sync) >= 0;
+}
+
+
+/* Plans the next sync after one finished at 'now'. 'hint' is what the
+   last upload response carried, NULL if there was no response. Failures
+   back off exponentially with jitter, capped at SYNC_BACKOFF_MAX. */
+void sync_schedule_done(sync_schedule_t* schedule, uint32_t now, uint32_t base_period,
+    int success, const sync_hint_t* hint, uint32_t random)
+{
+    if (hint != NULL && hint->period > 0) {
+        schedule->period = hint->period;
+        schedule->offset = hint->offset;
+    }
+
+    if (success) {
+        schedule->failures = 0;
+        schedule->next_sync = next_slot(schedule, now, base_period);
+    } else {
+        int shift = schedule->failures < SYNC_BACKOFF_SHIFT_MAX ? schedule->failures : SYNC_BACKOFF_SHIFT_MAX;
+        uint32_t backoff = (base_period > 0 ? base_period : SYNC_PERIOD_MIN) << shift;
+
+        if (backoff > SYNC_BACKOFF_MAX) {
+            backoff = SYNC_BACKOFF_MAX;
+        }
+        schedule->failures++;
+
+        // half fixed, half random, so devices that failed together spread out
+        uint32_t retry = now + backoff / 2 + random % (backoff / 2 + 1);
+        schedule->next_sync = schedule->period > 0 ? next_slot(schedule, retry - 1, base_period) : retry;
+    }
+
+    if (hint != NULL && hint->retry_after > 0 && (int32_t)(now + hint->retry_after - schedule->next_sync) > 0) {
+        schedule->next_sync = now + hint->retry_after;
+    }
+}
+
+
+/* Deep sleep length that wakes the device no later than its next sync */
+uint32_t sync_schedule_sleep(const sync_schedule_t* schedule, uint32_t now, uint32_t sleep_delay)
+{
+    int32_t until_sync = (int32_t)(schedule->next_sync - now);
+
+    if (until_sync <= 0 || (uint32_t)until_sync >= sleep_delay) {
+        return sleep_delay;
+    }
+    return until_sync;
+}
+
+
+/* Finds '"key": <unsigned int>' between 'json' and 'end' */
+static int find_uint(const char* json, const char* end, const char* key, uint32_t* value)
+{
+    size_t key_len = strlen(key);
+
+    for (const char* p = json; p + key_len + 2 <= end; p++) {
+        if (p[0] != '"' || strncmp(p + 1, key, key_len) != 0 || p[key_len + 1] != '"') {
+            continue;
+        }
+        p += key_len + 2;
+        while (p < end && (*p == ' ' || *p == ':')) {
+            p++;
+        }
+        if (p >= end || *p < '0' || *p > '9') {
+            return 0;
+        }
+
+        char* num_end;
+        unsigned long parsed = strtoul(p, &num_end, 10);
+        if (num_end > end || parsed > UINT32_MAX) {
+            return 0;
+        }
+        *value = parsed;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* The server slot is stretched to a multiple of itself when the power
+   governor asks for rarer syncs, keeping the assigned phase */
+static uint32_t slot_period(const sync_schedule_t* schedule, uint32_t base_period)
+{
+    if (schedule->period == 0) {
+        return base_period;
+    }
+    if (base_period <= schedule->period) {
+        return schedule->period;
+    }
+    return (base_period + schedule->period - 1) / schedule->period * schedule->period;
+}
+
+
+/* First slot time strictly after 'after'. Slots are only meaningful once
+   the clock is set; before that the period is counted from 'after'. */
+static uint32_t next_slot(const sync_schedule_t* schedule, uint32_t after, uint32_t base_period)
+{
+    uint32_t period = slot_period(schedule, base_period);
+
+    if (period == 0) {
+        return after;
+    }
+    if (schedule->period == 0 || after < SYNC_CLOCK_VALID) {
+        return after + period;
+    }
+
+    uint32_t wait = (schedule->offset + period - after % period) % period;
+    return after + (wait > 0 ? wait : period);
+}
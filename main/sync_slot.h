@@ -0,0 +1,47 @@
+#ifndef SYNC_SLOT_H_
+#define SYNC_SLOT_H_
+
+#include <stdint.h>
+
+/* Sync scheduling of the Wi-Fi uplink. The server may assign every
+   device a slot (period and phase offset, in wall clock seconds) and ask
+   it to back off, both in the upload response body:
+
+     {"sync_slot": {"period": 600, "offset": 137}, "retry_after": 300}
+
+   Without a slot, syncs are spread with random jitter after power-on
+   and back off exponentially on failure, so a fleet that boots together
+   does not keep hitting the server together. */
+
+#define SYNC_CLOCK_VALID 1451606400     // 2016-01-01, earlier means the clock was never set
+#define SYNC_PERIOD_MIN 60              // accepted range of server assigned periods
+#define SYNC_PERIOD_MAX 86400
+#define SYNC_RETRY_AFTER_MAX 86400
+#define SYNC_BACKOFF_MAX 3600           // cap of the failure backoff, in s
+#define SYNC_BACKOFF_SHIFT_MAX 6
+
+typedef struct {
+    uint32_t period;        // 0 if the response carried no slot
+    uint32_t offset;
+    uint32_t retry_after;   // 0 if the response carried no hint
+} sync_hint_t;
+
+typedef struct {
+    uint32_t period;        // server assigned slot, 0 if none
+    uint32_t offset;
+    uint32_t next_sync;     // wall clock time of the next sync
+    uint32_t failures;      // consecutive failed syncs
+} sync_schedule_t;
+
+int sync_hint_parse(const char* response, sync_hint_t* hint);
+
+void sync_schedule_reset(sync_schedule_t* schedule, uint32_t now, uint32_t base_period, uint32_t random);
+
+int sync_schedule_due(const sync_schedule_t* schedule, uint32_t now);
+
+void sync_schedule_done(sync_schedule_t* schedule, uint32_t now, uint32_t base_period,
+    int success, const sync_hint_t* hint, uint32_t random);
+
+uint32_t sync_schedule_sleep(const sync_schedule_t* schedule, uint32_t now, uint32_t sleep_delay);
+
+#endif
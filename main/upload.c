@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "lwip/err.h"
+#include "lwip/sockets.h"
+#include "lwip/sys.h"
+#include "lwip/netdb.h"
+
+#include "upload.h"
+#include "blog.h"
+
+
+#define READOUT_JSON_LEN 128
+#define AGGREGATE_JSON_LEN 192
+#define TELEMETRY_JSON_LEN 32           // per phase, names are short
+#define REQUEST_HEADER_LEN 1024
+#define GET_REQUEST_LEN 256
+#define RECV_BUF_LEN 512
+
+
+// logging tag
+static const char *TAG = "upload";
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t len;
+} response_buffer_t;
+
+static const char* web_server = WEB_SERVER;
+static const char* web_port = WEB_PORT;
+
+static int copy_body(void* ctx, int status, const char* data, size_t len);
+static int http_exchange(const char* request, http_body_cb_t on_body, void* ctx, int timeout_ms);
+static int connect_within(int s, const struct sockaddr* addr, socklen_t addr_len, int timeout_ms);
+
+
+/* Overrides the server all requests go to. The strings must stay valid
+   for as long as requests are made. */
+void upload_set_server(const char* host, const char* port)
+{
+    web_server = host;
+    web_port = port;
+}
+
+
+/* Serializes readouts of one sensor into the JSON array accepted by
+   /api/v1/devices/<uuid>/readouts. The caller frees the result. */
+char* build_readouts_body(const char* sensor_code, const time_t* timestamps, const int* values, int count)
+{
+    char* body = malloc(count * READOUT_JSON_LEN + 3);
+    if (body == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate request body for %d readouts", count);
+        return NULL;
+    }
+
+    char time_buf[64];
+    struct tm timeinfo;
+    size_t len = 0;
+
+    body[len++] = '[';
+
+    for (int i = 0; i < count; i++) {
+        localtime_r(&timestamps[i], &timeinfo);
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &timeinfo);
+
+        len += snprintf(body + len, READOUT_JSON_LEN,
+            "%s{\"timestamp\": \"%s\", \"sensor_type\": \"%s\", \"value\": %d}",
+            i == 0 ? "" : ", ", time_buf, sensor_code, values[i]
+        );
+    }
+
+    body[len++] = ']';
+    body[len] = 0;
+
+    return body;
+}
+
+
+/* Serializes closed aggregation windows of one sensor for
+   /api/v1/devices/<uuid>/aggregates. 'timestamps' are the window starts.
+   The caller frees the result. */
+char* build_aggregates_body(const char* sensor_code, const time_t* timestamps,
+    const aggregate_record_t* records, int count, int window_len)
+{
+    char* body = malloc(count * AGGREGATE_JSON_LEN + 3);
+    if (body == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate request body for %d aggregates", count);
+        return NULL;
+    }
+
+    char time_buf[64];
+    struct tm timeinfo;
+    size_t len = 0;
+
+    body[len++] = '[';
+
+    for (int i = 0; i < count; i++) {
+        localtime_r(&timestamps[i], &timeinfo);
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &timeinfo);
+
+        len += snprintf(body + len, AGGREGATE_JSON_LEN,
+            "%s{\"timestamp\": \"%s\", \"sensor_type\": \"%s\", \"window\": %d, \"count\": %d, "
+            "\"min\": %d, \"max\": %d, \"mean\": %d, \"variance\": %d}",
+            i == 0 ? "" : ", ", time_buf, sensor_code, window_len, records[i].count,
+            records[i].min, records[i].max, records[i].mean, records[i].variance
+        );
+    }
+
+    body[len++] = ']';
+    body[len] = 0;
+
+    return body;
+}
+
+
+/* Serializes the wake-cycle supervisor counters for
+   /api/v1/devices/<uuid>/telemetry. The caller frees the result. */
+char* build_telemetry_body(const char* const* phase_names, const uint32_t* overruns, int phase_count,
+    uint32_t hard_cap_hits)
+{
+    char* body = malloc((phase_count + 2) * TELEMETRY_JSON_LEN);
+    if (body == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate telemetry body");
+        return NULL;
+    }
+
+    size_t len = sprintf(body, "{\"phase_overruns\": {");
+
+    for (int i = 0; i < phase_count; i++) {
+        len += snprintf(body + len, TELEMETRY_JSON_LEN, "%s\"%s\": %u",
+            i == 0 ? "" : ", ", phase_names[i], (unsigned) overruns[i]);
+    }
+
+    snprintf(body + len, 2 * TELEMETRY_JSON_LEN, "}, \"hard_cap_hits\": %u}", (unsigned) hard_cap_hits);
+
+    return body;
+}
+
+
+/* Prepends the HTTP header for posting 'body' to the 'resource' collection
+   (e.g. "readouts") of 'device_id'. The caller frees the result. */
+char* build_request(const char* device_id, const char* resource, const char* body)
+{
+    char header[REQUEST_HEADER_LEN];
+    int header_len = snprintf(header, REQUEST_HEADER_LEN,
+        "POST http://%s/api/v1/devices/%s/%s HTTP/1.0\r\n"
+        "Host: %s\r\n"
+        "User-Agent: esp-idf/1.0 esp32\r\n"
+        "Accept: application/json\r\n"
+        "Connection: close\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %d\r\n"
+        "\r\n", web_server, device_id, resource, web_server, (int)strlen(body));
+
+    char* request = malloc(header_len + strlen(body) + 1);
+    if (request == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate request");
+        return NULL;
+    }
+    strcpy(request, header);
+    strcat(request, body);
+
+    return request;
+}
+
+
+/* Sends a prepared request to the server and copies the response body
+   (without headers) into 'response'. The whole exchange gives up after
+   'timeout_ms', a 'timeout_ms' of 0 or less fails right away. Returns
+   the HTTP status code, or -1 if the server could not be reached. */
+int http_post(const char* request, char* response, size_t response_size, int timeout_ms)
+{
+    response_buffer_t buffer = {
+        .data = response,
+        .size = response_size,
+        .len = 0,
+    };
+
+    int status = http_exchange(request, copy_body, &buffer, timeout_ms);
+
+    if (response_size > 0) {
+        response[buffer.len] = 0;
+    }
+    return status;
+}
+
+
+/* Fetches 'path' (relative to /api/v1/devices/<uuid>/) of DEVICE_ID and
+   streams the response body to 'on_body' as it arrives, so large
+   downloads need no buffer. 'on_body' returning non-zero aborts the
+   transfer. Returns the HTTP status code, or -1 if the server could not
+   be reached or the transfer was aborted. */
+int http_get(const char* path, http_body_cb_t on_body, void* ctx, int timeout_ms)
+{
+    char request[GET_REQUEST_LEN];
+    snprintf(request, GET_REQUEST_LEN,
+        "GET http://%s/api/v1/devices/" DEVICE_ID "/%s HTTP/1.0\r\n"
+        "Host: %s\r\n"
+        "User-Agent: esp-idf/1.0 esp32\r\n"
+        "Connection: close\r\n"
+        "\r\n", web_server, path, web_server);
+
+    return http_exchange(request, on_body, ctx, timeout_ms);
+}
+
+
+static int copy_body(void* ctx, int status, const char* data, size_t len)
+{
+    response_buffer_t* buffer = ctx;
+
+    (void)status;
+    for (size_t i = 0; i < len && buffer->len + 1 < buffer->size; i++) {
+        buffer->data[buffer->len++] = data[i];
+    }
+    return 0;
+}
+
+
+static int http_exchange(const char* request, http_body_cb_t on_body, void* ctx, int timeout_ms)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+    struct in_addr *addr;
+    int s, r;
+    char recv_buf[RECV_BUF_LEN];
+
+    // a zero timeout means no timeout to lwip
+    if (timeout_ms <= 0) {
+        ESP_LOGE(TAG, "... no time left for the request");
+        return -1;
+    }
+    uint32_t start_ms = esp_log_timestamp();
+
+    int err = getaddrinfo(web_server, web_port, &hints, &res);
+
+    if(err != 0 || res == NULL) {
+        ESP_LOGE(TAG, "DNS lookup failed err=%d res=%p", err, res);
+        return -1;
+    }
+
+    /* Code to print the resolved IP, in network byte order */
+    addr = &((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    BLOGI(TAG, "DNS lookup succeeded. IP=%08x", addr->s_addr);
+
+    s = socket(res->ai_family, res->ai_socktype, 0);
+    if(s < 0) {
+        ESP_LOGE(TAG, "... Failed to allocate socket.");
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    // the resolver runs on its own timeouts, what it took comes off ours
+    int remaining_ms = timeout_ms - (int)(esp_log_timestamp() - start_ms);
+    if(remaining_ms <= 0 || connect_within(s, res->ai_addr, res->ai_addrlen, remaining_ms) != 0) {
+        ESP_LOGE(TAG, "... socket connect failed errno=%d", errno);
+        close(s);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    remaining_ms = timeout_ms - (int)(esp_log_timestamp() - start_ms);
+    if (remaining_ms <= 0) {
+        ESP_LOGE(TAG, "... no time left after connect");
+        close(s);
+        return -1;
+    }
+    struct timeval socket_timeout;
+    socket_timeout.tv_sec = remaining_ms / 1000;
+    socket_timeout.tv_usec = (remaining_ms % 1000) * 1000;
+    if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &socket_timeout, sizeof(socket_timeout)) < 0
+            || setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &socket_timeout, sizeof(socket_timeout)) < 0) {
+        ESP_LOGE(TAG, "... failed to set socket timeouts");
+        close(s);
+        return -1;
+    }
+
+    if (write(s, request, strlen(request)) < 0) {
+        ESP_LOGE(TAG, "... socket send failed");
+        close(s);
+        return -1;
+    }
+
+    /* Read HTTP response: status line and headers are matched on the fly,
+       everything after the blank line goes to 'on_body' */
+    int status = -1;
+    int header_done = 0;
+    size_t line_len = 0;
+    char line[64];
+
+    do {
+        r = read(s, recv_buf, sizeof(recv_buf));
+        for(int i = 0; i < r; i++) {
+            char ch = recv_buf[i];
+
+            if (header_done) {
+                if (on_body(ctx, status, recv_buf + i, r - i) != 0) {
+                    ESP_LOGE(TAG, "... transfer aborted, status=%d", status);
+                    close(s);
+                    return -1;
+                }
+                break;
+            }
+
+            if (ch != '\n') {
+                if (ch != '\r' && line_len < sizeof(line) - 1) {
+                    line[line_len++] = ch;
+                }
+                continue;
+            }
+
+            line[line_len] = 0;
+            if (status < 0) {
+                status = 0;
+                sscanf(line, "HTTP/%*s %d", &status);
+            } else if (line_len == 0) {
+                header_done = 1;
+            }
+            line_len = 0;
+        }
+
+        // every read may take up to the socket timeout, the exchange may not
+        if (r > 0 && (int)(esp_log_timestamp() - start_ms) >= timeout_ms) {
+            ESP_LOGE(TAG, "... transfer timed out, status=%d", status);
+            close(s);
+            return -1;
+        }
+    } while(r > 0);
+
+    BLOGI(TAG, "... done reading from socket, status=%d", status);
+    close(s);
+
+    return status;
+}
+
+
+/* connect() that gives up after 'timeout_ms'. A blocking connect in lwip
+   waits out the whole SYN retry schedule, SO_SNDTIMEO does not cover it. */
+static int connect_within(int s, const struct sockaddr* addr, socklen_t addr_len, int timeout_ms)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    if (connect(s, addr, addr_len) != 0) {
+        if (errno != EINPROGRESS) {
+            return -1;
+        }
+
+        fd_set writable;
+        FD_ZERO(&writable);
+        FD_SET(s, &writable);
+        struct timeval timeout;
+        timeout.tv_sec = timeout_ms / 1000;
+        timeout.tv_usec = (timeout_ms % 1000) * 1000;
+        int ready = select(s + 1, NULL, &writable, NULL, &timeout);
+        if (ready <= 0) {
+            if (ready == 0) {
+                errno = ETIMEDOUT;
+            }
+            return -1;
+        }
+
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(s, SOL_SOCKET, SO_ERROR, &error, &error_len) != 0 || error != 0) {
+            errno = error;
+            return -1;
+        }
+    }
+
+    return fcntl(s, F_SETFL, flags);
+}
@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "aggregate.h"
+
+
+// overridable for host builds, see tools/loadgen.py
+#ifndef WEB_SERVER
+#define WEB_SERVER "buratino.asobolev.ru"
+#endif
+#ifndef WEB_PORT
+#define WEB_PORT "80"
+#endif
+#define HTTP_TIMEOUT_MS 5000
+#define DEVICE_ID "2e52e67d-d0f5-4f87-b7b6-9aae97a42623"
+
+void upload_set_server(const char* host, const char* port);
+
+char* build_readouts_body(const char* sensor_code, const time_t* timestamps, const int* values, int count);
+
+char* build_aggregates_body(const char* sensor_code, const time_t* timestamps,
+    const aggregate_record_t* records, int count, int window_len);
+
+/* Receives a chunk of the response body along with the HTTP status */
+typedef int (*http_body_cb_t)(void* ctx, int status, const char* data, size_t len);
+
+char* build_telemetry_body(const char* const* phase_names, const uint32_t* overruns, int phase_count,
+    uint32_t hard_cap_hits);
+
+char* build_request(const char* device_id, const char* resource, const char* body);
+
+int http_post(const char* request, char* response, size_t response_size, int timeout_ms);
+
+int http_get(const char* path, http_body_cb_t on_body, void* ctx, int timeout_ms);
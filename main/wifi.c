@@ -16,6 +16,7 @@
 #include "lwip/err.h"
 #include "apps/sntp/sntp.h"
 #include "wifi.h"
+#include "blog.h"
 
 
 #define WIFI_SSID "Tech_D0048070"
@@ -32,11 +33,16 @@ static EventGroupHandle_t wifi_event_group;
 // logging tag
 static const char *TAG = "wifi";
 
+static const char* wifi_ssid = WIFI_SSID;
+static const char* wifi_pass = WIFI_PASS;
+
 static void initialize_sntp(void);
 static esp_err_t event_handler(void *ctx, system_event_t *event);
 
 
-void obtain_time()
+/* Waits up to 'timeout_ms' (forever if negative) for SNTP to set the
+   clock. Returns 0 once the time is set, -1 otherwise. */
+int obtain_time(int timeout_ms)
 {
     initialize_sntp();
     
@@ -45,37 +51,63 @@ void obtain_time()
     struct tm timeinfo = { 0 };
     int retry = 0;
     const int retry_count = 10;
+    const int retry_delay = 2000;
+    TickType_t start = xTaskGetTickCount();
 
     while (timeinfo.tm_year < (2016 - 1900) && ++retry < retry_count) {
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
+        int delay = retry_delay;
+
+        if (timeout_ms >= 0) {
+            int left = timeout_ms - (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+            if (left <= 0) {
+                break;
+            }
+            delay = left < delay ? left : delay;
+        }
+
+        BLOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
+        vTaskDelay(delay / portTICK_PERIOD_MS);
         time(&time_now);
         localtime_r(&time_now, &timeinfo);
     }
 
+    if (timeinfo.tm_year < (2016 - 1900)) {
+        ESP_LOGE(TAG, "System time is not set");
+        return -1;
+    }
+
     // update 'time_now' variable with current time
     time(&time_now);
 
-    // Set timezone to Eastern Standard Time and print local time
+    // Set timezone to Eastern Standard Time and log the current time
     setenv("TZ", "EST5EDT, M3.2.0/2, M11.1.0", 1);
     tzset();
-    localtime_r(&time_now, &timeinfo);
+    BLOGI(TAG, "The current time is %lu", time_now);
 
-    char strftime_buf[64];
-    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-    ESP_LOGI(TAG, "The current date/time in New York is: %s", strftime_buf);
+    return 0;
 }
 
 
 static void initialize_sntp(void)
 {
-    ESP_LOGI(TAG, "Initializing SNTP");
+    BLOGI(TAG, "Initializing SNTP");
     sntp_setoperatingmode(SNTP_OPMODE_POLL);
     sntp_setservername(0, "pool.ntp.org");
     sntp_init();
 }
 
-void initialise_wifi(void)
+/* Overrides the access point joined by initialise_wifi(). The strings
+   must stay valid while Wi-Fi is in use. */
+void wifi_set_credentials(const char* ssid, const char* pass)
+{
+    wifi_ssid = ssid;
+    wifi_pass = pass;
+}
+
+
+/* Joins the access point, waiting up to 'timeout_ms' (forever if
+   negative) for an IP address. Returns 0 once connected, -1 on timeout. */
+int initialise_wifi(int timeout_ms)
 {
     tcpip_adapter_init();
     wifi_event_group = xEventGroupCreate();
@@ -83,19 +115,23 @@ void initialise_wifi(void)
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
     ESP_ERROR_CHECK( esp_wifi_set_storage(WIFI_STORAGE_RAM) );
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASS,
-        },
-    };
-    ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
+    wifi_config_t wifi_config = { 0 };
+    strncpy((char*)wifi_config.sta.ssid, wifi_ssid, sizeof(wifi_config.sta.ssid));
+    strncpy((char*)wifi_config.sta.password, wifi_pass, sizeof(wifi_config.sta.password));
+    BLOGI(TAG, "Setting WiFi configuration...");
     ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK( esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config) );
     ESP_ERROR_CHECK( esp_wifi_start() );
 
     /* Waiting for connection */
-    xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, false, true, portMAX_DELAY);
+    TickType_t wait_ticks = timeout_ms < 0 ? portMAX_DELAY : (TickType_t)timeout_ms / portTICK_PERIOD_MS;
+    EventBits_t bits = xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, false, true, wait_ticks);
+
+    if (!(bits & CONNECTED_BIT)) {
+        ESP_LOGE(TAG, "Not connected to %s after %d ms", wifi_ssid, timeout_ms);
+        return -1;
+    }
+    return 0;
 }
 
 static esp_err_t event_handler(void *ctx, system_event_t *event)
@@ -1,6 +1,8 @@
 
-void obtain_time();
+int obtain_time(int timeout_ms);
 
-void initialise_wifi(void);
+void wifi_set_credentials(const char* ssid, const char* pass);
+
+int initialise_wifi(int timeout_ms);
 
 void stop_wifi();
\ No newline at end of file
@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+"""Checks the firmware's integer Welford aggregates and times them.
+
+Usage: aggregate_test.py [--windows 2000] [--bench 10000000]
+
+Builds main/aggregate.c with the host C compiler and feeds it windows of
+known data through ctypes: constant and single sample windows, extremes
+of the +-2^15 sensor range, long windows, negative values, and --windows
+random windows of sensor-like data. Mean and sample variance are
+compared with exact rational arithmetic; min, max, count and
+aggregate_due() must match exactly. Exits non-zero on the first window
+off by more than the rounding of the fixed point format allows.
+
+Then times --bench calls of aggregate_add() in a C loop, next to the
+same loop over a double precision Welford. The host has hardware double
+precision, the ESP32 does not (doubles are emulated there), so the host
+ratio understates what the integer version saves on the device.
+"""
+import argparse
+import ctypes
+import random
+import sys
+from fractions import Fraction
+
+from hostlib import AggregateRecord, AggregateWindow, build
+
+FIXED_SHIFT = 8             # AGGREGATE_FIXED_SHIFT
+
+BENCH_SOURCE = r'''
+#include <stdint.h>
+#include <time.h>
+#include "aggregate.h"
+
+static double elapsed_ns(const struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+double bench_fixed(int n, volatile int32_t* sink)
+{
+    aggregate_window_t window;
+    struct timespec start;
+    aggregate_reset(&window, 0);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i++) {
+        aggregate_add(&window, (int32_t)((i * 2654435761u) >> 20) - 2048);
+    }
+    *sink = (int32_t)window.m2;
+    return elapsed_ns(&start) / n;
+}
+
+double bench_double(int n, volatile int32_t* sink)
+{
+    double mean = 0, m2 = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i++) {
+        double x = (int32_t)((i * 2654435761u) >> 20) - 2048;
+        double delta = x - mean;
+        mean += delta / (i + 1);
+        m2 += delta * (x - mean);
+    }
+    *sink = (int32_t)m2;
+    return elapsed_ns(&start) / n;
+}
+'''
+
+
+def load_aggregate():
+    lib = build('aggregate', ['aggregate.c'], source=BENCH_SOURCE)
+    for name in ('bench_fixed', 'bench_double'):
+        getattr(lib, name).argtypes = [ctypes.c_int, ctypes.POINTER(ctypes.c_int32)]
+        getattr(lib, name).restype = ctypes.c_double
+    return lib
+
+
+def aggregate(lib, values, start=1000):
+    window = AggregateWindow()
+    record = AggregateRecord()
+    lib.aggregate_reset(ctypes.byref(window), start)
+    for value in values:
+        lib.aggregate_add(ctypes.byref(window), value)
+    lib.aggregate_close(ctypes.byref(window), ctypes.byref(record))
+    return window, record
+
+
+def check(lib, name, values):
+    """Compares one window with exact statistics. The mean is rounded to
+    fixed point and then to units, so it is within half a unit and 2^-9.
+    Each step of M2 uses means within
+    2^-9 of the exact ones, which moves the variance by up to the
+    spread of the window times 2^-8, plus its own rounding."""
+    _, record = aggregate(lib, values)
+    n = len(values)
+    mean = Fraction(sum(values), n)
+    variance = sum((v - mean) ** 2 for v in values) / (n - 1) if n > 1 else Fraction(0)
+    spread = max(values) - min(values)
+    mean_slack = Fraction(1, 2) + Fraction(1, 2 << FIXED_SHIFT)
+    variance_slack = 1 + Fraction(spread, 1 << FIXED_SHIFT)
+
+    errors = []
+    if (record.count, record.min, record.max) != (n, min(values), max(values)):
+        errors.append('count/min/max %d/%d/%d' % (record.count, record.min, record.max))
+    if abs(record.mean - mean) > mean_slack:
+        errors.append('mean %d, exact %.3f' % (record.mean, float(mean)))
+    if abs(record.variance - min(variance, 2 ** 31 - 1)) > variance_slack:
+        errors.append('variance %d, exact %.3f' % (record.variance, float(variance)))
+    if errors:
+        sys.exit('%s (%d samples): %s' % (name, n, ', '.join(errors)))
+    return abs(record.mean - mean), abs(record.variance - variance)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--windows', type=int, default=2000, help='random windows checked')
+    parser.add_argument('--bench', type=int, default=10000000, help='samples timed, 0 to skip')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib = load_aggregate()
+    rng = random.Random(args.seed)
+
+    cases = [
+        ('single sample', [1234]),
+        ('constant', [-7] * 500),
+        ('two samples', [0, 1]),
+        ('negative half', [-1, -2]),
+        ('extremes', [32767, -32768] * 50),
+        ('long window', [rng.randint(-32768, 32767) for _ in range(100000)]),
+        ('drift', [i // 10 for i in range(20000)]),
+        ('offset', [30000 + rng.randint(-3, 3) for _ in range(5000)]),
+    ]
+    for name, values in cases:
+        check(lib, name, values)
+
+    worst_mean = worst_variance = 0
+    for _ in range(args.windows):
+        center = rng.randint(-20000, 20000)
+        spread = rng.choice([1, 10, 100, 1000])
+        values = [center + int(rng.gauss(0, spread)) for _ in range(rng.randint(1, 720))]
+        values = [max(-32768, min(32767, v)) for v in values]
+        mean_error, variance_error = check(lib, 'random window', values)
+        worst_mean = max(worst_mean, mean_error)
+        worst_variance = max(worst_variance, variance_error)
+
+    window, _ = aggregate(lib, [])
+    due = [lib.aggregate_due(ctypes.byref(window), 5000, 600)]
+    window, _ = aggregate(lib, [1], start=1000)
+    due += [lib.aggregate_due(ctypes.byref(window), now, 600) for now in (1599, 1600, 999)]
+    if due != [0, 0, 1, 1]:
+        sys.exit('aggregate_due %s, expected [0, 0, 1, 1]' % due)
+
+    print('%d fixed and %d random windows match, worst error: mean %.3f, variance %.3f' % (
+        len(cases), args.windows, float(worst_mean), float(worst_variance)))
+
+    if args.bench:
+        sink = ctypes.c_int32()
+        fixed = min(lib.bench_fixed(args.bench, ctypes.byref(sink)) for _ in range(3))
+        double = min(lib.bench_double(args.bench, ctypes.byref(sink)) for _ in range(3))
+        print('aggregate_add: %.2f ns per sample, double Welford %.2f ns (host)' % (fixed, double))
+
+
+if __name__ == '__main__':
+    main()
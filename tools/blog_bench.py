@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+"""Measures what a BLOGx() call costs next to formatting the message.
+
+Usage: blog_bench.py [--calls 10000000] [--baud 115200]
+
+Builds main/blog.c with the host C compiler against the stand-in headers
+in tools/host/ and times BLOGI() calls with 0 to 4 arguments in a C
+loop, next to snprintf() of the same message, which is the least an
+ESP_LOGI() does before its line reaches the UART. The line then takes
+its length times 10 bits at --baud to go out, which is printed too: on
+the device that, not the formatting, is what a log line costs once the
+UART FIFO is full.
+
+Host times are only good for comparing the two, the ESP32 runs the
+same code several times slower.
+"""
+import argparse
+import ctypes
+
+from hostlib import build
+
+MESSAGE = 'Dumping %s readout at %lu with value: %d'
+
+BENCH_SOURCE = r'''
+#include <stdio.h>
+#include <time.h>
+#include "blog.h"
+
+static const char *TAG = "bench";
+
+static double elapsed_ns(const struct timespec* start, int n)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec)) / n;
+}
+
+double bench_blog(int n, int nargs)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i++) {
+        switch (nargs) {
+        case 0: BLOGI(TAG, "Dumping readouts"); break;
+        case 1: BLOGI(TAG, "Dumping %s readouts", "TMP"); break;
+        case 2: BLOGI(TAG, "Dumping %s readout at %lu", "TMP", (unsigned long)i); break;
+        case 3: BLOGI(TAG, "Dumping %s readout at %lu with value: %d", "TMP", (unsigned long)i, i); break;
+        default: BLOGI(TAG, "Dumping %s readout at %lu with value: %d of %d", "TMP", (unsigned long)i, i, n); break;
+        }
+    }
+    return elapsed_ns(&start, n);
+}
+
+double bench_format(int n, volatile char* sink)
+{
+    char line[128];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; i++) {
+        snprintf(line, sizeof(line), "I (%u) %s: Dumping %s readout at %lu with value: %d\n",
+            (unsigned)i, TAG, "TMP", (unsigned long)i, i);
+        *sink = line[0];
+    }
+    return elapsed_ns(&start, n);
+}
+'''
+
+
+def load_blog():
+    lib = build('blog', ['blog.c'], ['CONFIG_BURATINO_BLOG_GPIO=0'], BENCH_SOURCE)
+    lib.bench_blog.argtypes = [ctypes.c_int, ctypes.c_int]
+    lib.bench_blog.restype = ctypes.c_double
+    lib.bench_format.argtypes = [ctypes.c_int, ctypes.c_char_p]
+    lib.bench_format.restype = ctypes.c_double
+    return lib
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--calls', type=int, default=10000000)
+    parser.add_argument('--baud', type=int, default=115200, help='console UART speed')
+    args = parser.parse_args()
+
+    lib = load_blog()
+    sink = ctypes.create_string_buffer(1)
+
+    print('%-24s %10s' % ('', 'ns/call'))
+    for nargs in range(5):
+        ns = min(lib.bench_blog(args.calls, nargs) for _ in range(3))
+        print('%-24s %10.1f' % ('BLOGI, %d args' % nargs, ns))
+    ns = min(lib.bench_format(args.calls, sink) for _ in range(3))
+    print('%-24s %10.1f' % ('snprintf, 3 args', ns))
+
+    line = 'I (123456) storage: ' + MESSAGE % ('TMP', 123456789, -2048) + '\n'
+    print('%-24s %10.1f' % ('UART, %d bytes' % len(line), len(line) * 10 * 1e9 / args.baud))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+"""Renders the deferred binary log (main/blog.c) dumped over UART.
+
+Usage: blog_decode.py build/temp.elf [capture.txt]
+
+Reads a serial capture (stdin by default), replaces every "BLOG" record
+line with the formatted message and passes all other lines through.
+Format and tag strings are looked up by address in the firmware ELF, so
+the ELF must be the one the device is running. A %s argument is only
+rendered if it points into flash data (DROM), where string literals
+live; a pointer anywhere else breaks the rule in main/blog.h and is
+printed as <not in flash 0x...>, as what the ELF has at a RAM address
+is not what the device had there.
+"""
+import re
+import struct
+import sys
+
+LEVELS = {1: 'E', 2: 'W', 3: 'I', 4: 'D'}
+SHT_PROGBITS = 1
+DROM = (0x3F400000, 0x3F800000)     # SOC_DROM_LOW, SOC_DROM_HIGH: flash mapped for data
+CONVERSION = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z)?([diouxXcsp%])')
+
+
+class Elf(object):
+    """Just enough of ELF32 to read constant strings by address"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF' or self.data[4:5] != b'\x01':
+            raise ValueError('%s is not a 32-bit ELF file' % path)
+
+        shoff, = struct.unpack_from('<I', self.data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', self.data, 0x2E)
+
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from('<IIIIII', self.data, shoff + i * shentsize)
+            if sh_type == SHT_PROGBITS and addr != 0:
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                end = self.data.index(b'\0', start)
+                return self.data[start:end].decode('utf-8', 'replace')
+        return None
+
+
+def render(elf, fmt, args):
+    args = list(args)
+
+    def convert(match):
+        flags, _, kind = match.groups()
+        if kind == '%':
+            return '%'
+        value = args.pop(0) if args else 0
+        if kind == 's':
+            if not DROM[0] <= value < DROM[1]:
+                return '<not in flash 0x%08x>' % value
+            text = elf.string(value)
+            return text if text is not None else '<str@0x%08x>' % value
+        if kind == 'p':
+            return '0x%08x' % value
+        if kind in 'di' and value >= 0x80000000:
+            value -= 0x100000000
+        if kind == 'c':
+            return chr(value & 0xFF)
+        return ('%' + flags + kind) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode_line(elf, line):
+    words = [int(w, 16) for w in line.split()[1:]]
+    if len(words) != 8:
+        return line.rstrip('\n')
+
+    fmt_addr, tag_addr, time, meta = words[:4]
+    fmt = elf.string(fmt_addr)
+    tag = elf.string(tag_addr) or '?'
+    nargs = meta & 0xFF
+    level = LEVELS.get((meta >> 8) & 0xFF, '?')
+    wake = meta >> 16
+
+    if fmt is None:
+        return 'BLOG unknown format 0x%08x, is the ELF up to date?' % fmt_addr
+
+    return '%s [wake %d] (%d) %s: %s' % (level, wake, time, tag, render(elf, fmt, words[4:4 + nargs]))
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__)
+
+    elf = Elf(sys.argv[1])
+    capture = open(sys.argv[2]) if len(sys.argv) == 3 else sys.stdin
+
+    for line in capture:
+        if line.startswith('BLOG ') and not line.startswith('BLOG lost'):
+            print(decode_line(elf, line))
+        else:
+            sys.stdout.write(line)
+
+
+if __name__ == '__main__':
+    main()
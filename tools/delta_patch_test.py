@@ -0,0 +1,226 @@
+#!/usr/bin/env python
+"""Checks the firmware's delta applier against patches made by ota_delta.py.
+
+Usage: delta_patch_test.py [--seed 1] [--rounds 20]
+
+Builds main/delta_patch.c with the host C compiler and drives it through
+ctypes. For pairs of synthetic images (small edits, shifted addresses,
+inserted and dropped code, growth, shrinkage, an unrelated image) makes
+a patch with ota_delta.diff(), inflates it and feeds it to
+delta_patch_feed() in chunks split at random boundaries, --rounds times
+per pair and once byte by byte, as ota.c gets it from the socket. The
+written image must be the new one and delta_patch_finish() must accept
+it. Patches for another old image, truncated, overrunning the old or new
+image, or with a flipped byte must be turned down. Exits non-zero on the
+first patch the firmware gets wrong.
+"""
+import argparse
+import ctypes
+import random
+import struct
+import sys
+import zlib
+
+import ota_delta
+from hostlib import build
+
+DELTA_OK, DELTA_ERR_FORMAT, DELTA_ERR_OLD_IMAGE, DELTA_ERR_IO, DELTA_ERR_NEW_IMAGE = 0, -1, -2, -3, -4
+STATUS_NAMES = {DELTA_OK: 'OK', DELTA_ERR_FORMAT: 'ERR_FORMAT', DELTA_ERR_OLD_IMAGE: 'ERR_OLD_IMAGE',
+                DELTA_ERR_IO: 'ERR_IO', DELTA_ERR_NEW_IMAGE: 'ERR_NEW_IMAGE'}
+MAX_CHUNK = 700             # larger than DELTA_BUF_LEN, so chunks both split and span its buffers
+
+HARNESS_SOURCE = r'''
+#include <string.h>
+#include "delta_patch.h"
+
+typedef struct {
+    const uint8_t* old;
+    size_t old_len;
+    uint8_t* out;
+    size_t out_size;
+    size_t out_len;
+} images_t;
+
+static int read_old(void* ctx, uint32_t offset, uint8_t* buf, size_t len)
+{
+    images_t* images = ctx;
+    if (offset > images->old_len || len > images->old_len - offset) {
+        return -1;
+    }
+    memcpy(buf, images->old + offset, len);
+    return 0;
+}
+
+static int write_new(void* ctx, const uint8_t* buf, size_t len)
+{
+    images_t* images = ctx;
+    if (len > images->out_size - images->out_len) {
+        return -1;
+    }
+    memcpy(images->out + images->out_len, buf, len);
+    images->out_len += len;
+    return 0;
+}
+
+/* Feeds 'patch' in chunks of the given sizes, the rest in one go, and
+   returns the status of the first feed that failed or of the finish */
+int apply_chunked(const uint8_t* old, size_t old_len, const uint8_t* patch, size_t patch_len,
+                  const uint32_t* chunks, int chunk_count, uint8_t* out, size_t out_size, size_t* out_len)
+{
+    images_t images = { old, old_len, out, out_size, 0 };
+    delta_patch_t state;
+    delta_status_t status = DELTA_OK;
+    size_t pos = 0;
+
+    delta_patch_init(&state, read_old, write_new, &images);
+    for (int i = 0; i <= chunk_count && status == DELTA_OK; i++) {
+        size_t n = i < chunk_count && chunks[i] < patch_len - pos ? chunks[i] : patch_len - pos;
+        status = delta_patch_feed(&state, patch + pos, n);
+        pos += n;
+    }
+    if (status == DELTA_OK) {
+        status = delta_patch_finish(&state);
+    }
+    *out_len = images.out_len;
+    return status;
+}
+'''
+
+
+def load_delta_patch():
+    lib = build('delta_patch', ['delta_patch.c'], source=HARNESS_SOURCE)
+    lib.apply_chunked.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_char_p, ctypes.c_size_t,
+                                  ctypes.POINTER(ctypes.c_uint32), ctypes.c_int, ctypes.c_char_p,
+                                  ctypes.c_size_t, ctypes.POINTER(ctypes.c_size_t)]
+    return lib
+
+
+def apply(lib, old, raw, chunks):
+    """Status and image of the firmware applying an inflated patch"""
+    out = ctypes.create_string_buffer(len(raw) + len(old) + 1)
+    out_len = ctypes.c_size_t()
+    sizes = (ctypes.c_uint32 * len(chunks))(*chunks)
+    status = lib.apply_chunked(old, len(old), raw, len(raw), sizes, len(chunks), out, len(out),
+                               ctypes.byref(out_len))
+    return status, out.raw[:out_len.value]
+
+
+def random_chunks(rng, length):
+    chunks = []
+    while sum(chunks) < length:
+        chunks.append(rng.randint(1, MAX_CHUNK) if rng.random() < 0.8 else rng.randint(1, 8))
+    return chunks
+
+
+def firmware(rng, size):
+    """Image with the repetition of code: instructions reused with
+    different operands, and little-endian addresses into one region"""
+    ops = [bytes(bytearray(rng.getrandbits(8) for _ in range(3))) for _ in range(64)]
+    out = bytearray()
+    while len(out) < size:
+        if rng.random() < 0.2:
+            out += struct.pack('<I', 0x400D0000 + rng.randrange(0x10000) * 4)
+        else:
+            out += rng.choice(ops)
+    return bytes(out[:size])
+
+
+def shift_addresses(image, by):
+    out = bytearray(image)
+    for i in range(0, len(out) - 3):
+        word = struct.unpack_from('<I', out, i)[0]
+        if 0x400D0000 <= word < 0x40110000:
+            struct.pack_into('<I', out, i, word + by)
+    return bytes(out)
+
+
+def image_pairs(rng):
+    old = firmware(rng, 96 * 1024)
+    edited = bytearray(old)
+    for _ in range(40):
+        edited[rng.randrange(len(edited))] = rng.getrandbits(8)
+    cut = rng.randrange(len(old) // 4, len(old) // 2)
+    return [
+        ('identical', old, old),
+        ('small edits', old, bytes(edited)),
+        ('shifted addresses', old, shift_addresses(old, 0x40)),
+        ('inserted code', old, old[:cut] + firmware(rng, 3000) + shift_addresses(old[cut:], 3000)),
+        ('dropped code', old, old[:cut] + old[cut + 5000:]),
+        ('grown', old, old + firmware(rng, 20000)),
+        ('shrunk', old, old[:len(old) // 3]),
+        ('unrelated', old, firmware(rng, 64 * 1024)),
+        ('empty old', b'', firmware(rng, 4096)),
+    ]
+
+
+def broken_patches(old, new):
+    """(name, old image, inflated patch, expected status) the firmware must turn down"""
+    raw = zlib.decompress(ota_delta.diff(old, new))
+    header = ota_delta.HEADER
+    control = ota_delta.CONTROL
+    other = bytearray(old)
+    other[len(other) // 2] ^= 0xFF
+    flipped = bytearray(raw)
+    flipped[len(raw) // 2] ^= 0x01
+    old_crc = ota_delta.crc32(old)
+    return [
+        ('not a patch', old, b'PK\x03\x04' + raw[4:], DELTA_ERR_FORMAT),
+        ('another old image', bytes(other), raw, DELTA_ERR_OLD_IMAGE),
+        ('truncated header', old, raw[:header.size - 3], DELTA_ERR_FORMAT),
+        ('truncated record', old, raw[:-7], DELTA_ERR_FORMAT),
+        ('flipped byte', old, bytes(flipped), DELTA_ERR_NEW_IMAGE),
+        ('extra past the new image', old, raw + control.pack(0, 16, 0) + b'x' * 16, DELTA_ERR_FORMAT),
+        ('diff past the old image', old,
+         header.pack(ota_delta.MAGIC, len(old), old_crc, len(old) + 64, 0) + control.pack(len(old) + 64, 0, 0),
+         DELTA_ERR_FORMAT),
+        ('seek before the old image', old,
+         header.pack(ota_delta.MAGIC, len(old), old_crc, 64, 0) + control.pack(0, 0, -16) + control.pack(32, 0, 0),
+         DELTA_ERR_FORMAT),
+    ]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--rounds', type=int, default=20, help='random chunkings of every patch')
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    lib = load_delta_patch()
+
+    for data in (b'', b'123456789', firmware(rng, 5000)):
+        if lib.delta_crc32(0, data, len(data)) != ota_delta.crc32(data):
+            sys.exit('delta_crc32 differs from zlib over %d bytes' % len(data))
+
+    pairs = image_pairs(rng)
+    patch_bytes = image_bytes = 0
+    for name, old, new in pairs:
+        patch = ota_delta.diff(old, new)
+        raw = zlib.decompress(patch)
+        if ota_delta.apply(old, patch) != new:
+            sys.exit('%s: ota_delta.py apply does not give the new image' % name)
+        patch_bytes += len(patch)
+        image_bytes += len(new)
+
+        chunkings = [random_chunks(rng, len(raw)) for _ in range(args.rounds)] + [[1] * len(raw)]
+        for chunks in chunkings:
+            status, image = apply(lib, old, raw, chunks)
+            if status != DELTA_OK or image != new:
+                sys.exit('%s: %s, %d of %d bytes right, %d chunks' % (
+                    name, STATUS_NAMES[status], sum(1 for a, b in zip(image, new) if a == b), len(new),
+                    len(chunks)))
+
+    broken = broken_patches(*pairs[3][1:])
+    for name, old, raw, expected in broken:
+        for chunks in ([len(raw)], random_chunks(rng, len(raw))):
+            status, _ = apply(lib, old, raw, chunks)
+            if status != expected:
+                sys.exit('%s: %s, expected %s' % (name, STATUS_NAMES[status], STATUS_NAMES[expected]))
+
+    print('%d patches applied in %d chunkings each, %d of %d image bytes shipped' % (
+        len(pairs), args.rounds + 1, patch_bytes, image_bytes))
+    print('%d broken patches turned down' % len(broken))
+
+
+if __name__ == '__main__':
+    main()
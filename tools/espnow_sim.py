@@ -0,0 +1,164 @@
+#!/usr/bin/env python
+"""Replays ESP-NOW syncs over a lossy link through the firmware's framing.
+
+Usage: espnow_sim.py [--devices 30] [--wakes 2000] [--loss 0.2] [--ack-loss 0.2]
+
+Runs --devices devices against one gateway. Every device takes readouts
+on each wake and hands its backlog over with espnow_send_readouts(); the
+gateway takes frames with espnow_gateway_accept() (main/espnow_proto.c,
+compiled on the fly with the host C compiler). The simulated link drops
+--loss of the frames, drops --ack-loss of the ACKs and delivers --dup of
+the frames twice. --power-loss of the wakes start from a power-on, which
+resets the RTC sender state; an unacknowledged frame comes back from NVS
+as espnow.c keeps it. Devices sync sensor by sensor like sync_espnow().
+After the last wake every device syncs over a clean link until its
+backlog is empty.
+
+The same run is repeated with the boot number held constant and without
+the NVS copy, which is how frames looked before either was added. For
+both runs prints readouts taken, uploaded exactly once, uploaded twice,
+lost (acked but never uploaded) and still waiting on the devices. Exits
+non-zero if the firmware loses or duplicates readouts.
+"""
+import argparse
+import ctypes
+import random
+import sys
+from collections import Counter
+
+from hostlib import BATCH_SIZE, DEVICE_ID_LEN, SEND, WAIT_ACK, Frame, Gateway, Readout, Sender, Transport, build
+
+SENSORS = [b'TMP', b'FER']
+
+
+class Link(object):
+    """Lossy radio between the device sending and the gateway"""
+
+    def __init__(self, lib, gateway, args, rng):
+        self.lib = lib
+        self.gateway = gateway
+        self.args = args
+        self.rng = rng
+        self.acked = None
+        self.upstream = Counter()
+        self.transport = Transport(SEND(self.send), WAIT_ACK(self.wait_ack), None)
+
+    def send(self, ctx, data, length):
+        if self.rng.random() < self.args.loss:
+            return 0
+        frame = Frame()
+        if self.lib.espnow_decode_frame(data, length, ctypes.byref(frame)) != 0:
+            raise AssertionError('frame does not decode')
+        for _ in range(2 if self.rng.random() < self.args.dup else 1):
+            if self.lib.espnow_gateway_accept(ctypes.byref(self.gateway), ctypes.byref(frame), 0) < 0:
+                continue
+            if self.rng.random() >= self.args.ack_loss:
+                self.acked = frame.seq
+        return 0
+
+    def wait_ack(self, ctx, seq, timeout_ms):
+        acked, self.acked = self.acked, None
+        return 0 if acked == seq else -1
+
+    def forward(self, everything=False):
+        """Uploads the batch once it fills up, as gateway_run() does"""
+        if self.gateway.readout_count >= BATCH_SIZE * 3 // 4 or everything:
+            for i in range(self.gateway.readout_count):
+                self.upstream[self.gateway.readouts[i].value] += 1
+            self.gateway.readout_count = 0
+
+
+class Device(object):
+    def __init__(self, index, rng):
+        self.id = (ctypes.c_uint8 * DEVICE_ID_LEN)(*bytearray(rng.getrandbits(8) for _ in range(DEVICE_ID_LEN)))
+        self.base = index * 10000000
+        self.taken = 0
+        self.backlog = dict((code, []) for code in SENSORS)
+        self.sender = Sender(boot=1)
+        self.saved = None           # unacked frame in NVS
+
+    def power_on(self, firmware):
+        if firmware and self.saved is not None:
+            self.sender = Sender.from_buffer_copy(self.saved)
+        else:
+            self.sender = Sender(boot=self.sender.boot + 1 if firmware else self.sender.boot)
+
+    def sync(self, lib, link, firmware):
+        """Sensor by sensor like sync_espnow(): the sensor of an unacked
+        frame goes first, the first sensor the gateway fails ends the sync"""
+        first = SENSORS.index(self.sender.unacked_code) if self.sender.unacked else 0
+        for code in SENSORS[first:] + SENSORS[:first]:
+            backlog = self.backlog[code]
+            readouts = (Readout * len(backlog))(*[Readout(0, value) for value in backlog])
+            sent = lib.espnow_send_readouts(ctypes.byref(link.transport), self.id, ctypes.byref(self.sender),
+                                            code, readouts, len(backlog))
+            del backlog[:sent]
+            if firmware:
+                self.saved = bytes(self.sender) if self.sender.unacked else None
+            if sent < len(readouts):
+                return
+
+
+def simulate(lib, args, firmware):
+    rng = random.Random(args.seed)
+    gateway = Gateway()
+    lib.espnow_gateway_init(ctypes.byref(gateway))
+    link = Link(lib, gateway, args, rng)
+    devices = [Device(i, rng) for i in range(args.devices)]
+
+    for wake in range(args.wakes):
+        for device in rng.sample(devices, len(devices)):
+            if rng.random() < args.power_loss:
+                device.power_on(firmware)
+            for code in SENSORS:
+                for _ in range(rng.randint(0, 3)):
+                    device.backlog[code].append(device.base + device.taken)
+                    device.taken += 1
+
+            if wake % args.sync_every == 0:
+                device.sync(lib, link, firmware)
+                link.forward()
+
+    link.args = argparse.Namespace(loss=0, ack_loss=0, dup=0)
+    for device in devices:
+        for _ in range(100):
+            link.forward(everything=True)
+            device.sync(lib, link, firmware)
+    link.forward(everything=True)
+
+    taken = set(device.base + i for device in devices for i in range(device.taken))
+    waiting = set(value for device in devices for backlog in device.backlog.values() for value in backlog)
+    uploaded = link.upstream
+    return [len(taken), sum(1 for value in taken if uploaded[value] == 1),
+            sum(1 for value in taken if uploaded[value] > 1),
+            len(taken - waiting - set(uploaded)), len(waiting)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--devices', type=int, default=30, help='more than the radio keeps as peers')
+    parser.add_argument('--wakes', type=int, default=2000)
+    parser.add_argument('--sync-every', type=int, default=3, help='wakes per sync')
+    parser.add_argument('--loss', type=float, default=0.2, help='share of frames lost')
+    parser.add_argument('--ack-loss', type=float, default=0.2, help='share of ACKs lost')
+    parser.add_argument('--dup', type=float, default=0.05, help='share of frames delivered twice')
+    parser.add_argument('--power-loss', type=float, default=0.02, help='share of wakes after a power-on')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib = build('espnow_proto', ['espnow_proto.c'])
+    results = [('firmware', simulate(lib, args, True)), ('constant boot', simulate(lib, args, False))]
+
+    print('%d devices, %d wakes, frame loss %g, ACK loss %g, duplicates %g, power loss %g' % (
+        args.devices, args.wakes, args.loss, args.ack_loss, args.dup, args.power_loss))
+    print('%-14s %8s %8s %8s %8s %8s' % ('', 'taken', 'once', 'twice', 'lost', 'waiting'))
+    for name, row in results:
+        print('%-14s %8d %8d %8d %8d %8d' % tuple([name] + row))
+
+    taken, once, twice, lost, waiting = results[0][1]
+    if twice or lost or waiting or once != taken:
+        sys.exit('readouts lost or duplicated')
+
+
+if __name__ == '__main__':
+    main()
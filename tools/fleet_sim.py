@@ -0,0 +1,127 @@
+#!/usr/bin/env python
+"""Simulates a fleet booting together after a power outage.
+
+Usage: fleet_sim.py [--devices 5000] [--hours 3] [--capacity 200]
+
+Runs the fleet twice in simulated time against a server that serves
+--capacity uploads at once: first with the fixed FREQ_SYNC cadence, then
+with server assigned sync slots. The slot run calls the firmware's own
+scheduler (main/sync_slot.c, compiled on the fly with the host C
+compiler) and the slot assignment of tools/sync_server.py. Prints peak
+concurrent connections and failed connects of both runs.
+"""
+import argparse
+import ctypes
+import heapq
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from sync_server import SlotAssigner, RETRY_AFTER  # noqa: E402
+from hostlib import Hint, Schedule, build  # noqa: E402
+
+START = 1500000000      # wall clock at power-on, the RTC is assumed set
+AWAKE = 1.0             # seconds awake on a wake without sync
+REJECT = 1.0            # seconds a refused connection keeps the radio up
+
+
+class Server(object):
+    """Connections in flight, refusing those over capacity"""
+
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.accepted = []      # end times
+        self.attempts = []      # end times, refused ones included
+        self.peak = 0
+        self.failed = 0
+        self.synced = 0
+
+    def connect(self, now, duration):
+        while self.accepted and self.accepted[0] <= now:
+            heapq.heappop(self.accepted)
+        while self.attempts and self.attempts[0] <= now:
+            heapq.heappop(self.attempts)
+
+        ok = len(self.accepted) < self.capacity
+        end = now + (duration if ok else REJECT)
+        heapq.heappush(self.attempts, end)
+        self.peak = max(self.peak, len(self.attempts))
+        if ok:
+            heapq.heappush(self.accepted, end)
+            self.synced += 1
+        else:
+            self.failed += 1
+        return ok, end
+
+
+def simulate(args, lib=None):
+    rng = random.Random(args.seed)
+    server = Server(args.capacity)
+    slots = SlotAssigner(args.period)
+    base_period = args.sleep * args.sync_every
+    end_time = START + args.hours * 3600
+    schedules = []
+    wakes = []
+
+    for device in range(args.devices):
+        boot = START + rng.uniform(0, args.boot_jitter)
+        if lib is not None:
+            schedule = Schedule()
+            lib.sync_schedule_reset(ctypes.byref(schedule), int(boot), base_period, rng.getrandbits(32))
+            schedules.append(schedule)
+        heapq.heappush(wakes, (boot, device, 1))
+
+    while wakes:
+        now, device, boot_count = heapq.heappop(wakes)
+        if now >= end_time:
+            continue
+
+        if lib is None:
+            sync = boot_count % args.sync_every == 0
+        else:
+            schedule = schedules[device]
+            sync = lib.sync_schedule_due(ctypes.byref(schedule), int(now))
+
+        awake_end = now + AWAKE
+        if sync:
+            ok, awake_end = server.connect(now, rng.uniform(args.min_upload, args.max_upload))
+            if lib is not None:
+                hint = Hint(**slots.assign(device))
+                if not ok:
+                    hint.retry_after = RETRY_AFTER
+                lib.sync_schedule_done(ctypes.byref(schedule), int(awake_end), base_period, ok,
+                                       ctypes.byref(hint), rng.getrandbits(32))
+
+        sleep = args.sleep
+        if lib is not None:
+            sleep = lib.sync_schedule_sleep(ctypes.byref(schedule), int(awake_end), args.sleep)
+        heapq.heappush(wakes, (awake_end + sleep, device, boot_count + 1))
+
+    return server
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--devices', type=int, default=5000)
+    parser.add_argument('--hours', type=float, default=3)
+    parser.add_argument('--capacity', type=int, default=200, help='uploads the server serves at once')
+    parser.add_argument('--sleep', type=int, default=60, help='deep sleep between wakes, s')
+    parser.add_argument('--sync-every', type=int, default=10, help='FREQ_SYNC, wakes per sync')
+    parser.add_argument('--period', type=int, default=600, help='slot period assigned by the server, s')
+    parser.add_argument('--boot-jitter', type=float, default=2, help='spread of power-on times, s')
+    parser.add_argument('--min-upload', type=float, default=3, help='shortest connect and upload, s')
+    parser.add_argument('--max-upload', type=float, default=8, help='longest connect and upload, s')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    results = [('fixed cadence', simulate(args)), ('sync slots', simulate(args, build('sync_slot', ['sync_slot.c'])))]
+
+    print('%d devices, %g hours, server capacity %d' % (args.devices, args.hours, args.capacity))
+    print('%-14s %10s %10s %10s' % ('', 'peak conn', 'failed', 'synced'))
+    for name, server in results:
+        print('%-14s %10d %10d %10d' % (name, server.peak, server.failed, server.synced))
+
+
+if __name__ == '__main__':
+    main()
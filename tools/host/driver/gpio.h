@@ -0,0 +1,8 @@
+/* host build: the debug pin reads high, blog_flush() stays quiet */
+#define GPIO_MODE_INPUT 1
+#define GPIO_PULLUP_ONLY 0
+
+static inline void gpio_pad_select_gpio(int gpio) { (void)gpio; }
+static inline int gpio_set_direction(int gpio, int mode) { (void)gpio; (void)mode; return 0; }
+static inline int gpio_set_pull_mode(int gpio, int pull) { (void)gpio; (void)pull; return 0; }
+static inline int gpio_get_level(int gpio) { (void)gpio; return 1; }
@@ -0,0 +1,2 @@
+/* host build: there is no RTC memory, RTC data is plain data */
+#define RTC_DATA_ATTR
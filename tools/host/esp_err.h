@@ -0,0 +1,11 @@
+/* host build: the error codes storage.c checks */
+#ifndef ESP_ERR_H_
+#define ESP_ERR_H_
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NOT_FOUND 0x105
+
+#endif
@@ -0,0 +1,16 @@
+/* host build: errors and warnings go to stderr, the rest is dropped */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) do { } while (0)
+#define ESP_LOGD(tag, format, ...) do { } while (0)
+
+static inline uint32_t esp_log_timestamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,32 @@
+/* host build: STORAGE_BASE_PATH is a plain directory, mounting is a no-op */
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+typedef struct {
+    const char* base_path;
+    const char* partition_label;
+    size_t max_files;
+    bool format_if_mount_failed;
+} esp_vfs_spiffs_conf_t;
+
+static inline esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t* conf)
+{
+    (void)conf;
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_vfs_spiffs_unregister(const char* partition_label)
+{
+    (void)partition_label;
+    return ESP_OK;
+}
+
+static inline esp_err_t esp_spiffs_info(const char* partition_label, size_t* total, size_t* used)
+{
+    (void)partition_label;
+    *total = 0;
+    *used = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,9 @@
+/* host build: upload.c needs no RTOS. blog.c takes a spinlock, an
+   atomic flag like the one the ESP32 port spins on. */
+typedef struct {
+    volatile char locked;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+#define portENTER_CRITICAL(mux) while (__atomic_test_and_set(&(mux)->locked, __ATOMIC_ACQUIRE)) { }
+#define portEXIT_CRITICAL(mux) __atomic_clear(&(mux)->locked, __ATOMIC_RELEASE)
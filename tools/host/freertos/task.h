@@ -0,0 +1 @@
+/* host build: no RTOS needed by upload.c */
@@ -0,0 +1,15 @@
+/* Host port of the firmware modules that tools/loadgen.py and
+   tools/storage_test.py build as shared libraries. The headers next to
+   this file stand in for the ESP-IDF ones used by main/upload.c and
+   main/storage.c: lwip sockets map onto POSIX sockets, SPIFFS onto a
+   plain directory, errors go to stderr and the deferred log is dropped. */
+#include "blog.h"
+
+
+void blog_record(blog_level_t level, const char* tag, const char* format, int nargs, ...)
+{
+    (void)level;
+    (void)tag;
+    (void)format;
+    (void)nargs;
+}
@@ -0,0 +1 @@
+/* host build: lwip errors are not used by upload.c */
@@ -0,0 +1,2 @@
+/* host build: lwip DNS resolver is getaddrinfo() */
+#include <netdb.h>
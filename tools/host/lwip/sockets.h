@@ -0,0 +1,7 @@
+/* host build: lwip sockets are BSD sockets */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
@@ -0,0 +1 @@
+/* host build: nothing needed from lwip/sys.h */
@@ -0,0 +1,211 @@
+"""Builds firmware modules for the host and mirrors their structures.
+
+The modules in main/ that the tools in this directory drive through ctypes
+are compiled here with the host C compiler, next to the stand-ins for the
+ESP-IDF headers in tools/host, and with warnings treated as errors. The
+prototypes of each module are declared on the library it ends up in, and
+the structures it takes are mirrored below, so every tool sees the same
+layout of them.
+"""
+import ctypes
+import os
+import shutil
+import subprocess
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+CFLAGS = ['-shared', '-fPIC', '-O2', '-Wall', '-Wextra', '-Werror']
+
+DEVICE_ID_LEN = 16          # ESPNOW_DEVICE_ID_LEN
+MAX_PEERS = 64              # GATEWAY_MAX_PEERS
+BATCH_SIZE = 512            # GATEWAY_BATCH_SIZE
+MAX_READOUTS = 27           # ESPNOW_MAX_READOUTS
+FRAME_MAX_LEN = 250         # ESPNOW_FRAME_MAX_LEN
+
+
+# aggregate.h
+class AggregateWindow(ctypes.Structure):
+    _fields_ = [('start', ctypes.c_ulong), ('count', ctypes.c_int32), ('min', ctypes.c_int32),
+                ('max', ctypes.c_int32), ('sum', ctypes.c_int64), ('mean', ctypes.c_int64), ('m2', ctypes.c_int64)]
+
+
+class AggregateRecord(ctypes.Structure):
+    _fields_ = [('start', ctypes.c_ulong), ('count', ctypes.c_int), ('min', ctypes.c_int),
+                ('max', ctypes.c_int), ('mean', ctypes.c_int), ('variance', ctypes.c_int)]
+
+
+# espnow_proto.h
+class Sender(ctypes.Structure):
+    _fields_ = [('seq', ctypes.c_uint16), ('boot', ctypes.c_uint16), ('unacked', ctypes.c_uint8),
+                ('unacked_code', ctypes.c_char * 4)]
+
+
+class Readout(ctypes.Structure):
+    _fields_ = [('age', ctypes.c_uint32), ('value', ctypes.c_int32)]
+
+
+class Frame(ctypes.Structure):
+    _fields_ = [('type', ctypes.c_uint8), ('seq', ctypes.c_uint16), ('boot', ctypes.c_uint16),
+                ('device_id', ctypes.c_uint8 * DEVICE_ID_LEN), ('sensor_code', ctypes.c_char * 4),
+                ('count', ctypes.c_uint8), ('readouts', Readout * MAX_READOUTS)]
+
+
+class Peer(ctypes.Structure):
+    _fields_ = [('device_id', ctypes.c_uint8 * DEVICE_ID_LEN), ('last_seq', ctypes.c_uint16),
+                ('last_boot', ctypes.c_uint16), ('last_used', ctypes.c_uint32)]
+
+
+class GatewayReadout(ctypes.Structure):
+    _fields_ = [('device_id', ctypes.c_uint8 * DEVICE_ID_LEN), ('sensor_code', ctypes.c_char * 4),
+                ('timestamp', ctypes.c_int64), ('value', ctypes.c_int)]
+
+
+class Gateway(ctypes.Structure):
+    _fields_ = [('peers', Peer * MAX_PEERS), ('peer_count', ctypes.c_int), ('clock', ctypes.c_uint32),
+                ('readouts', GatewayReadout * BATCH_SIZE), ('readout_count', ctypes.c_int)]
+
+
+SEND = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t)
+WAIT_ACK = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_void_p, ctypes.c_uint16, ctypes.c_int)
+
+
+class Transport(ctypes.Structure):
+    _fields_ = [('send', SEND), ('wait_ack', WAIT_ACK), ('ctx', ctypes.c_void_p)]
+
+
+# phase_budget.h
+CLOCK = ctypes.CFUNCTYPE(ctypes.c_int64)
+
+
+class Budget(ctypes.Structure):
+    _fields_ = [('now_ms', CLOCK), ('phase_budgets_ms', ctypes.POINTER(ctypes.c_int)),
+                ('total_budget_ms', ctypes.c_int), ('wake_start_ms', ctypes.c_int64),
+                ('phase_start_ms', ctypes.c_int64), ('phase', ctypes.c_int),
+                ('overruns', ctypes.POINTER(ctypes.c_uint32))]
+
+
+# power_policy.h
+class Profile(ctypes.Structure):
+    _fields_ = [('level', ctypes.c_int), ('sleep_delay', ctypes.c_int), ('sync_every', ctypes.c_int)]
+
+
+# remote_config.h
+class Config(ctypes.Structure):
+    _fields_ = [('version', ctypes.c_uint32), ('temp', ctypes.c_int), ('soil', ctypes.c_int),
+                ('light', ctypes.c_int), ('sleep', ctypes.c_int), ('sync', ctypes.c_int),
+                ('ssid', ctypes.c_char * 33), ('password', ctypes.c_char * 65),
+                ('host', ctypes.c_char * 64), ('port', ctypes.c_char * 6)]
+
+
+# storage.h
+class Range(ctypes.Structure):
+    _fields_ = [('f', ctypes.c_void_p), ('t0', ctypes.c_ulong), ('t1', ctypes.c_ulong),
+                ('offset', ctypes.c_long), ('line_offset', ctypes.c_long)]
+
+
+# sync_slot.h
+class Hint(ctypes.Structure):
+    _fields_ = [('period', ctypes.c_uint32), ('offset', ctypes.c_uint32), ('retry_after', ctypes.c_uint32)]
+
+
+class Schedule(ctypes.Structure):
+    _fields_ = [('period', ctypes.c_uint32), ('offset', ctypes.c_uint32),
+                ('next_sync', ctypes.c_uint32), ('failures', ctypes.c_uint32)]
+
+
+def p(struct):
+    return ctypes.POINTER(struct)
+
+
+u32 = ctypes.c_uint32
+time_p = ctypes.POINTER(ctypes.c_int64)
+
+# (argtypes, restype) of the functions each module exports
+PROTOTYPES = {
+    'aggregate.c': {
+        'aggregate_reset': ([p(AggregateWindow), ctypes.c_ulong], None),
+        'aggregate_add': ([p(AggregateWindow), ctypes.c_int32], None),
+        'aggregate_due': ([p(AggregateWindow), ctypes.c_ulong, ctypes.c_ulong], ctypes.c_int),
+        'aggregate_close': ([p(AggregateWindow), p(AggregateRecord)], None),
+    },
+    'delta_patch.c': {
+        'delta_crc32': ([ctypes.c_uint32, ctypes.c_char_p, ctypes.c_size_t], ctypes.c_uint32),
+    },
+    'espnow_proto.c': {
+        'espnow_decode_frame': ([ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t, p(Frame)], ctypes.c_int),
+        'espnow_send_readouts': ([p(Transport), ctypes.POINTER(ctypes.c_uint8), p(Sender), ctypes.c_char_p,
+                                  p(Readout), ctypes.c_int], ctypes.c_int),
+        'espnow_gateway_init': ([p(Gateway)], None),
+        'espnow_gateway_accept': ([p(Gateway), p(Frame), ctypes.c_int64], ctypes.c_int),
+    },
+    'phase_budget.c': {
+        'phase_budget_start': ([p(Budget), CLOCK, ctypes.POINTER(ctypes.c_int), ctypes.c_int,
+                                ctypes.POINTER(ctypes.c_uint32)], None),
+        'phase_budget_begin': ([p(Budget), ctypes.c_int], None),
+        'phase_budget_remaining_ms': ([p(Budget)], ctypes.c_int),
+        'phase_budget_end': ([p(Budget)], ctypes.c_int),
+    },
+    'power_policy.c': {
+        'power_policy_level': ([ctypes.c_int, ctypes.c_int], ctypes.c_int),
+        'power_policy_profile': ([ctypes.c_int, ctypes.c_int, ctypes.c_int, p(Profile)], None),
+    },
+    'remote_config.c': {
+        'remote_config_parse': ([ctypes.c_char_p, p(Config), p(Config)], ctypes.c_int),
+    },
+    'storage.c': {
+        'dump_readout': ([ctypes.c_char_p, ctypes.c_ulong, ctypes.c_int], None),
+        'read_range': ([ctypes.c_char_p, ctypes.c_ulong, ctypes.c_ulong, p(Range)], ctypes.c_int),
+        'read_range_next': ([p(Range), ctypes.POINTER(ctypes.c_ulong), ctypes.POINTER(ctypes.c_int)],
+                            ctypes.c_int),
+        'read_range_close': ([p(Range)], None),
+        'flush_readouts': ([ctypes.c_char_p], None),
+        'prune_readouts': ([ctypes.c_char_p, ctypes.c_ulong], None),
+        'expire_readouts': ([ctypes.c_char_p, ctypes.c_ulong], None),
+        'get_aggregates_count': ([ctypes.c_char_p], ctypes.c_int),
+        'get_aggregates': ([ctypes.c_char_p, p(AggregateRecord), ctypes.c_int], ctypes.c_int),
+    },
+    'sync_slot.c': {
+        'sync_schedule_reset': ([p(Schedule), u32, u32, u32], None),
+        'sync_schedule_due': ([p(Schedule), u32], ctypes.c_int),
+        'sync_schedule_done': ([p(Schedule), u32, u32, ctypes.c_int, p(Hint), u32], None),
+        'sync_schedule_sleep': ([p(Schedule), u32, u32], u32),
+    },
+    'upload.c': {
+        'build_readouts_body': ([ctypes.c_char_p, time_p, ctypes.POINTER(ctypes.c_int), ctypes.c_int],
+                                ctypes.c_void_p),
+        'build_aggregates_body': ([ctypes.c_char_p, time_p, p(AggregateRecord), ctypes.c_int, ctypes.c_int],
+                                  ctypes.c_void_p),
+        'build_request': ([ctypes.c_char_p, ctypes.c_char_p, ctypes.c_void_p], ctypes.c_void_p),
+        'http_post': ([ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_int], ctypes.c_int),
+    },
+}
+
+
+def build(name, modules=(), defines=(), source=None, host=False):
+    """Compiles main/<modules> and the optional C source into lib<name>.so and loads it.
+
+    defines are passed on as -D flags; host links in tools/host/host_port.c
+    for the modules that log, take sockets or mount SPIFFS.
+    """
+    workdir = tempfile.mkdtemp()
+    library = os.path.join(workdir, 'lib%s.so' % name)
+    sources = [os.path.join(ROOT, 'main', module) for module in modules]
+    if host:
+        sources.append(os.path.join(ROOT, 'tools', 'host', 'host_port.c'))
+    try:
+        if source is not None:
+            sources.append(os.path.join(workdir, '%s.c' % name))
+            with open(sources[-1], 'w') as f:
+                f.write(source)
+        subprocess.check_call([os.environ.get('CC', 'cc')] + CFLAGS +
+                              ['-I', os.path.join(ROOT, 'tools', 'host'), '-I', os.path.join(ROOT, 'main')] +
+                              ['-D%s' % define for define in defines] + ['-o', library] + sources)
+        lib = ctypes.CDLL(library)
+    finally:
+        shutil.rmtree(workdir)
+
+    for module in modules:
+        for function, (argtypes, restype) in PROTOTYPES.get(module, {}).items():
+            getattr(lib, function).argtypes = argtypes
+            getattr(lib, function).restype = restype
+    return lib
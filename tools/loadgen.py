@@ -0,0 +1,251 @@
+#!/usr/bin/env python
+"""Fleet load generator and ingestion benchmark for the upload API.
+
+Usage: loadgen.py [--devices 2000] [--server HOST --port PORT] [--format readouts,aggregates]
+
+Simulates --devices devices syncing their backlog, each as the firmware
+does it: readouts are serialized and posted by the firmware's own
+main/upload.c (and aggregated by main/aggregate.c), compiled on the fly
+for the host together with the stand-in headers in tools/host/. Without
+--server the uploads go to the bundled mock (tools/sync_server.py).
+
+Most devices have the backlog of one sync interval, --offline-rate of
+them were offline for up to --offline-hours and post many chunks. Start
+times are spread over --spread seconds and --failure-rate of the
+requests lose the link, the device then retries the rest of its backlog
+after --retry-delay seconds. For each payload format prints throughput,
+request latency percentiles and body bytes per reading.
+"""
+import argparse
+import ctypes
+import os
+import random
+import sys
+import threading
+import time
+import uuid
+from concurrent.futures import ThreadPoolExecutor
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from sync_server import SyncServer  # noqa: E402
+from hostlib import AggregateRecord, AggregateWindow, build  # noqa: E402
+
+WAKE_INTERVAL = 10          # DEEP_SLEEP_DELAY, s between readouts
+UPLOAD_CHUNK = 128          # readouts per request, as in app_main
+AGGREGATE_WINDOW = 600      # BURATINO_AGGREGATE_WINDOW default, s
+RESPONSE_LEN = 256
+SENSORS = [                 # code, read frequency in wakes, typical value, step of the random walk
+    (b'TMP', 1, 2150, 6),
+    (b'FER', 2, 1800, 20),
+    (b'LUM', 1, 400, 50),
+]
+
+
+def load_firmware(server, port):
+    return build('upload', ['upload.c', 'aggregate.c'], ['WEB_SERVER="%s"' % server, 'WEB_PORT="%d"' % port],
+                 host=True)
+
+
+class Stats(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.requests = 0
+        self.failed = 0
+        self.dropped = 0
+        self.readings = 0
+        self.body_bytes = 0
+
+    def add(self, latency, ok, readings, body_bytes):
+        with self.lock:
+            self.requests += 1
+            self.latencies.append(latency)
+            if ok:
+                self.readings += readings
+                self.body_bytes += body_bytes
+            else:
+                self.failed += 1
+
+    def drop(self):
+        with self.lock:
+            self.dropped += 1
+
+
+class Device(object):
+    """Backlog of one device, values random walk around typical readings"""
+
+    def __init__(self, rng, args, now):
+        self.id = str(uuid.UUID(int=rng.getrandbits(128))).encode()
+        if rng.random() < args.offline_rate:
+            backlog_s = int(rng.uniform(args.sync_interval, args.offline_hours * 3600))
+        else:
+            backlog_s = args.sync_interval
+        wakes = int(backlog_s // WAKE_INTERVAL)
+
+        self.readouts = []
+        for code, frequency, typical, step in SENSORS:
+            value = typical + rng.randint(-10 * step, 10 * step)
+            times, values = [], []
+            for wake in range(0, wakes, frequency):
+                value += rng.randint(-step, step)
+                times.append(now - backlog_s + wake * WAKE_INTERVAL)
+                values.append(value)
+            self.readouts.append((code, times, values))
+
+
+class Uploader(object):
+    def __init__(self, lib, args):
+        self.lib = lib
+        self.args = args
+        self.free = ctypes.CDLL(None).free
+        self.free.argtypes = [ctypes.c_void_p]
+
+    def post(self, device_id, resource, body, readings, stats):
+        request = self.lib.build_request(device_id, resource, body)
+        response = ctypes.create_string_buffer(RESPONSE_LEN)
+        body_bytes = len(ctypes.string_at(body))
+
+        start = time.time()
+        status = self.lib.http_post(request, response, RESPONSE_LEN, self.args.timeout)
+        stats.add(time.time() - start, 200 <= status < 300, readings, body_bytes)
+
+        self.free(request)
+        self.free(body)
+        return 200 <= status < 300
+
+    def readouts(self, device, code, times, values, rng, stats):
+        """Posts in chunks like upload_readouts(), returns how many made it"""
+        sent = 0
+        while sent < len(times):
+            if rng.random() < self.args.failure_rate:
+                stats.drop()
+                return sent
+            chunk = min(UPLOAD_CHUNK, len(times) - sent)
+            body = self.lib.build_readouts_body(code, (ctypes.c_int64 * chunk)(*times[sent:sent + chunk]),
+                                                (ctypes.c_int * chunk)(*values[sent:sent + chunk]), chunk)
+            if not self.post(device.id, b'readouts', body, chunk, stats):
+                return sent
+            sent += chunk
+        return sent
+
+    def aggregates(self, device, code, times, values, rng, stats):
+        """Aggregates per window with the firmware code, posts in one request
+        like upload_aggregates()"""
+        if not times:
+            return 0
+        if rng.random() < self.args.failure_rate:
+            stats.drop()
+            return 0
+
+        window = AggregateWindow()
+        records, starts = [], []
+        for t, value in zip(times, values):
+            if window.count and t - window.start >= AGGREGATE_WINDOW:
+                records.append(AggregateRecord())
+                self.lib.aggregate_close(ctypes.byref(window), ctypes.byref(records[-1]))
+                starts.append(window.start)
+                window.count = 0
+            if window.count == 0:
+                self.lib.aggregate_reset(ctypes.byref(window), t)
+            self.lib.aggregate_add(ctypes.byref(window), value)
+        records.append(AggregateRecord())
+        self.lib.aggregate_close(ctypes.byref(window), ctypes.byref(records[-1]))
+        starts.append(window.start)
+
+        count = len(records)
+        body = self.lib.build_aggregates_body(code, (ctypes.c_int64 * count)(*starts),
+                                              (AggregateRecord * count)(*records), count, AGGREGATE_WINDOW)
+        return len(times) if self.post(device.id, b'aggregates', body, len(times), stats) else 0
+
+    def sync(self, device, payload, start, seed, stats):
+        rng = random.Random(seed)
+        time.sleep(max(0, start - time.time()))
+        upload = self.readouts if payload == 'readouts' else self.aggregates
+        pending = device.readouts
+
+        for attempt in range(self.args.retries + 1):
+            if attempt > 0:
+                time.sleep(self.args.retry_delay * rng.uniform(0.5, 1.5))
+            remaining = []
+            for code, times, values in pending:
+                sent = upload(device, code, times, values, rng, stats)
+                if sent < len(times):
+                    remaining.append((code, times[sent:], values[sent:]))
+            if not remaining:
+                return
+            pending = remaining
+
+
+def percentile(values, fraction):
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def run(lib, devices, payload, args):
+    stats = Stats()
+    uploader = Uploader(lib, args)
+    rng = random.Random(args.seed)
+
+    start = time.time()
+    starts = sorted(start + rng.uniform(0, args.spread) for _ in devices)
+    with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        syncs = [pool.submit(uploader.sync, device, payload, device_start, rng.getrandbits(32), stats)
+                 for device, device_start in zip(devices, starts)]
+        for sync in syncs:
+            sync.result()
+    elapsed = time.time() - start
+
+    latencies = sorted(stats.latencies)
+    return [
+        payload, stats.requests, stats.failed, stats.dropped, stats.requests / elapsed, stats.readings / elapsed,
+        1000 * percentile(latencies, 0.5), 1000 * percentile(latencies, 0.9),
+        1000 * percentile(latencies, 0.99), 1000 * (latencies[-1] if latencies else 0),
+        float(stats.body_bytes) / stats.readings if stats.readings else 0,
+    ]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--devices', type=int, default=2000)
+    parser.add_argument('--server', help='host of the endpoint, the bundled mock if omitted')
+    parser.add_argument('--port', type=int, default=80)
+    parser.add_argument('--format', default='readouts,aggregates', help='payload formats to benchmark')
+    parser.add_argument('--concurrency', type=int, default=64, help='devices syncing at once')
+    parser.add_argument('--spread', type=float, default=5, help='spread of device start times, s')
+    parser.add_argument('--sync-interval', type=int, default=600, help='backlog of a regular device, s')
+    parser.add_argument('--offline-rate', type=float, default=0.05, help='share of devices back from an outage')
+    parser.add_argument('--offline-hours', type=float, default=24, help='longest outage')
+    parser.add_argument('--failure-rate', type=float, default=0.02, help='share of requests losing the link')
+    parser.add_argument('--retries', type=int, default=2)
+    parser.add_argument('--retry-delay', type=float, default=1, help='s')
+    parser.add_argument('--timeout', type=int, default=5000, help='socket timeout of http_post, ms')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    mock = None
+    server, port = args.server, args.port
+    if server is None:
+        mock = SyncServer(('127.0.0.1', 0), 600, capacity=1 << 30)
+        threading.Thread(target=mock.serve_forever, daemon=True).start()
+        server, port = '127.0.0.1', mock.server_address[1]
+
+    lib = load_firmware(server, port)
+    rng = random.Random(args.seed)
+    now = int(time.time())
+    devices = [Device(rng, args, now) for _ in range(args.devices)]
+    readings = sum(len(times) for device in devices for _, times, _ in device.readouts)
+
+    print('%d devices, %d readings against %s:%d%s' % (
+        args.devices, readings, server, port, ' (bundled mock)' if mock else ''))
+    print('%-10s %8s %7s %7s %8s %10s %8s %8s %8s %8s %9s' % (
+        'format', 'requests', 'failed', 'dropped', 'req/s', 'reading/s', 'p50 ms', 'p90 ms', 'p99 ms', 'max ms', 'B/reading'))
+    for payload in args.format.split(','):
+        print('%-10s %8d %7d %7d %8.1f %10.1f %8.1f %8.1f %8.1f %8.1f %9.2f' % tuple(run(lib, devices, payload, args)))
+
+    if mock:
+        mock.shutdown()
+
+
+if __name__ == '__main__':
+    main()
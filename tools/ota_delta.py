@@ -0,0 +1,154 @@
+#!/usr/bin/env python
+"""Makes and applies compressed delta patches for over-the-air updates.
+
+Usage: ota_delta.py diff old.bin new.bin patch.bin
+       ota_delta.py apply old.bin patch.bin new.bin
+
+'diff' writes a zlib compressed patch that turns old.bin (the firmware
+the device runs) into new.bin; the server answers the device's
+firmware?from=<version> request with it. 'apply' is the reference
+implementation of main/delta_patch.c and checks a patch before it ships.
+
+The patch format is described in main/delta_patch.h: records of bytes
+added to the old image (small differences such as shifted addresses
+leave mostly zeros, which compress well) and literal new bytes.
+"""
+import struct
+import sys
+import zlib
+
+MAGIC = b'BDLT'
+HEADER = struct.Struct('<4sIIII')
+CONTROL = struct.Struct('<IIi')
+BLOCK = 16              # length of exact matches used to find candidate regions
+GIVE_UP = 64            # mismatch excess after which a match is not extended further
+
+
+def crc32(data):
+    return zlib.crc32(data) & 0xFFFFFFFF
+
+
+def index_blocks(old):
+    index = {}
+    for i in range(len(old) - BLOCK + 1):
+        index.setdefault(old[i:i + BLOCK], i)
+    return index
+
+
+def extend(old, old_pos, new, new_pos):
+    """Length of the approximate match starting at the given positions,
+    maximizing matching minus differing bytes as bsdiff does"""
+    score = best = length = 0
+    limit = min(len(old) - old_pos, len(new) - new_pos)
+    for k in range(limit):
+        score += 1 if old[old_pos + k] == new[new_pos + k] else -1
+        if score > best:
+            best, length = score, k + 1
+        elif score < best - GIVE_UP:
+            break
+    return length
+
+
+def find_matches(old, new):
+    """Non-overlapping (new_pos, old_pos, length) regions in new order"""
+    index = index_blocks(old)
+    matches = []
+    covered = 0
+    i = 0
+
+    while i + BLOCK <= len(new):
+        # keep following the old image where the last match ended
+        j = None
+        if matches:
+            last_new, last_old, last_len = matches[-1]
+            expected = last_old + last_len + (i - last_new - last_len)
+            if expected + BLOCK <= len(old) and old[expected:expected + BLOCK] == new[i:i + BLOCK]:
+                j = expected
+        if j is None:
+            j = index.get(new[i:i + BLOCK])
+        if j is None:
+            i += 1
+            continue
+
+        while i > covered and j > 0 and new[i - 1] == old[j - 1]:
+            i -= 1
+            j -= 1
+
+        length = extend(old, j, new, i)
+        matches.append((i, j, length))
+        i += length
+        covered = i
+
+    return matches
+
+
+def diff(old, new):
+    out = [HEADER.pack(MAGIC, len(old), crc32(old), len(new), crc32(new))]
+    matches = find_matches(old, new)
+
+    # a leading record carries the literal bytes before the first match
+    first_new, first_old = matches[0][:2] if matches else (len(new), 0)
+    out.append(CONTROL.pack(0, first_new, first_old))
+    out.append(new[:first_new])
+
+    for k, (new_pos, old_pos, length) in enumerate(matches):
+        next_new, next_old = matches[k + 1][:2] if k + 1 < len(matches) else (len(new), old_pos + length)
+        extra = new[new_pos + length:next_new]
+        delta = bytes(bytearray((n - o) & 0xFF for n, o in zip(new[new_pos:new_pos + length],
+                                                              old[old_pos:old_pos + length])))
+        out.append(CONTROL.pack(length, len(extra), next_old - old_pos - length))
+        out.append(delta)
+        out.append(extra)
+
+    return zlib.compress(b''.join(out), 9)
+
+
+def apply(old, patch):
+    data = zlib.decompress(patch)
+    magic, old_size, old_crc, new_size, new_crc = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError('not a delta patch')
+    if old_size != len(old) or old_crc != crc32(old):
+        raise ValueError('patch is for a different old image')
+
+    new = bytearray()
+    pos = HEADER.size
+    old_pos = 0
+    while pos < len(data):
+        diff_len, extra_len, seek = CONTROL.unpack_from(data, pos)
+        pos += CONTROL.size
+        if old_pos + diff_len > len(old) or len(new) + diff_len + extra_len > new_size:
+            raise ValueError('corrupted patch')
+        new.extend((o + d) & 0xFF for o, d in zip(old[old_pos:old_pos + diff_len],
+                                                  bytearray(data[pos:pos + diff_len])))
+        pos += diff_len
+        new.extend(data[pos:pos + extra_len])
+        pos += extra_len
+        old_pos += diff_len + seek
+
+    if len(new) != new_size or crc32(bytes(new)) != new_crc:
+        raise ValueError('patched image does not match')
+    return bytes(new)
+
+
+def main():
+    if len(sys.argv) != 5 or sys.argv[1] not in ('diff', 'apply'):
+        sys.exit(__doc__)
+
+    with open(sys.argv[2], 'rb') as f:
+        old = f.read()
+    with open(sys.argv[3], 'rb') as f:
+        second = f.read()
+
+    if sys.argv[1] == 'diff':
+        result = diff(old, second)
+        sys.stderr.write('%d -> %d bytes, patch %d bytes\n' % (len(old), len(second), len(result)))
+    else:
+        result = apply(old, second)
+
+    with open(sys.argv[4], 'wb') as f:
+        f.write(result)
+
+
+if __name__ == '__main__':
+    main()
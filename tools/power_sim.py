@@ -0,0 +1,113 @@
+#!/usr/bin/env python
+"""Replays a battery discharge through the firmware's power policy.
+
+Usage: power_sim.py [--capacity 2000] [--sleep 10] [--sync 1] [--curve measured.csv]
+
+Drains a --capacity mAh cell wake by wake until it browns out. Every wake
+reads the battery voltage and picks its sleep and sync intervals with
+power_policy_level() and power_policy_profile() (main/power_policy.c,
+compiled on the fly with the host C compiler), starting from --sleep and
+--sync as DEEP_SLEEP_DELAY and FREQ_SYNC do. The voltage comes from the
+open circuit curve of a Li-ion cell, or from --curve, a CSV file of
+"percent charge,mV" rows such as a measured discharge, less the sag of
+the awake current over the cell's internal resistance, plus --noise mV of
+ADC noise (what is left after read_battery_voltage() averages its reads).
+
+The same cell is run again with the policy held at POWER_LEVEL_NORMAL, as
+the firmware behaved before the governor. For both runs prints days until
+brownout, wakes, syncs and level changes, and the hours spent on each
+level by the governor. Exits non-zero if the governor does not outlast
+the fixed run or its level flaps (changes more than twice per level).
+"""
+import argparse
+import csv
+import ctypes
+import random
+import sys
+
+from hostlib import Profile, build
+
+LEVELS = ['NORMAL', 'SAVING', 'LOW', 'CRITICAL']
+LI_ION = [(100, 4200), (90, 4060), (80, 3980), (70, 3920), (60, 3870), (50, 3830),
+          (40, 3790), (30, 3750), (20, 3700), (10, 3600), (5, 3450), (0, 3000)]
+BROWNOUT_MV = 3300          # LDO drops out under the radio current below this
+
+
+def read_curve(path):
+    with open(path) as f:
+        points = [(float(row[0]), float(row[1])) for row in csv.reader(f) if row and row[0][0].isdigit()]
+    return sorted(points, reverse=True)
+
+
+def open_circuit_mv(curve, percent):
+    for (p1, mv1), (p2, mv2) in zip(curve, curve[1:]):
+        if p2 <= percent <= p1:
+            return mv2 + (mv1 - mv2) * (percent - p2) / (p1 - p2)
+    return curve[-1][1]
+
+
+def simulate(lib, args, curve, governed):
+    rng = random.Random(args.seed)
+    profile = Profile()
+    level = 0
+    charge = args.capacity * 3600.0       # mAs left
+    seconds = wakes = syncs = changes = 0
+    hours = [0.0] * len(LEVELS)
+
+    while True:
+        percent = 100.0 * charge / (args.capacity * 3600.0)
+        ocv = open_circuit_mv(curve, percent)
+        if ocv - args.sync_ma * args.resistance < BROWNOUT_MV:
+            break
+
+        measured = int(ocv - args.awake_ma * args.resistance + rng.gauss(0, args.noise))
+        previous = level
+        level = lib.power_policy_level(measured, level) if governed else 0
+        changes += level != previous
+        lib.power_policy_profile(level, args.sleep, args.sync, ctypes.byref(profile))
+
+        wakes += 1
+        sync = profile.sync_every > 0 and wakes % profile.sync_every == 0
+        syncs += sync
+        awake = args.sync_s if sync else args.awake_s
+        used = (args.sync_ma if sync else args.awake_ma) * awake + args.sleep_ua / 1000.0 * profile.sleep_delay
+        charge -= used
+        seconds += awake + profile.sleep_delay
+        hours[level] += (awake + profile.sleep_delay) / 3600.0
+
+    return seconds / 86400.0, wakes, syncs, changes, hours
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--capacity', type=float, default=2000, help='mAh')
+    parser.add_argument('--sleep', type=int, default=10, help='base deep sleep, seconds')
+    parser.add_argument('--sync', type=int, default=1, help='base wakes per sync')
+    parser.add_argument('--curve', help='CSV of percent charge,mV')
+    parser.add_argument('--awake-ma', type=float, default=40, help='current of a wake without sync')
+    parser.add_argument('--awake-s', type=float, default=0.3)
+    parser.add_argument('--sync-ma', type=float, default=120, help='current of a wake with sync')
+    parser.add_argument('--sync-s', type=float, default=3.0)
+    parser.add_argument('--sleep-ua', type=float, default=10, help='deep sleep current')
+    parser.add_argument('--resistance', type=float, default=0.15, help='internal resistance, ohm')
+    parser.add_argument('--noise', type=float, default=10, help='ADC noise of the averaged read, mV standard deviation')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib = build('power_policy', ['power_policy.c'])
+    curve = read_curve(args.curve) if args.curve else LI_ION
+    results = [('governor', simulate(lib, args, curve, True)), ('fixed', simulate(lib, args, curve, False))]
+
+    print('%g mAh, sleep %d s, sync every %d wakes, noise %g mV' % (args.capacity, args.sleep, args.sync, args.noise))
+    print('%-10s %8s %10s %10s %8s' % ('', 'days', 'wakes', 'syncs', 'changes'))
+    for name, (days, wakes, syncs, changes, _) in results:
+        print('%-10s %8.1f %10d %10d %8d' % (name, days, wakes, syncs, changes))
+    print('hours per level: ' + ', '.join('%s %.0f' % (name, h) for name, h in zip(LEVELS, results[0][1][4])))
+
+    governor, fixed = results[0][1], results[1][1]
+    if governor[0] <= fixed[0] or governor[3] > 2 * (len(LEVELS) - 1):
+        sys.exit('governor does not outlast the fixed schedule or its level flaps')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python
+"""Checks which config deltas the firmware accepts and what it makes of them.
+
+Usage: remote_config_test.py
+
+Builds main/remote_config.c with the host C compiler and runs
+remote_config_parse() through ctypes over upload responses that must be
+accepted, with the settings they must leave behind, and over malformed,
+out of range, duplicate and stale ones that must be turned down as a
+whole. Unknown keys carry nested objects and arrays, which must be
+skipped when they are well formed and rejected when a ',' or ':' is
+missing or extra, or when they nest too deep. Their numbers may be of
+any size, sign, fraction or exponent, but must follow the JSON grammar. Exits non-zero on the
+first response the firmware gets wrong.
+"""
+import argparse
+import ctypes
+import sys
+
+from hostlib import Config, build
+
+SKIP_DEPTH = 8              # SKIP_DEPTH in remote_config.c
+
+NONE, UPDATED, STALE, INVALID = 0, 1, -1, -2
+STATUS_NAMES = {NONE: 'NONE', UPDATED: 'UPDATED', STALE: 'STALE', INVALID: 'INVALID'}
+
+
+def stored():
+    """The config a device has from an earlier sync"""
+    return Config(version=5, temp=2, sleep=60, ssid=b'home', password=b'secret123',
+                  host=b'10.0.0.2', port=b'8080')
+
+
+def nested(depth):
+    return '[' * depth + '1' + ']' * depth
+
+
+def response(config):
+    return '{"slot": 120, "config": %s}' % config
+
+
+# responses that must be taken, and the settings they must leave behind
+ACCEPTED = [
+    ('version only', '{"v": 6}', {}),
+    ('all keys', '{"v": 7, "temp": 1, "soil": 3, "light": 4, "sleep": 10, "sync": 2, "ssid": "lab",'
+     ' "pass": "password", "url": "http://sync.example.com:9000"}',
+     {'version': 7, 'temp': 1, 'soil': 3, 'light': 4, 'sleep': 10, 'sync': 2, 'ssid': b'lab',
+      'password': b'password', 'host': b'sync.example.com', 'port': b'9000'}),
+    ('nulls restore defaults', '{"v": 6, "temp": null, "sleep": null, "ssid": null, "url": null}',
+     {'temp': 0, 'sleep': 0, 'ssid': b'', 'host': b'', 'port': b''}),
+    ('open network', '{"v": 6, "pass": ""}', {'password': b''}),
+    ('default port', '{"v": 6, "url": "http://192.168.1.10"}', {'host': b'192.168.1.10', 'port': b'80'}),
+    ('escaped ssid', r'{"v": 6, "ssid": "a\"b\\c"}', {'ssid': b'a"b\\c'}),
+    ('whitespace', '{\n\t"v" : 6 ,\r\n "sync":3\n}', {'sync': 3}),
+    ('unknown scalars', '{"x": -12, "y": true, "z": false, "w": null, "s": "long \\" string", "v": 6}',
+     {}),
+    ('unknown array', '{"x": [1, 2, 3], "v": 6}', {}),
+    ('unknown object', '{"x": {"a": "b", "c": [true, false, null]}, "v": 6}', {}),
+    ('unknown empties', '{"x": [], "y": {}, "z": [{}, []], "v": 6}', {}),
+    ('unknown nesting', '{"x": %s, "v": 6}' % nested(SKIP_DEPTH), {}),
+    ('unknown key named like a known one', '{"x": {"v": 99, "temp": 0}, "v": 6}', {}),
+    ('long unknown key', '{"v": 6, "aggregate_window_s": 600}', {}),
+    ('unknown fraction', '{"v": 6, "x": -0.5}', {}),
+    ('unknown large number', '{"v": 6, "x": 12345678901}', {}),
+    ('unknown exponents', '{"v": 6, "x": [1e-3, 2.5E+10, -0, 0.0e0]}', {}),
+]
+
+# responses that must be turned down as a whole
+REJECTED = [
+    ('array without commas', '{"x": [1 2 3], "v": 6}', INVALID),
+    ('object without colon', '{"x": {"a" "b"}, "v": 6}', INVALID),
+    ('object without comma', '{"x": {"a": 1 "b": 2}, "v": 6}', INVALID),
+    ('object key not a string', '{"x": {1: 2}, "v": 6}', INVALID),
+    ('object key without value', '{"x": {"a"}, "v": 6}', INVALID),
+    ('colon in array', '{"x": ["a": 1], "v": 6}', INVALID),
+    ('trailing comma in array', '{"x": [1, ], "v": 6}', INVALID),
+    ('trailing comma in object', '{"x": {"a": 1, }, "v": 6}', INVALID),
+    ('leading comma in array', '{"x": [, 1], "v": 6}', INVALID),
+    ('mismatched brackets', '{"x": [1, 2}, "v": 6}', INVALID),
+    ('unclosed array', '{"v": 6, "x": [1, 2', INVALID),
+    ('nesting too deep', '{"x": %s, "v": 6}' % nested(SKIP_DEPTH + 1), INVALID),
+    ('unterminated string', '{"v": 6, "x": "abc', INVALID),
+    ('bare word', '{"x": yes, "v": 6}', INVALID),
+    ('leading zero', '{"x": 01, "v": 6}', INVALID),
+    ('fraction without digits', '{"x": 1., "v": 6}', INVALID),
+    ('fraction without integer', '{"x": .5, "v": 6}', INVALID),
+    ('exponent without digits', '{"x": 1e, "v": 6}', INVALID),
+    ('lone minus', '{"x": -, "v": 6}', INVALID),
+    ('plus sign', '{"x": +1, "v": 6}', INVALID),
+    ('trailing comma', '{"v": 6, }', INVALID),
+    ('missing comma', '{"v": 6 "temp": 1}', INVALID),
+    ('missing version', '{"temp": 1}', INVALID),
+    ('version zero', '{"v": 0}', INVALID),
+    ('duplicate key', '{"v": 6, "temp": 1, "temp": 2}', INVALID),
+    ('frequency zero', '{"v": 6, "temp": 0}', INVALID),
+    ('frequency too high', '{"v": 6, "sync": 1001}', INVALID),
+    ('sleep too short', '{"v": 6, "sleep": 4}', INVALID),
+    ('sleep too long', '{"v": 6, "sleep": 86401}', INVALID),
+    ('negative frequency', '{"v": 6, "temp": -1}', INVALID),
+    ('fraction', '{"v": 6, "temp": 1.5}', INVALID),
+    ('exponent', '{"v": 6, "sleep": 1e2}', INVALID),
+    ('version overflow', '{"v": 4294967296}', INVALID),
+    ('number as string', '{"v": 6, "temp": "1"}', INVALID),
+    ('short password', '{"v": 6, "pass": "1234567"}', INVALID),
+    ('empty ssid', '{"v": 6, "ssid": ""}', INVALID),
+    ('long ssid', '{"v": 6, "ssid": "%s"}' % ('s' * 33), INVALID),
+    ('unknown escape', r'{"v": 6, "ssid": "a\qb"}', INVALID),
+    ('https url', '{"v": 6, "url": "https://host"}', INVALID),
+    ('port out of range', '{"v": 6, "url": "http://host:65536"}', INVALID),
+    ('url with path', '{"v": 6, "url": "http://host/api"}', INVALID),
+    ('same version', '{"v": 5, "temp": 1}', STALE),
+    ('older version', '{"v": 4}', STALE),
+]
+
+
+def parse(lib, config):
+    current = stored()
+    updated = Config()
+    status = lib.remote_config_parse(response(config).encode(), ctypes.byref(current), ctypes.byref(updated))
+    return status, updated
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.parse_args()
+
+    lib = build('remote_config', ['remote_config.c'])
+
+    for name, config, expected in ACCEPTED:
+        status, updated = parse(lib, config)
+        if status != UPDATED:
+            sys.exit('%s: %s, expected UPDATED\n  %s' % (name, STATUS_NAMES[status], config))
+        settings = dict((field, getattr(stored(), field)) for field, _ in Config._fields_)
+        settings['version'] = 6
+        settings.update(expected)
+        wrong = ['%s %r, expected %r' % (field, getattr(updated, field), value)
+                 for field, value in sorted(settings.items()) if getattr(updated, field) != value]
+        if wrong:
+            sys.exit('%s: %s\n  %s' % (name, ', '.join(wrong), config))
+
+    for name, config, expected in REJECTED:
+        status, _ = parse(lib, config)
+        if status != expected:
+            sys.exit('%s: %s, expected %s\n  %s' % (name, STATUS_NAMES[status], STATUS_NAMES[expected], config))
+
+    current, updated = stored(), Config()
+    if lib.remote_config_parse(b'{"slot": 120}', ctypes.byref(current), ctypes.byref(updated)) != NONE:
+        sys.exit('response without config: expected NONE')
+
+    print('%d deltas accepted, %d turned down' % (len(ACCEPTED), len(REJECTED)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,195 @@
+#!/usr/bin/env python
+"""Injects stalls into simulated wakes to exercise the supervisor's budgets.
+
+Usage: stall_sim.py [--wakes 5000] [--stall 0.05] [--hang 0.01]
+
+Replays wakes through the deadline bookkeeping of the wake-cycle
+supervisor (main/phase_budget.c, compiled on the fly with the host C
+compiler) on a simulated clock, with the phase and total budgets read
+from main/supervisor.c. Each phase does its usual work the way
+app_main() does it: sensor reads are skipped once the phase is out of
+time, connects, NTP, uploads and updates are given the remaining time as
+their timeout, and uploads go chunk by chunk while time is left.
+
+--stall of the blocking operations stall, they only return at their
+timeout. --hang of the wakes hang in one operation that ignores its
+timeout, like a stuck driver, and are cut off by the hard cap.
+
+Prints awake time percentiles, wakes over the total budget, overruns
+per phase and hard cap hits. Exits non-zero if a wake outlives the hard
+cap, a wake without a hang runs past the total budget by more than its
+longest unchecked operation, or the overrun counters disagree with the
+phases seen running out of time.
+"""
+import argparse
+import ctypes
+import os
+import random
+import re
+import sys
+
+from hostlib import CLOCK, ROOT, Budget, build
+
+PHASES = ['BOOT', 'SENSORS', 'STORAGE', 'CONNECT', 'TIME_SYNC', 'UPLOAD', 'UPDATE']
+UNCHECKED_MS = 200          # longest operation that does not look at the budget, a sensor read
+
+
+
+def read_budgets():
+    """Phase budgets and the total and grace budgets as the firmware has them"""
+    with open(os.path.join(ROOT, 'main', 'supervisor.c')) as f:
+        source = f.read()
+    phases = dict(re.findall(r'\[WAKE_PHASE_(\w+)\] = (\d+)', source))
+    total = int(re.search(r'#define WAKE_BUDGET_MS (\d+)', source).group(1))
+    grace = int(re.search(r'#define WAKE_HARD_CAP_GRACE_MS (\d+)', source).group(1))
+    return [int(phases[name]) for name in PHASES], total, grace
+
+
+class HardCap(Exception):
+    pass
+
+
+class Wake(object):
+    """One wake on a simulated clock, the phases doing their work"""
+
+    def __init__(self, lib, args, rng, budgets, total, grace, overruns):
+        self.lib = lib
+        self.args = args
+        self.rng = rng
+        self.clock = 0
+        self.cap = total + grace
+        self.budget = Budget()
+        self.now = CLOCK(lambda: self.clock)
+        self.seen = [0] * len(PHASES)      # phases seen running out of time
+        self.hung = False
+        lib.phase_budget_start(ctypes.byref(self.budget), self.now, budgets, total, overruns)
+
+    def remaining(self):
+        return self.lib.phase_budget_remaining_ms(ctypes.byref(self.budget))
+
+    def spend(self, ms):
+        if self.clock + ms >= self.cap:
+            self.clock = self.cap
+            raise HardCap()
+        self.clock += ms
+
+    def unchecked(self, ms):
+        self.spend(self.rng.randint(ms // 2, ms))
+
+    def blocking(self, ms):
+        """An operation given the remaining time as its timeout. Returns
+        0 if it finished, -1 if it stalled or timed out."""
+        timeout = self.remaining()
+        if self.hang_now():
+            self.hung = True
+            self.spend(10 * self.cap)
+        if self.rng.random() < self.args.stall:
+            self.spend(timeout)
+            return -1
+        took = self.rng.randint(ms // 2, ms)
+        self.spend(min(took, timeout))
+        return 0 if took <= timeout else -1
+
+    def hang_now(self):
+        return self.hang_at == self.operations.pop(0) if self.operations else False
+
+    def phase(self, phase):
+        self.lib.phase_budget_begin(ctypes.byref(self.budget), PHASES.index(phase))
+
+    def done(self):
+        if self.remaining() == 0:
+            self.seen[self.budget.phase] += 1
+        return self.lib.phase_budget_end(ctypes.byref(self.budget)) == 0
+
+    def run(self):
+        """The phases of app_main() and sync_wifi(), a sync on every wake"""
+        self.operations = list(range(4))
+        self.hang_at = self.rng.randrange(4) if self.rng.random() < self.args.hang else None
+
+        self.unchecked(300)
+        self.done()
+
+        self.phase('SENSORS')
+        for _ in range(3):
+            if self.remaining() > 0:
+                self.unchecked(UNCHECKED_MS)
+        self.done()
+
+        self.phase('STORAGE')
+        for _ in range(3):
+            self.unchecked(30)
+        self.done()
+
+        self.phase('CONNECT')
+        connected = self.blocking(2500) == 0
+        self.done()
+        if not connected:
+            return
+
+        if self.rng.random() < 0.1:
+            self.phase('TIME_SYNC')
+            synced = self.blocking(1500) == 0
+            self.done()
+            if not synced:
+                return
+
+        self.phase('UPLOAD')
+        for _ in range(self.rng.randint(1, 8)):
+            if self.remaining() == 0 or self.blocking(900) != 0:
+                break
+        self.done()
+
+        self.phase('UPDATE')
+        if self.remaining() > 0 and self.rng.random() < 0.05:
+            self.blocking(15000)
+        self.done()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--wakes', type=int, default=5000)
+    parser.add_argument('--stall', type=float, default=0.05, help='share of blocking operations that stall')
+    parser.add_argument('--hang', type=float, default=0.01, help='share of wakes hanging in one operation')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib = build('phase_budget', ['phase_budget.c'])
+    phase_budgets, total, grace = read_budgets()
+    budgets = (ctypes.c_int * len(PHASES))(*phase_budgets)
+    overruns = (ctypes.c_uint32 * len(PHASES))()
+    rng = random.Random(args.seed)
+
+    awake = []
+    seen = [0] * len(PHASES)
+    hard_cap_hits = over_budget = failures = 0
+
+    for _ in range(args.wakes):
+        wake = Wake(lib, args, rng, budgets, total, grace, overruns)
+        try:
+            wake.run()
+        except HardCap:
+            # what hard_cap_cb() does
+            overruns[wake.budget.phase] += 1
+            wake.seen[wake.budget.phase] += 1
+            hard_cap_hits += 1
+        awake.append(wake.clock)
+        over_budget += wake.clock > total
+        failures += wake.clock > wake.cap or (not wake.hung and wake.clock > total + UNCHECKED_MS)
+        seen = [a + b for a, b in zip(seen, wake.seen)]
+
+    awake.sort()
+    print('%d wakes, stalls %g, hangs %g, budget %d ms, hard cap %d ms' % (
+        args.wakes, args.stall, args.hang, total, total + grace))
+    print('awake ms: p50 %d, p99 %d, max %d; %d wakes over the budget' % (
+        awake[len(awake) // 2], awake[len(awake) * 99 // 100], awake[-1], over_budget))
+    print('%-10s %8s' % ('phase', 'overruns'))
+    for name, count in zip(PHASES, overruns):
+        print('%-10s %8d' % (name.lower(), count))
+    print('hard cap hits %d' % hard_cap_hits)
+
+    if failures or list(overruns) != seen:
+        sys.exit('%d wakes outlived their budget, overruns %s, seen %s' % (failures, list(overruns), seen))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,470 @@
+#!/usr/bin/env python
+"""Pulls the readout logs off a device and decodes them into CSV or Parquet.
+
+Usage: storage_dump.py decode INPUT [-o readouts.csv] [--aggregates aggregates.csv]
+       storage_dump.py mkimage storage.bin [--stream capture.bin] [--hours 48]
+
+INPUT is one of
+  - the serial port of a device: the tool asks it for maintenance mode
+    (reset the device, or hold BURATINO_MAINT_GPIO to ground) and pulls
+    the storage partition in CRC checked frames (see main/maint.h),
+    asking again for blocks that arrived damaged,
+  - a capture of that stream,
+  - a raw dump of the partition, e.g.
+    esptool.py read_flash 0x210000 0xF0000 storage.bin
+
+The SPIFFS image is read page by page, without mounting it: the
+readout logs (<sensor>.txt) and aggregates (<sensor>.agg) are collected
+from their valid pages in span order. Offsets are turned into epoch
+timestamps with the time base the device reports, or --base. A .parquet
+output needs pyarrow.
+
+'mkimage' writes a made up storage partition of the same layout, full of
+stale and interleaved pages like a long used one, for testing the
+decoder; --stream also writes it as a maintenance stream with boot noise.
+"""
+import argparse
+import csv
+import os
+import random
+import re
+import stat
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b'BDMP'
+HEADER = struct.Struct('<4sBBHIH')
+FRAME_INFO, FRAME_DATA, FRAME_END = b'I'[0], b'D'[0], b'E'[0]
+BANNER = re.compile(br'BURATINO MAINT (\d+)\r?\n')
+MAX_PAYLOAD = 4096
+CONSOLE_BAUD = 115200
+
+PAGE_LEN = 256              # SPIFFS logical page of esp_spiffs
+BLOCK_LEN = 4096            # SPIFFS logical block, one flash sector
+PAGE_HEADER = struct.Struct('<HHB')
+OBJECT_HEADER = struct.Struct('<3xI B32s')  # after the 5 byte page header: pad to 8, size, type, name
+OBJ_ID_INDEX = 0x8000
+FLAG_USED, FLAG_FINAL, FLAG_INDEX, FLAG_IXDELE, FLAG_DELET = 0x01, 0x02, 0x04, 0x40, 0x80
+OBJECT_FILE = 1
+UNKNOWN_SIZE = 0xFFFFFFFF
+
+
+def crc32(data, crc=0):
+    return zlib.crc32(data, crc) & 0xFFFFFFFF
+
+
+class Dump(object):
+    """Partition image put together from maintenance frames"""
+
+    def __init__(self):
+        self.size = None
+        self.time_base = 0
+        self.blocks = {}
+        self.end = None
+        self.damaged = 0
+
+    def add(self, frame_type, offset, payload):
+        if frame_type == FRAME_INFO:
+            self.size, _, _, self.time_base = struct.unpack('<IIII', payload)
+            self.end = None
+        elif frame_type == FRAME_DATA:
+            self.blocks[offset] = payload
+        elif frame_type == FRAME_END:
+            self.end = struct.unpack('<III', payload)
+
+    def image(self):
+        data = bytearray(b'\xff' * self.size)
+        for offset, payload in self.blocks.items():
+            data[offset:offset + len(payload)] = payload
+        return bytes(data)
+
+    def complete(self):
+        return self.size is not None and self.end is not None and crc32(self.image()) == self.end[1]
+
+
+class FrameReader(object):
+    """Finds frames in a byte stream, skipping noise and damaged frames"""
+
+    def __init__(self, dump):
+        self.dump = dump
+        self.buffer = bytearray()
+        self.frames = 0
+
+    def feed(self, data):
+        self.buffer.extend(data)
+        while True:
+            start = self.buffer.find(MAGIC)
+            if start < 0:
+                del self.buffer[:-len(MAGIC) + 1]
+                return
+            del self.buffer[:start]
+            if len(self.buffer) < HEADER.size:
+                return
+            _, frame_type, _, _, offset, length = HEADER.unpack_from(self.buffer)
+            if length > MAX_PAYLOAD:
+                del self.buffer[:1]
+                continue
+            end = HEADER.size + length + 4
+            if len(self.buffer) < end:
+                return
+            frame = bytes(self.buffer[:end])
+            if crc32(frame[4:-4]) != struct.unpack('<I', frame[-4:])[0]:
+                self.dump.damaged += 1
+                del self.buffer[:1]
+                continue
+            del self.buffer[:end]
+            self.frames += 1
+            self.dump.add(frame_type, offset, frame[HEADER.size:-4])
+            if frame_type == FRAME_END:
+                return True
+
+
+def set_baud(fd, baud):
+    import termios
+    attrs = termios.tcgetattr(fd)
+    speed = getattr(termios, 'B%d' % baud)
+    attrs[0] = 0                                                    # iflag: raw
+    attrs[1] = 0                                                    # oflag
+    attrs[2] = termios.CS8 | termios.CREAD | termios.CLOCAL         # cflag
+    attrs[3] = 0                                                    # lflag
+    attrs[4] = attrs[5] = speed
+    attrs[6][termios.VMIN] = 0
+    attrs[6][termios.VTIME] = 1                                     # reads return after 0.1 s of silence
+    termios.tcsetattr(fd, termios.TCSANOW, attrs)
+    termios.tcflush(fd, termios.TCIFLUSH)
+
+
+def pull(path, args):
+    """Talks the device into maintenance mode and reads the partition,
+    asking for another dump while blocks are missing"""
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    try:
+        set_baud(fd, CONSOLE_BAUD)
+        sys.stderr.write('Waiting for %s, reset the device or hold the maintenance pin\n' % path)
+        seen = b''
+        deadline = time.time() + args.wait
+        while True:
+            if time.time() > deadline:
+                sys.exit('No maintenance banner from %s' % path)
+            os.write(fd, b'maint\n')
+            seen = seen[-256:] + os.read(fd, 4096)
+            match = BANNER.search(seen)
+            if match:
+                break
+
+        baud = int(match.group(1))
+        set_baud(fd, baud)
+        dump = Dump()
+        data = seen[match.end():]
+        for attempt in range(args.retries + 1):
+            if attempt > 0:
+                sys.stderr.write('%d damaged frames, dumping again\n' % dump.damaged)
+                os.write(fd, b'dump\n')
+            reader = FrameReader(dump)
+            started = time.time()
+            silent_since = time.time()
+            while time.time() - silent_since < args.timeout:
+                if data:
+                    silent_since = time.time()
+                    if reader.feed(data):
+                        break
+                data = os.read(fd, 65536)
+            data = b''
+            if reader.frames:
+                received = sum(len(block) for block in dump.blocks.values())
+                sys.stderr.write('%d frames at %d baud, %.1f KB/s\n' % (
+                    reader.frames, baud, received / 1024.0 / max(time.time() - started, 1e-3)))
+            if dump.complete():
+                break
+
+        if not args.stay:
+            os.write(fd, b'reboot\n')
+    finally:
+        os.close(fd)
+    return dump
+
+
+def load(path, args):
+    """Returns the partition image and its time base from any kind of INPUT"""
+    if stat.S_ISCHR(os.stat(path).st_mode):
+        dump = pull(path, args)
+    else:
+        with open(path, 'rb') as f:
+            data = f.read()
+        dump = Dump()
+        FrameReader(dump).feed(data)
+        if dump.size is None:
+            if len(data) % BLOCK_LEN:
+                sys.exit('%s is neither a maintenance stream nor a partition dump' % path)
+            return data, 0
+
+    if dump.size is None:
+        sys.exit('No data from %s' % path)
+    if not dump.complete():
+        problem = 'stream ended early' if dump.end is None else 'partition CRC mismatch'
+        message = '%s: %s, %d damaged frames' % (path, problem, dump.damaged)
+        if not args.partial:
+            sys.exit(message + ' (--partial decodes it anyway)')
+        sys.stderr.write('Warning: %s\n' % message)
+    return dump.image(), dump.time_base
+
+
+def read_files(image):
+    """Contents of the files in a SPIFFS image by name. Only pages that
+    are written, finalized and not deleted count; a file without a valid
+    object header is deleted. Data pages are put together by span index
+    and cut to the size in the header."""
+    headers = {}
+    pages = {}
+
+    for block in range(0, len(image) - BLOCK_LEN + 1, BLOCK_LEN):
+        # the first page of each block is the object lookup table
+        for page in range(block + PAGE_LEN, block + BLOCK_LEN, PAGE_LEN):
+            obj_id, span, flags = PAGE_HEADER.unpack_from(image, page)
+            if flags & (FLAG_DELET | FLAG_FINAL | FLAG_USED) != FLAG_DELET or obj_id in (0, 0xFFFF):
+                continue
+            if flags & FLAG_INDEX:
+                pages.setdefault((obj_id, span), page)
+            elif obj_id & OBJ_ID_INDEX and span == 0 and flags & FLAG_IXDELE:
+                size, obj_type, name = OBJECT_HEADER.unpack_from(image, page + PAGE_HEADER.size)
+                if obj_type == OBJECT_FILE:
+                    headers.setdefault(obj_id & ~OBJ_ID_INDEX, (name.split(b'\0')[0].decode('ascii', 'replace'), size))
+
+    payload = PAGE_LEN - PAGE_HEADER.size
+    files = {}
+    for obj_id, (name, size) in headers.items():
+        if size == UNKNOWN_SIZE:
+            spans = max([span + 1 for (page_id, span) in pages if page_id == obj_id] or [0])
+        else:
+            spans = (size + payload - 1) // payload
+        data = bytearray()
+        resync = False
+        for span in range(spans):
+            page = pages.get((obj_id, span))
+            if page is None:
+                # a page lost from a partial dump: drop the lines it cuts and go on after it
+                del data[data.rfind(b'\n') + 1:]
+                resync = True
+                continue
+            chunk = image[page + PAGE_HEADER.size:page + PAGE_LEN]
+            if span == spans - 1:
+                chunk = chunk[:size - span * payload] if size != UNKNOWN_SIZE else chunk.rstrip(b'\xff')
+            if resync:
+                if b'\n' not in chunk:
+                    continue
+                chunk = chunk[chunk.index(b'\n') + 1:]
+                resync = False
+            data.extend(chunk)
+        files[name] = bytes(data)
+    return files
+
+
+def parse_logs(files, base):
+    """Readout and aggregate rows of every sensor. A line cut short by a
+    reset is skipped."""
+    readouts, aggregates = [], []
+    skipped = 0
+    for name in sorted(files):
+        match = re.match(r'^/?(\w+)\.(txt|agg)$', name)
+        if not match:
+            continue
+        sensor, kind = match.groups()
+        for line in files[name].decode('ascii', 'replace').split('\n'):
+            fields = line.split()
+            if not fields:
+                continue
+            try:
+                values = [int(field) for field in fields]
+            except ValueError:
+                values = []
+            if kind == 'txt' and len(values) == 2:
+                readouts.append((sensor, values[0], base + values[0] // 1000 if base else None, values[1]))
+            elif kind == 'agg' and len(values) == 6:
+                aggregates.append((sensor, values[0], base + values[0] // 1000 if base else None) + tuple(values[1:]))
+            else:
+                skipped += 1
+    return readouts, aggregates, skipped
+
+
+READOUT_COLUMNS = ['sensor', 'offset_ms', 'timestamp', 'value']
+AGGREGATE_COLUMNS = ['sensor', 'start_ms', 'timestamp', 'count', 'min', 'max', 'mean', 'variance']
+
+
+def write_table(path, columns, rows):
+    if path.endswith('.parquet'):
+        try:
+            import pyarrow
+            import pyarrow.parquet
+        except ImportError:
+            sys.exit('Writing %s needs pyarrow (pip install pyarrow)' % path)
+        table = pyarrow.Table.from_pydict({
+            column: pyarrow.array([row[i] for row in rows], pyarrow.string() if column == 'sensor' else pyarrow.int64())
+            for i, column in enumerate(columns)})
+        pyarrow.parquet.write_table(table, path)
+    else:
+        with open(path, 'w') as f:
+            writer = csv.writer(f, lineterminator='\n')
+            writer.writerow(columns)
+            writer.writerows(['' if value is None else value for value in row] for row in rows)
+
+
+def decode(args):
+    image, base = load(args.input, args)
+    if args.image:
+        with open(args.image, 'wb') as f:
+            f.write(image)
+    if args.base is not None:
+        base = args.base
+
+    files = read_files(image)
+    readouts, aggregates, skipped = parse_logs(files, base)
+    write_table(args.output, READOUT_COLUMNS, readouts)
+    if args.aggregates:
+        write_table(args.aggregates, AGGREGATE_COLUMNS, aggregates)
+
+    sys.stderr.write('%d files, %d readouts, %d aggregates, %d lines skipped, time base %s\n' % (
+        len(files), len(readouts), len(aggregates), skipped, base or 'unknown'))
+
+
+class ImageWriter(object):
+    """Lays out files in SPIFFS pages the way the decoder reads them.
+    Pages are taken from the blocks in random order, as wear leveling
+    leaves them, and deleted files leave their pages behind."""
+
+    def __init__(self, size, rng):
+        self.image = bytearray(b'\xff' * size)
+        self.blocks = size // BLOCK_LEN
+        self.free = [block * BLOCK_LEN + page * PAGE_LEN
+                     for block in range(self.blocks) for page in range(1, BLOCK_LEN // PAGE_LEN)]
+        rng.shuffle(self.free)
+        self.free.sort(key=lambda page: page // BLOCK_LEN % 7)
+        self.next_id = 1
+        for block in range(self.blocks):
+            magic = (0x20140529 ^ PAGE_LEN ^ (self.blocks - block)) & 0xFFFF
+            struct.pack_into('<H', self.image, block * BLOCK_LEN + PAGE_LEN - 2, magic)
+
+    def page(self, obj_id, span, flags, body):
+        if not self.free:
+            raise ValueError('image full')
+        page = self.free.pop(0)
+        self.image[page:page + PAGE_HEADER.size] = PAGE_HEADER.pack(obj_id, span, flags)
+        self.image[page + PAGE_HEADER.size:page + PAGE_HEADER.size + len(body)] = body
+        block, index = divmod(page, BLOCK_LEN)
+        struct.pack_into('<H', self.image, block * BLOCK_LEN + (index // PAGE_LEN - 1) * 2, obj_id)
+        return page
+
+    def write(self, name, data):
+        obj_id = self.next_id
+        self.next_id += 1
+        written = [self.page(obj_id | OBJ_ID_INDEX, 0, 0xFF & ~(FLAG_USED | FLAG_FINAL | FLAG_INDEX),
+                             OBJECT_HEADER.pack(len(data), OBJECT_FILE, name.encode()))]
+        payload = PAGE_LEN - PAGE_HEADER.size
+        for span in range((len(data) + payload - 1) // payload):
+            written.append(self.page(obj_id, span, 0xFF & ~(FLAG_USED | FLAG_FINAL),
+                                     data[span * payload:(span + 1) * payload]))
+        return written
+
+    def delete(self, written):
+        for page in written:
+            self.image[page + 4] &= ~FLAG_DELET
+            block, index = divmod(page, BLOCK_LEN)
+            struct.pack_into('<H', self.image, block * BLOCK_LEN + (index // PAGE_LEN - 1) * 2, 0)
+
+
+def make_logs(rng, hours, interval=10):
+    """Text logs as storage.c writes them, offsets in ms from the time base"""
+    logs = {}
+    for sensor, every, value, step in (('TMP', 1, 2150, 6), ('FER', 2, 1800, 20), ('LUM', 1, 400, 50)):
+        lines = []
+        for wake in range(0, int(hours * 3600 // interval), every):
+            value += rng.randint(-step, step)
+            lines.append('%d %d\n' % (wake * interval * 1000 + rng.randint(0, 999), value))
+        logs[sensor] = lines
+    return logs
+
+
+def mkimage(args):
+    rng = random.Random(args.seed)
+    writer = ImageWriter(args.size, rng)
+    logs = make_logs(rng, args.hours)
+
+    expected = []
+    for sensor, lines in sorted(logs.items()):
+        # an older copy of the log, rewritten and deleted since, as truncate_readouts() leaves it
+        writer.delete(writer.write('/%s.txt' % sensor, ''.join(lines[:len(lines) // 3]).encode()))
+        writer.write('/%s.idx' % sensor, os.urandom(64))
+        writer.write('/%s.txt' % sensor, ''.join(lines).encode())
+        expected.extend((sensor, line) for line in lines)
+
+        aggregate = ''.join('%d 60 %d %d %d %d\n' % (start, rng.randint(0, 100), rng.randint(100, 200),
+                                                      rng.randint(50, 150), rng.randint(0, 999))
+                            for start in range(0, int(args.hours * 3600000), 600000))
+        writer.write('/%s.agg' % sensor, aggregate.encode())
+
+    image = bytes(writer.image)
+    with open(args.image, 'wb') as f:
+        f.write(image)
+
+    if args.stream:
+        with open(args.stream, 'wb') as f:
+            f.write(b'ets Jun  8 2016 00:22:57\r\nrst:0x1 (POWERON_RESET),boot:0x13\r\n' + os.urandom(200))
+            f.write(b'\nBURATINO MAINT 921600\n')
+            seq = [0]
+
+            def frame(frame_type, offset, payload):
+                header = HEADER.pack(MAGIC, frame_type, 0, seq[0] & 0xFFFF, offset, len(payload))
+                seq[0] += 1
+                body = header + payload
+                f.write(body + struct.pack('<I', crc32(body[4:])))
+
+            frame(FRAME_INFO, 0, struct.pack('<IIII', len(image), BLOCK_LEN, PAGE_LEN, args.base))
+            sent = 0
+            for offset in range(0, len(image), BLOCK_LEN):
+                block = image[offset:offset + BLOCK_LEN]
+                if block != b'\xff' * len(block):
+                    frame(FRAME_DATA, offset, block)
+                    sent += 1
+            frame(FRAME_END, 0, struct.pack('<III', len(image), crc32(image), sent))
+
+    sys.stderr.write('%d readouts in %d of %d blocks\n' % (
+        len(expected), sum(1 for o in range(0, len(image), BLOCK_LEN) if image[o:o + BLOCK_LEN] != b'\xff' * BLOCK_LEN),
+        len(image) // BLOCK_LEN))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    commands = parser.add_subparsers(dest='command')
+
+    command = commands.add_parser('decode', help='serial port, stream capture or partition dump to CSV or Parquet')
+    command.add_argument('input')
+    command.add_argument('-o', '--output', default='readouts.csv', help='.csv or .parquet')
+    command.add_argument('--aggregates', help='also write the aggregates, .csv or .parquet')
+    command.add_argument('--image', help='save the partition image pulled from a device or stream')
+    command.add_argument('--base', type=int, help='epoch second readout offsets count from, overrides the device')
+    command.add_argument('--partial', action='store_true', help='decode an incomplete stream anyway')
+    command.add_argument('--wait', type=float, default=30, help='time to get the device into maintenance, s')
+    command.add_argument('--timeout', type=float, default=3, help='silence that ends a dump, s')
+    command.add_argument('--retries', type=int, default=3, help='dumps asked again for damaged frames')
+    command.add_argument('--stay', action='store_true', help='leave the device in maintenance mode')
+
+    command = commands.add_parser('mkimage', help='write a test storage partition')
+    command.add_argument('image')
+    command.add_argument('--stream', help='also write it as a maintenance stream')
+    command.add_argument('--size', type=lambda s: int(s, 0), default=0xF0000, help='partition size')
+    command.add_argument('--hours', type=float, default=48, help='readout history')
+    command.add_argument('--base', type=int, default=1500000000, help='time base put in the stream')
+    command.add_argument('--seed', type=int, default=1)
+
+    args = parser.parse_args()
+    if args.command == 'decode':
+        decode(args)
+    elif args.command == 'mkimage':
+        mkimage(args)
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,466 @@
+#!/usr/bin/env python
+"""Decodes SPIFFS images laid out by SPIFFS' own structures with storage_dump.py.
+
+Usage: storage_dump_test.py [--hours 6] [--keep image.bin]
+
+The images storage_dump.py mkimage writes share the decoder's idea of
+the page layout, so they cannot catch a wrong one. This test lays out
+its fixture with a small C writer built on the host C compiler, whose
+page structures are those of spiffs_nucleus.h with the spiffs_config.h
+values of esp_spiffs (256 byte pages, 4KB blocks, 32 byte names, 4
+bytes of metadata), so the offsets come from the compiler, not from
+storage_dump.py. Files are grown the way SPIFFS grows them on the
+device: appends rewrite the last data page and the index pages and
+delete the old copies, larger logs need more than one index page, a
+compacted log is renamed over its deleted predecessor, and a removal cut
+short by a reset leaves an index header marked for deletion.
+
+The image is then decoded as a raw partition dump with storage_dump.py
+decode, on this machine, and every readout and aggregate must come back
+with its offset, timestamp and value. An image from storage_dump.py
+mkimage, written as a maintenance stream as well, must decode to the
+same rows either way. Exits non-zero on the first difference.
+"""
+import argparse
+import csv
+import ctypes
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+from hostlib import ROOT, build
+
+TOOL = os.path.join(ROOT, 'tools', 'storage_dump.py')
+PARTITION_LEN = 0xF0000     # storage partition of partitions.csv
+TIME_BASE = 1500000000
+
+FIXTURE_SOURCE = r'''
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* spiffs_config.h as esp_spiffs builds it */
+#define SPIFFS_CFG_LOG_PAGE_SZ 256
+#define SPIFFS_CFG_LOG_BLOCK_SZ 4096
+#define SPIFFS_OBJ_NAME_LEN 32
+#define SPIFFS_OBJ_META_LEN 4
+#define SPIFFS_PACKED __attribute__((packed))
+typedef uint16_t spiffs_obj_id;
+typedef uint16_t spiffs_span_ix;
+typedef uint16_t spiffs_page_ix;
+typedef uint8_t spiffs_obj_type;
+
+/* from spiffs_nucleus.h */
+#define SPIFFS_OBJ_ID_IX_FLAG ((spiffs_obj_id)(1 << (8 * sizeof(spiffs_obj_id) - 1)))
+#define SPIFFS_OBJ_ID_DELETED ((spiffs_obj_id)0)
+#define SPIFFS_PH_FLAG_USED (1 << 0)
+#define SPIFFS_PH_FLAG_FINAL (1 << 1)
+#define SPIFFS_PH_FLAG_INDEX (1 << 2)
+#define SPIFFS_PH_FLAG_IXDELE (1 << 6)
+#define SPIFFS_PH_FLAG_DELET (1 << 7)
+#define SPIFFS_TYPE_FILE (1)
+#define SPIFFS_PAGES_PER_BLOCK (SPIFFS_CFG_LOG_BLOCK_SZ / SPIFFS_CFG_LOG_PAGE_SZ)
+#define SPIFFS_OBJ_LOOKUP_PAGES \
+    (SPIFFS_PAGES_PER_BLOCK * sizeof(spiffs_obj_id) / SPIFFS_CFG_LOG_PAGE_SZ > 0 \
+        ? SPIFFS_PAGES_PER_BLOCK * sizeof(spiffs_obj_id) / SPIFFS_CFG_LOG_PAGE_SZ : 1)
+#define SPIFFS_MAGIC(blocks, bix) ((spiffs_obj_id)(0x20140529 ^ SPIFFS_CFG_LOG_PAGE_SZ ^ ((blocks) - (bix))))
+
+typedef struct SPIFFS_PACKED {
+    spiffs_obj_id obj_id;
+    spiffs_span_ix span_ix;
+    uint8_t flags;
+} spiffs_page_header;
+
+typedef struct SPIFFS_PACKED {
+    spiffs_page_header p_hdr;
+    uint8_t _align[4 - ((sizeof(spiffs_page_header) & 3) == 0 ? 4 : (sizeof(spiffs_page_header) & 3))];
+    uint32_t size;
+    spiffs_obj_type type;
+    uint8_t name[SPIFFS_OBJ_NAME_LEN];
+    uint8_t meta[SPIFFS_OBJ_META_LEN];
+} spiffs_page_object_ix_header;
+
+typedef struct SPIFFS_PACKED {
+    spiffs_page_header p_hdr;
+    uint8_t _align[4 - ((sizeof(spiffs_page_header) & 3) == 0 ? 4 : (sizeof(spiffs_page_header) & 3))];
+} spiffs_page_object_ix;
+
+#define SPIFFS_OBJ_HDR_IX_LEN ((SPIFFS_CFG_LOG_PAGE_SZ - sizeof(spiffs_page_object_ix_header)) / sizeof(spiffs_page_ix))
+#define SPIFFS_OBJ_IX_LEN ((SPIFFS_CFG_LOG_PAGE_SZ - sizeof(spiffs_page_object_ix)) / sizeof(spiffs_page_ix))
+#define SPIFFS_DATA_PAGE_SIZE (SPIFFS_CFG_LOG_PAGE_SZ - sizeof(spiffs_page_header))
+
+#define MAX_OBJECTS 32
+#define MAX_DATA_PAGES 2048
+#define MAX_INDEX_PAGES 32
+
+typedef struct {
+    spiffs_obj_id id;
+    char name[SPIFFS_OBJ_NAME_LEN];
+    uint32_t size;
+    uint32_t data_pages;
+    spiffs_page_ix data[MAX_DATA_PAGES];
+    uint32_t index_pages;
+    spiffs_page_ix index[MAX_INDEX_PAGES];
+} object_t;
+
+static uint8_t* image;
+static uint32_t blocks;
+static uint32_t next_page;
+static object_t objects[MAX_OBJECTS];
+static int object_count;
+
+size_t fixture_size_offset()
+{
+    return offsetof(spiffs_page_object_ix_header, size);
+}
+
+static spiffs_page_header* header(spiffs_page_ix page)
+{
+    return (spiffs_page_header*)(image + page * SPIFFS_CFG_LOG_PAGE_SZ);
+}
+
+static spiffs_obj_id* lookup(spiffs_page_ix page)
+{
+    uint32_t block = page / SPIFFS_PAGES_PER_BLOCK;
+    uint32_t entry = page % SPIFFS_PAGES_PER_BLOCK - SPIFFS_OBJ_LOOKUP_PAGES;
+    return (spiffs_obj_id*)(image + block * SPIFFS_CFG_LOG_BLOCK_SZ) + entry;
+}
+
+/* Pages are used in order, each block's lookup pages skipped, like a
+   freshly formatted file system fills up before its first GC */
+static int allocate(spiffs_obj_id obj_id)
+{
+    while (next_page % SPIFFS_PAGES_PER_BLOCK < SPIFFS_OBJ_LOOKUP_PAGES) {
+        next_page++;
+    }
+    if (next_page >= blocks * SPIFFS_PAGES_PER_BLOCK) {
+        return -1;
+    }
+    *lookup(next_page) = obj_id;
+    return next_page++;
+}
+
+static void delete_page(spiffs_page_ix page)
+{
+    header(page)->flags &= ~SPIFFS_PH_FLAG_DELET;
+    *lookup(page) = SPIFFS_OBJ_ID_DELETED;
+}
+
+int fixture_init(uint32_t size)
+{
+    free(image);
+    image = malloc(size);
+    if (image == NULL) {
+        return -1;
+    }
+    memset(image, 0xFF, size);
+    memset(objects, 0, sizeof(objects));
+    object_count = 0;
+    blocks = size / SPIFFS_CFG_LOG_BLOCK_SZ;
+    next_page = 0;
+
+    for (uint32_t bix = 0; bix < blocks; bix++) {
+        spiffs_obj_id magic = SPIFFS_MAGIC(blocks, bix);
+        memcpy(image + bix * SPIFFS_CFG_LOG_BLOCK_SZ + SPIFFS_OBJ_LOOKUP_PAGES * SPIFFS_CFG_LOG_PAGE_SZ
+            - sizeof(spiffs_obj_id), &magic, sizeof(magic));
+    }
+    return 0;
+}
+
+const uint8_t* fixture_image()
+{
+    return image;
+}
+
+/* Writes the index pages of an object anew and deletes the old ones */
+static int write_index(object_t* object)
+{
+    spiffs_page_ix old[MAX_INDEX_PAGES];
+    uint32_t old_count = object->index_pages;
+    uint32_t count = 1;
+
+    memcpy(old, object->index, sizeof(old));
+    if (object->data_pages > SPIFFS_OBJ_HDR_IX_LEN) {
+        count += (object->data_pages - SPIFFS_OBJ_HDR_IX_LEN + SPIFFS_OBJ_IX_LEN - 1) / SPIFFS_OBJ_IX_LEN;
+    }
+    if (count > MAX_INDEX_PAGES) {
+        return -1;
+    }
+
+    for (uint32_t span = 0; span < count; span++) {
+        spiffs_obj_id obj_id = object->id | SPIFFS_OBJ_ID_IX_FLAG;
+        int page = allocate(obj_id);
+        if (page < 0) {
+            return -1;
+        }
+        uint8_t* p = image + page * SPIFFS_CFG_LOG_PAGE_SZ;
+        uint8_t* entries;
+        uint32_t first, len;
+
+        if (span == 0) {
+            spiffs_page_object_ix_header* ix = (spiffs_page_object_ix_header*)p;
+            ix->size = object->size;
+            ix->type = SPIFFS_TYPE_FILE;
+            memset(ix->name, 0, sizeof(ix->name));
+            strncpy((char*)ix->name, object->name, sizeof(ix->name));
+            entries = p + sizeof(spiffs_page_object_ix_header);
+            first = 0;
+            len = SPIFFS_OBJ_HDR_IX_LEN;
+        } else {
+            entries = p + sizeof(spiffs_page_object_ix);
+            first = SPIFFS_OBJ_HDR_IX_LEN + (span - 1) * SPIFFS_OBJ_IX_LEN;
+            len = SPIFFS_OBJ_IX_LEN;
+        }
+        for (uint32_t i = 0; i < len && first + i < object->data_pages; i++) {
+            // the entries after the packed header are not aligned
+            memcpy(entries + i * sizeof(spiffs_page_ix), &object->data[first + i], sizeof(spiffs_page_ix));
+        }
+        ((spiffs_page_header*)p)->obj_id = obj_id;
+        ((spiffs_page_header*)p)->span_ix = span;
+        ((spiffs_page_header*)p)->flags = 0xFF & ~(SPIFFS_PH_FLAG_USED | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX);
+        object->index[span] = page;
+    }
+    object->index_pages = count;
+
+    for (uint32_t i = 0; i < old_count; i++) {
+        delete_page(old[i]);
+    }
+    return 0;
+}
+
+/* Appends to a file, creating it first if there is no such live file.
+   The last data page, if partly filled, is copied into a new page with
+   the appended bytes and the old one deleted, as spiffs_object_append()
+   does. Returns the object id, -1 if the image is full. */
+int fixture_append(const char* name, const uint8_t* data, uint32_t len)
+{
+    object_t* object = NULL;
+
+    for (int i = 0; i < object_count; i++) {
+        if (objects[i].id != 0 && strcmp(objects[i].name, name) == 0) {
+            object = &objects[i];
+        }
+    }
+    if (object == NULL) {
+        if (object_count == MAX_OBJECTS) {
+            return -1;
+        }
+        object = &objects[object_count++];
+        object->id = object_count;
+        strncpy(object->name, name, sizeof(object->name) - 1);
+    }
+
+    uint32_t offset = object->size % SPIFFS_DATA_PAGE_SIZE;
+    uint32_t done = 0;
+
+    if (offset != 0 && len > 0) {
+        spiffs_page_ix old = object->data[object->data_pages - 1];
+        int page = allocate(object->id);
+        uint32_t n = SPIFFS_DATA_PAGE_SIZE - offset < len ? SPIFFS_DATA_PAGE_SIZE - offset : len;
+        if (page < 0) {
+            return -1;
+        }
+        memcpy(image + page * SPIFFS_CFG_LOG_PAGE_SZ, image + old * SPIFFS_CFG_LOG_PAGE_SZ, sizeof(spiffs_page_header) + offset);
+        memcpy(image + page * SPIFFS_CFG_LOG_PAGE_SZ + sizeof(spiffs_page_header) + offset, data, n);
+        delete_page(old);
+        object->data[object->data_pages - 1] = page;
+        done = n;
+    }
+
+    while (done < len) {
+        int page = allocate(object->id);
+        uint32_t n = len - done < SPIFFS_DATA_PAGE_SIZE ? len - done : SPIFFS_DATA_PAGE_SIZE;
+        if (page < 0 || object->data_pages == MAX_DATA_PAGES) {
+            return -1;
+        }
+        header(page)->obj_id = object->id;
+        header(page)->span_ix = object->data_pages;
+        header(page)->flags = 0xFF & ~(SPIFFS_PH_FLAG_USED | SPIFFS_PH_FLAG_FINAL);
+        memcpy(image + page * SPIFFS_CFG_LOG_PAGE_SZ + sizeof(spiffs_page_header), data + done, n);
+        object->data[object->data_pages++] = page;
+        done += n;
+    }
+
+    object->size += len;
+    return write_index(object) == 0 ? object->id : -1;
+}
+
+/* Renames a file, which rewrites its index header with the new name */
+int fixture_rename(int id, const char* name)
+{
+    object_t* object = &objects[id - 1];
+
+    memset(object->name, 0, sizeof(object->name));
+    strncpy(object->name, name, sizeof(object->name) - 1);
+    return write_index(object);
+}
+
+/* Removes a file. With 'interrupted' only the first step of
+   spiffs_object_truncate() is done, marking the index header for
+   deletion, as a reset in the middle of SPIFFS_remove() leaves it. */
+int fixture_remove(int id, int interrupted)
+{
+    object_t* object = &objects[id - 1];
+
+    if (interrupted) {
+        header(object->index[0])->flags &= ~SPIFFS_PH_FLAG_IXDELE;
+    } else {
+        for (uint32_t i = 0; i < object->data_pages; i++) {
+            delete_page(object->data[i]);
+        }
+        for (uint32_t i = 0; i < object->index_pages; i++) {
+            delete_page(object->index[i]);
+        }
+    }
+    object->id = 0;
+    return 0;
+}
+'''
+
+
+def load_fixture():
+    lib = build('fixture', source=FIXTURE_SOURCE)
+    lib.fixture_size_offset.restype = ctypes.c_size_t
+    lib.fixture_init.argtypes = [ctypes.c_uint32]
+    lib.fixture_image.restype = ctypes.POINTER(ctypes.c_uint8)
+    lib.fixture_append.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_uint32]
+    lib.fixture_rename.argtypes = [ctypes.c_int, ctypes.c_char_p]
+    lib.fixture_remove.argtypes = [ctypes.c_int, ctypes.c_int]
+    return lib
+
+
+def append(lib, name, data):
+    obj_id = lib.fixture_append(name.encode(), data, len(data))
+    if obj_id < 0:
+        sys.exit('fixture image full appending to %s' % name)
+    return obj_id
+
+
+def make_fixture(lib, rng, hours):
+    """Syncs of a device: readouts appended to the logs in batches, an
+    aggregate line per window, an index, a compaction that rewrites a
+    log and an interrupted removal. Returns the image and the rows it
+    must decode to."""
+    lib.fixture_init(PARTITION_LEN)
+    readouts, aggregates = [], []
+    logs = {'TMP': 2150, 'FER': 1800, 'LUM': 400}
+    kept = dict((sensor, []) for sensor in logs)
+
+    wakes = int(hours * 360)
+    for start in range(0, wakes, 60):
+        for sensor in sorted(logs):
+            lines = []
+            for wake in range(start, min(start + 60, wakes)):
+                logs[sensor] += rng.randint(-20, 20)
+                lines.append((wake * 10000 + rng.randint(0, 999), logs[sensor]))
+            kept[sensor].extend(lines)
+            append(lib, '/%s.txt' % sensor, ''.join('%d %d\n' % line for line in lines).encode())
+            append(lib, '/%s.idx' % sensor, os.urandom(16))
+
+            window = (sensor, start * 10000, 60, rng.randint(0, 100), rng.randint(100, 200),
+                      rng.randint(50, 150), rng.randint(0, 999))
+            aggregates.append(window)
+            append(lib, '/%s.agg' % sensor, ('%d %d %d %d %d %d\n' % window[1:]).encode())
+
+    # truncate_readouts() of TMP: the kept half is copied to TMP.tmp, which replaces the log
+    half = len(kept['TMP']) // 2
+    tmp = append(lib, '/TMP.tmp', ''.join('%d %d\n' % line for line in kept['TMP'][half:]).encode())
+    lib.fixture_remove(append(lib, '/TMP.txt', b''), 0)
+    if lib.fixture_rename(tmp, b'/TMP.txt') != 0:
+        sys.exit('fixture image full renaming /TMP.tmp')
+    kept['TMP'] = kept['TMP'][half:]
+
+    # a log removed with a reset halfway through
+    gone = append(lib, '/OLD.txt', b'1000 1\n2000 2\n')
+    lib.fixture_remove(gone, 1)
+
+    for sensor in sorted(logs):
+        readouts.extend((sensor, offset, value) for offset, value in kept[sensor])
+
+    image = ctypes.string_at(lib.fixture_image(), PARTITION_LEN)
+    return image, readouts, aggregates
+
+
+def read_rows(path):
+    with open(path) as f:
+        return [tuple(row) for row in csv.reader(f)][1:]
+
+
+def decode(workdir, source, base=None):
+    """Readout and aggregate rows storage_dump.py decodes from a file"""
+    readouts = os.path.join(workdir, 'readouts.csv')
+    aggregates = os.path.join(workdir, 'aggregates.csv')
+    command = [sys.executable, TOOL, 'decode', source, '-o', readouts, '--aggregates', aggregates]
+    if base is not None:
+        command += ['--base', str(base)]
+    subprocess.check_call(command, stderr=open(os.devnull, 'w'))
+    return read_rows(readouts), read_rows(aggregates)
+
+
+def check_fixture(lib, args, workdir):
+    sys.path.insert(0, os.path.dirname(TOOL))
+    import storage_dump
+    header_offset = storage_dump.PAGE_HEADER.size + storage_dump.OBJECT_HEADER.size - 4 - 1 - 32
+    if header_offset != lib.fixture_size_offset():
+        sys.exit('storage_dump.py reads the object size at page offset %d, SPIFFS keeps it at %d' % (
+            header_offset, lib.fixture_size_offset()))
+
+    image, readouts, aggregates = make_fixture(lib, random.Random(args.seed), args.hours)
+    path = args.keep or os.path.join(workdir, 'fixture.bin')
+    with open(path, 'wb') as f:
+        f.write(image)
+
+    decoded_readouts, decoded_aggregates = decode(workdir, path, TIME_BASE)
+    expected_readouts = [(sensor, str(offset), str(TIME_BASE + offset // 1000), str(value))
+                         for sensor, offset, value in sorted(readouts, key=lambda row: row[0])]
+    expected_aggregates = [(row[0], str(row[1]), str(TIME_BASE + row[1] // 1000)) + tuple(str(v) for v in row[2:])
+                           for row in sorted(aggregates, key=lambda row: row[0])]
+
+    for kind, decoded, expected in (('readouts', decoded_readouts, expected_readouts),
+                                    ('aggregates', decoded_aggregates, expected_aggregates)):
+        if decoded != expected:
+            first = next((i for i, (a, b) in enumerate(zip(decoded, expected)) if a != b), min(len(decoded), len(expected)))
+            sys.exit('fixture: %d %s decoded, %d expected, first difference at row %d: %s, expected %s' % (
+                len(decoded), kind, len(expected), first,
+                decoded[first] if first < len(decoded) else None, expected[first] if first < len(expected) else None))
+    print('SPIFFS fixture: %d readouts and %d aggregates decoded, %d of %d pages written' % (
+        len(decoded_readouts), len(decoded_aggregates),
+        sum(1 for page in range(0, len(image), 256) if page % 4096 and image[page + 4] != 0xFF),
+        len(image) // 256 - len(image) // 4096))
+
+
+def check_mkimage(args, workdir):
+    image = os.path.join(workdir, 'mkimage.bin')
+    stream = os.path.join(workdir, 'mkimage.stream')
+    subprocess.check_call([sys.executable, TOOL, 'mkimage', image, '--stream', stream, '--hours', str(args.hours),
+                           '--base', str(TIME_BASE)], stderr=open(os.devnull, 'w'))
+    raw = decode(workdir, image, TIME_BASE)
+    streamed = decode(workdir, stream)
+    if raw != streamed or not raw[0] or not raw[1]:
+        sys.exit('mkimage: %d/%d rows from the image, %d/%d from the stream' % (
+            len(raw[0]), len(raw[1]), len(streamed[0]), len(streamed[1])))
+    print('mkimage: %d readouts and %d aggregates from the image and the stream' % (len(raw[0]), len(raw[1])))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hours', type=float, default=6, help='readout history in the images')
+    parser.add_argument('--keep', help='also save the fixture image here')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    lib = load_fixture()
+    workdir = tempfile.mkdtemp()
+    try:
+        check_fixture(lib, args, workdir)
+        check_mkimage(args, workdir)
+    finally:
+        shutil.rmtree(workdir)
+
+
+if __name__ == '__main__':
+    main()
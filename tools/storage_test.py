@@ -0,0 +1,237 @@
+#!/usr/bin/env python
+"""Checks readout log compaction recovery and benchmarks the time index.
+
+Usage: storage_test.py [--readouts 20000] [--queries 500]
+
+Builds main/storage.c with the host C compiler against the stand-in
+headers in tools/host/, with STORAGE_BASE_PATH pointing to a temporary
+directory instead of the SPIFFS mount, and drives it through ctypes.
+
+First leaves the files of a readout log the way a reset would at every
+step of truncate_readouts() (partial and complete <sensor>.tmp, dropped
+index, log moved to <sensor>.old, .tmp renamed over it), runs
+storage_init() and checks that the log holds either all readouts or
+exactly the kept ones, with nothing left behind. A missing or partial
+index must not change what read_range() returns either, and neither
+must one that is misaligned or points past the end of the log, into a
+line or at a later readout; pruning with such an index must keep what
+it has to, and the next readout must rebuild a misaligned index.
+Expiring a few
+readouts must leave the log alone, expiring many must compact it, and
+reading aggregates must stay within the records the caller has room
+for when a line is torn or overlong.
+
+Then fills a log with --readouts readouts and times --queries short
+read_range() queries at random times, with the index and with the
+index removed (a scan from the start of the log). Prints the bytes read
+and the host time per query. On the device the bytes are what counts,
+every one of them comes from flash.
+"""
+import argparse
+import ctypes
+import os
+import random
+import shutil
+import struct
+import sys
+import tempfile
+import time
+
+from hostlib import AggregateRecord, Range, build
+
+SENSOR = b'TMP'
+STEP_MS = 10000             # readouts 10 s apart, as with the default DEEP_SLEEP_DELAY
+ULONG_MAX = ctypes.c_ulong(-1).value
+
+
+class Log(object):
+    def __init__(self, lib, base):
+        self.lib = lib
+        self.base = base
+
+    def path(self, suffix):
+        return os.path.join(self.base, '%s.%s' % (SENSOR.decode(), suffix))
+
+    def read(self, suffix):
+        with open(self.path(suffix), 'rb') as f:
+            return f.read()
+
+    def write(self, suffix, data):
+        with open(self.path(suffix), 'wb') as f:
+            f.write(data)
+
+    def remove(self, *suffixes):
+        for suffix in suffixes:
+            if os.path.exists(self.path(suffix)):
+                os.unlink(self.path(suffix))
+
+    def fill(self, count):
+        self.lib.flush_readouts(SENSOR)
+        for i in range(count):
+            self.lib.dump_readout(SENSOR, i * STEP_MS, i % 4096 - 2048)
+
+    def query(self, t0, t1):
+        """Readouts between t0 and t1, and the bytes read to find them"""
+        readouts = []
+        rng = Range()
+        t, value = ctypes.c_ulong(), ctypes.c_int()
+        if self.lib.read_range(SENSOR, t0, t1, ctypes.byref(rng)) != 0:
+            return readouts, 0
+        start = rng.offset
+        while self.lib.read_range_next(ctypes.byref(rng), ctypes.byref(t), ctypes.byref(value)):
+            readouts.append((t.value, value.value))
+        self.lib.read_range_close(ctypes.byref(rng))
+        return readouts, rng.offset - start
+
+
+def check_recovery(lib, log):
+    count, keep_from = 2000, 1234
+    log.fill(count)
+    full, full_index = log.read('txt'), log.read('idx')
+    expected_full = log.query(0, ULONG_MAX)[0]
+
+    lib.prune_readouts(SENSOR, keep_from * STEP_MS)
+    kept, kept_index = log.read('txt'), log.read('idx')
+    expected_kept = log.query(0, ULONG_MAX)[0]
+    if expected_kept != expected_full[keep_from:]:
+        sys.exit('prune_readouts kept %d readouts, expected %d' % (len(expected_kept), count - keep_from))
+
+    # files as a reset leaves them after each step of truncate_readouts()
+    states = [
+        ('partial .tmp', {'txt': full, 'idx': full_index, 'tmp': kept[:len(kept) // 2]}, expected_full),
+        ('complete .tmp', {'txt': full, 'idx': full_index, 'tmp': kept}, expected_full),
+        ('index dropped', {'txt': full, 'tmp': kept}, expected_full),
+        ('log moved to .old', {'old': full, 'tmp': kept}, expected_kept),
+        ('.tmp renamed', {'old': full, 'txt': kept}, expected_kept),
+        ('index not rebuilt', {'txt': kept}, expected_kept),
+        ('index partial', {'txt': kept, 'idx': kept_index[:len(kept_index) // 2]}, expected_kept),
+    ]
+    for name, files, expected in states:
+        log.remove('txt', 'idx', 'tmp', 'old')
+        for suffix, data in files.items():
+            log.write(suffix, data)
+
+        lib.storage_init()
+
+        readouts = log.query(0, ULONG_MAX)[0]
+        t0 = expected[len(expected) // 2][0]
+        middle = log.query(t0, t0 + 5 * STEP_MS)[0]
+        left = [suffix for suffix in ('tmp', 'old') if os.path.exists(log.path(suffix))]
+        if readouts != expected or middle != [r for r in expected if t0 <= r[0] <= t0 + 5 * STEP_MS] or left:
+            sys.exit('reset with %s: %d readouts, expected %d, %d in the middle query, left %s' % (
+                name, len(readouts), len(expected), len(middle), left))
+    print('%d reset states recover' % len(states))
+
+
+def check_bad_index(lib, log):
+    count, keep_from = 2000, 1234
+    log.fill(count)
+    full, index = log.read('txt'), log.read('idx')
+    expected = log.query(0, ULONG_MAX)[0]
+    entry = struct.Struct('<II')
+    middle = len(index) // entry.size // 2
+    time, offset = entry.unpack_from(index, middle * entry.size)
+
+    def patched(new_time, new_offset):
+        return index[:middle * entry.size] + entry.pack(new_time, new_offset) + index[(middle + 1) * entry.size:]
+
+    indexes = [
+        ('misaligned', index + b'\x01\x02\x03'),
+        ('past the end', index[:-entry.size] + entry.pack(expected[-1][0], len(full) + 100)),
+        ('inside a line', patched(time, offset + 3)),
+        ('at a later readout', patched(time - 20 * STEP_MS, offset)),
+    ]
+    for name, data in indexes:
+        for t0 in (time - 10 * STEP_MS, time, expected[-1][0]):
+            log.write('txt', full)
+            log.write('idx', data)
+            readouts = log.query(t0, t0 + 5 * STEP_MS)[0]
+            if readouts != [r for r in expected if t0 <= r[0] <= t0 + 5 * STEP_MS]:
+                sys.exit('index %s: %d readouts from %d' % (name, len(readouts), t0))
+
+        log.write('idx', data)
+        lib.prune_readouts(SENSOR, keep_from * STEP_MS)
+        if log.query(0, ULONG_MAX)[0] != expected[keep_from:]:
+            sys.exit('index %s: prune_readouts kept the wrong readouts' % name)
+
+    log.write('txt', full)
+    log.write('idx', indexes[0][1])
+    lib.dump_readout(SENSOR, count * STEP_MS, 0)
+    if len(log.read('idx')) % entry.size:
+        sys.exit('misaligned index was not rebuilt')
+    print('%d broken indexes ignored' % len(indexes))
+
+
+def check_expiry(lib, log):
+    count = 2000
+    log.fill(count)
+    full = log.read('txt')
+    for expired, compacts in ((100, False), (1000, True)):
+        lib.expire_readouts(SENSOR, expired * STEP_MS)
+        readouts = log.query(0, ULONG_MAX)[0]
+        if compacts and len(readouts) != count - expired or not compacts and log.read('txt') != full:
+            sys.exit('expire_readouts of %d: %d readouts left of %d' % (expired, len(readouts), count))
+
+
+def check_aggregates(lib, log):
+    lines = b'600000 60 1 9 5 2\n1200000 60 2 8 5 1\n' + b'1 ' * 80 + b'\n1800000 60 3 7 5 0\n1800000 6'
+    log.write('agg', lines)
+    capacity = lib.get_aggregates_count(SENSOR)
+    records = (AggregateRecord * (capacity + 1))()
+    records[capacity].count = -1
+    read = lib.get_aggregates(SENSOR, records, capacity)
+    log.remove('agg')
+    if capacity != 4 or read > capacity or records[capacity].count != -1 or records[read - 1].start != 1800000:
+        sys.exit('get_aggregates read %d records with room for %d' % (read, capacity))
+
+
+def bench(log, args):
+    rng = random.Random(args.seed)
+    log.fill(args.readouts)
+    size = os.path.getsize(log.path('txt'))
+    index = log.read('idx')
+    starts = [rng.randrange(args.readouts) * STEP_MS for _ in range(args.queries)]
+
+    results = []
+    for name in ('index', 'scan'):
+        if name == 'scan':
+            log.remove('idx')
+        read = 0
+        began = time.perf_counter()
+        for t0 in starts:
+            readouts, bytes_read = log.query(t0, t0 + 10 * STEP_MS)
+            read += bytes_read
+            if not readouts or readouts[0][0] != t0:
+                sys.exit('%s query at %d returned %s' % (name, t0, readouts[:1]))
+        results.append((name, read / float(args.queries), (time.perf_counter() - began) * 1e6 / args.queries))
+    log.write('idx', index)
+
+    print('%d readouts, %d bytes of log, %d bytes of index, %d queries of 11 readouts' % (
+        args.readouts, size, len(index), args.queries))
+    print('%-6s %12s %10s' % ('', 'bytes read', 'us/query'))
+    for name, bytes_read, micros in results:
+        print('%-6s %12.0f %10.1f' % (name, bytes_read, micros))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--readouts', type=int, default=20000, help='readouts in the benchmarked log')
+    parser.add_argument('--queries', type=int, default=500)
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    base = tempfile.mkdtemp()
+    try:
+        lib = build('storage', ['storage.c'], ['STORAGE_BASE_PATH="%s"' % base], host=True)
+        log = Log(lib, base)
+        check_recovery(lib, log)
+        check_bad_index(lib, log)
+        check_expiry(lib, log)
+        check_aggregates(lib, log)
+        bench(log, args)
+    finally:
+        shutil.rmtree(base)
+
+
+if __name__ == '__main__':
+    main()
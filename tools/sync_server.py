@@ -0,0 +1,166 @@
+#!/usr/bin/env python
+"""Local stand-in for the Buratino server, for trying out sync slots.
+
+Usage: sync_server.py [--port 8080] [--period 600] [--capacity 50] [--config JSON]
+
+Accepts readout, aggregate and telemetry uploads at
+/api/v1/devices/<uuid>/... and answers each with a sync slot (see
+main/sync_slot.h). Devices are spread evenly over the period. Once more
+than --capacity uploads are in flight, new ones get 503 with a
+retry_after hint. With --config, accepted uploads also carry that
+settings delta (see main/remote_config.h). Firmware update checks get
+204.
+Point WEB_SERVER and WEB_PORT in main/upload.h at this host to use it.
+"""
+import argparse
+import json
+import re
+import sys
+import threading
+
+try:
+    from http.server import BaseHTTPRequestHandler, HTTPServer
+    from socketserver import ThreadingMixIn
+except ImportError:
+    from BaseHTTPServer import BaseHTTPRequestHandler, HTTPServer
+    from SocketServer import ThreadingMixIn
+
+ABSOLUTE_URI = re.compile(r'^https?://[^/]*')
+UPLOAD_PATH = re.compile(r'^/api/v1/devices/([0-9a-f-]{36})/(readouts|aggregates|telemetry)$')
+FIRMWARE_PATH = re.compile(r'^/api/v1/devices/([0-9a-f-]{36})/firmware(\?.*)?$')
+BUCKET = 10             # seconds, resolution of slot offsets
+RETRY_AFTER = 60        # minimal wait asked of a rejected device
+
+
+class SlotAssigner(object):
+    """Gives every device a fixed offset within the period, always in the
+    least loaded bucket so far"""
+
+    def __init__(self, period, bucket=BUCKET):
+        self.period = period
+        self.bucket = bucket
+        self.load = [0] * max(1, period // bucket)
+        self.slots = {}
+        self.lock = threading.Lock()
+
+    def assign(self, device_id):
+        with self.lock:
+            if device_id not in self.slots:
+                index = min(range(len(self.load)), key=lambda i: self.load[i])
+                self.load[index] += 1
+                self.slots[device_id] = index * self.bucket
+            return {'period': self.period, 'offset': self.slots[device_id]}
+
+
+class Gate(object):
+    """Counts uploads in flight, refusing those over capacity"""
+
+    def __init__(self, capacity):
+        self.capacity = capacity
+        self.active = 0
+        self.peak = 0
+        self.lock = threading.Lock()
+
+    def enter(self):
+        with self.lock:
+            if self.active >= self.capacity:
+                return False
+            self.active += 1
+            self.peak = max(self.peak, self.active)
+            return True
+
+    def leave(self):
+        with self.lock:
+            self.active -= 1
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.0'
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            BaseHTTPRequestHandler.log_message(self, fmt, *args)
+
+    def reply(self, status, body=None):
+        data = json.dumps(body).encode() if body is not None else b''
+        self.send_response(status)
+        if body is not None:
+            self.send_header('Content-Type', 'application/json')
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def resource(self):
+        # the firmware puts the absolute URI into the request line
+        return ABSOLUTE_URI.sub('', self.path)
+
+    def do_GET(self):
+        if FIRMWARE_PATH.match(self.resource()):
+            self.reply(204)
+        else:
+            self.reply(404, {'error': 'not found'})
+
+    def do_POST(self):
+        match = UPLOAD_PATH.match(self.resource())
+        body = self.rfile.read(int(self.headers.get('Content-Length', 0)))
+        if not match:
+            self.reply(404, {'error': 'not found'})
+            return
+
+        slot = self.server.slots.assign(match.group(1))
+        if not self.server.gate.enter():
+            self.reply(503, {'sync_slot': slot, 'retry_after': RETRY_AFTER})
+            return
+        try:
+            records = json.loads(body.decode('utf-8'))
+            self.server.handle_records(match.group(1), match.group(2), records)
+            reply = {'sync_slot': slot}
+            if self.server.config is not None:
+                reply['config'] = self.server.config
+            self.reply(201, reply)
+        except (ValueError, UnicodeDecodeError):
+            self.reply(400, {'error': 'malformed body'})
+        finally:
+            self.server.gate.leave()
+
+
+class SyncServer(ThreadingMixIn, HTTPServer):
+    daemon_threads = True
+    request_queue_size = 1024   # a fleet connects in bursts
+
+    def __init__(self, address, period, capacity, verbose=False, config=None):
+        HTTPServer.__init__(self, address, Handler)
+        self.config = config
+        self.slots = SlotAssigner(period)
+        self.gate = Gate(capacity)
+        self.verbose = verbose
+        self.received = 0
+        self.lock = threading.Lock()
+
+    def handle_records(self, device_id, resource, records):
+        if resource == 'telemetry':
+            sys.stderr.write('%s telemetry: %s\n' % (device_id, json.dumps(records, sort_keys=True)))
+            return
+        with self.lock:
+            self.received += len(records)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--port', type=int, default=8080)
+    parser.add_argument('--period', type=int, default=600, help='sync period assigned to devices, s')
+    parser.add_argument('--capacity', type=int, default=50, help='uploads served at once')
+    parser.add_argument('--config', type=json.loads, help='settings delta pushed to devices, e.g. \'{"v": 2, "sleep": 60}\'')
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    server = SyncServer(('', args.port), args.period, args.capacity, args.verbose, args.config)
+    sys.stderr.write('Listening on port %d\n' % args.port)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        sys.stderr.write('%d records received, peak %d uploads at once\n' % (server.received, server.gate.peak))
+
+
+if __name__ == '__main__':
+    main()